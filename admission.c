@@ -0,0 +1,270 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "admission.h"
+#include "simple_stream_server.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "async_log.h"
+
+#define SLOT_MASK (ADMISSION_SHARD_SLOTS - 1)
+#define SHARD_MAX_USED (ADMISSION_SHARD_SLOTS / 4 * 3) // keeps the probe sequences short
+
+/*
+ * IpEntry:
+ * State of one client address. The bucket is kept in byte-milliseconds
+ * (bytes * 1000), so refilling 'rate' bytes per second adds exactly
+ * 'rate' per elapsed millisecond.
+ */
+typedef struct IpEntry {
+    in_addr_t addr;       // network byte order, 0 = free slot (INADDR_ANY never connects)
+    uint32_t conns;       // connections open from this address
+    int64_t credit;       // bucket content in byte-milliseconds, negative while in debt
+    uint64_t stamp_ms;    // timer_now_ms() of the last refill
+} IpEntry;
+
+typedef struct Shard {
+    pthread_mutex_t mutex;
+    unsigned used;
+    IpEntry slots[ADMISSION_SHARD_SLOTS];
+} Shard;
+
+static Shard *shards;            // NULL when no per-address limit is configured
+static atomic_int open_conns;    // connections admitted and not released yet
+static int64_t credit_max;       // full bucket, ip_burst in byte-milliseconds
+
+/* murmur3 finalizer: addresses of one subnet differ in a single byte */
+static uint32_t hash_addr(in_addr_t addr) {
+    uint32_t h = addr;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static Shard *shard_of(in_addr_t addr) {
+    return &shards[hash_addr(addr) % ADMISSION_SHARDS];
+}
+
+static unsigned home_slot(in_addr_t addr) {
+    return (hash_addr(addr) / ADMISSION_SHARDS) & SLOT_MASK;
+}
+
+static void refill(IpEntry *entry, uint64_t now) {
+    uint64_t rate = server_config.ip_rate;
+    if (rate == 0 || entry->credit >= credit_max) {
+        entry->stamp_ms = now;
+        return;
+    }
+
+    uint64_t gap = (uint64_t)(credit_max - entry->credit);
+    uint64_t elapsed = now - entry->stamp_ms;
+    if (elapsed >= gap / rate + 1) {
+        entry->credit = credit_max;
+    } else {
+        entry->credit += (int64_t)(elapsed * rate);
+        if (entry->credit > credit_max) entry->credit = credit_max;
+    }
+    entry->stamp_ms = now;
+}
+
+/* An address without connections and with a full bucket has no state worth keeping */
+static int reclaimable(IpEntry *entry, uint64_t now) {
+    if (entry->conns > 0) return 0;
+    refill(entry, now);
+    return entry->credit >= credit_max;
+}
+
+/*
+ * remove_slot:
+ * Frees slot 'i' with backward-shift deletion: the entries following it
+ * in the probe sequence move back, so lookups need no tombstones.
+ */
+static void remove_slot(Shard *shard, unsigned i) {
+    unsigned j = i;
+    while (1) {
+        j = (j + 1) & SLOT_MASK;
+        if (shard->slots[j].addr == 0) break;
+
+        /* The entry at 'j' may fill the hole unless its home slot lies cyclically in (i, j] */
+        unsigned k = home_slot(shard->slots[j].addr);
+        int stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            shard->slots[i] = shard->slots[j];
+            i = j;
+        }
+    }
+    shard->slots[i].addr = 0;
+    shard->used--;
+}
+
+/* Drops every reclaimable address of a shard that is filling up */
+static void sweep(Shard *shard, uint64_t now) {
+    unsigned i = 0;
+    while (i < ADMISSION_SHARD_SLOTS) {
+        IpEntry *entry = &shard->slots[i];
+        if (entry->addr != 0 && reclaimable(entry, now)) {
+            remove_slot(shard, i); // another entry may have moved to 'i', check it again
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * lookup:
+ * Finds the entry of 'addr' in its (locked) shard, or adds it with a
+ * full bucket when 'create' is set.
+ * Returns NULL when not found, or when the shard is full.
+ */
+static IpEntry *lookup(Shard *shard, in_addr_t addr, int create, uint64_t now) {
+    unsigned i = home_slot(addr);
+    while (shard->slots[i].addr != 0) {
+        if (shard->slots[i].addr == addr) return &shard->slots[i];
+        i = (i + 1) & SLOT_MASK;
+    }
+    if (!create) return NULL;
+
+    if (shard->used >= SHARD_MAX_USED) {
+        sweep(shard, now);
+        if (shard->used >= SHARD_MAX_USED) return NULL;
+
+        /* The sweep moved entries around, the free slot may be another one */
+        i = home_slot(addr);
+        while (shard->slots[i].addr != 0) i = (i + 1) & SLOT_MASK;
+    }
+
+    IpEntry *entry = &shard->slots[i];
+    entry->addr = addr;
+    entry->conns = 0;
+    entry->credit = credit_max;
+    entry->stamp_ms = now;
+    shard->used++;
+    return entry;
+}
+
+/*
+ * admission_init:
+ * Allocates the address table when a per-address limit is configured.
+ * Returns 0 on success, or -1 on error.
+ */
+int admission_init(void) {
+    atomic_store(&open_conns, 0);
+    if (server_config.max_conns_per_ip == 0 && server_config.ip_rate == 0) {
+        return 0;
+    }
+
+    size_t burst = server_config.ip_burst ? server_config.ip_burst : server_config.ip_rate;
+    credit_max = (int64_t)burst * 1000;
+
+    shards = calloc(ADMISSION_SHARDS, sizeof(Shard));
+    if (!shards) {
+        log_msg(LOG_ERR, "admission table calloc: %s", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < ADMISSION_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+    return 0;
+}
+
+/* Frees the address table, once no connection is left */
+void admission_destroy(void) {
+    if (!shards) return;
+    for (int i = 0; i < ADMISSION_SHARDS; i++) {
+        pthread_mutex_destroy(&shards[i].mutex);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+/*
+ * admission_acquire:
+ * Called for every accepted connection before anything is allocated for
+ * it. Counts the refusals in the metrics.
+ * Returns 0 if the connection is admitted (admission_release() must be
+ * called when it is closed), or -1 if it has to be closed right away.
+ */
+int admission_acquire(in_addr_t addr) {
+    int open = atomic_fetch_add(&open_conns, 1) + 1;
+    if (server_config.max_conns > 0 && open > server_config.max_conns) {
+        atomic_fetch_sub(&open_conns, 1);
+        metrics_add(METRIC_REJECTED_MAX_CONNS, 1);
+        return -1;
+    }
+    if (!shards || addr == 0) return 0;
+
+    MetricCounter rejected = METRIC_COUNTER_COUNT;
+    Shard *shard = shard_of(addr);
+    pthread_mutex_lock(&shard->mutex);
+    IpEntry *entry = lookup(shard, addr, 1, timer_now_ms());
+    if (!entry) {
+        rejected = METRIC_REJECTED_IP_TABLE_FULL;
+    } else if (server_config.max_conns_per_ip > 0 && entry->conns >= (uint32_t)server_config.max_conns_per_ip) {
+        rejected = METRIC_REJECTED_PER_IP;
+    } else {
+        entry->conns++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (rejected != METRIC_COUNTER_COUNT) {
+        atomic_fetch_sub(&open_conns, 1);
+        metrics_add(rejected, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/* Called when a connection admitted by admission_acquire() is closed */
+void admission_release(in_addr_t addr) {
+    atomic_fetch_sub(&open_conns, 1);
+    if (!shards || addr == 0) return;
+
+    Shard *shard = shard_of(addr);
+    pthread_mutex_lock(&shard->mutex);
+    uint64_t now = timer_now_ms();
+    IpEntry *entry = lookup(shard, addr, 0, now);
+    if (entry) {
+        if (entry->conns > 0) entry->conns--;
+        if (reclaimable(entry, now)) remove_slot(shard, entry - shard->slots);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Connections admitted and not released yet, whichever the I/O mode */
+int admission_open_count(void) {
+    return atomic_load(&open_conns);
+}
+
+/*
+ * admission_consume:
+ * Takes 'bytes' just received from 'addr' out of its bucket.
+ * Returns how many milliseconds the connection must wait before reading
+ * again (0 when the bucket was not overdrawn).
+ */
+uint64_t admission_consume(in_addr_t addr, size_t bytes) {
+    if (!shards || addr == 0 || server_config.ip_rate == 0) return 0;
+
+    uint64_t delay_ms = 0;
+    Shard *shard = shard_of(addr);
+    pthread_mutex_lock(&shard->mutex);
+    uint64_t now = timer_now_ms();
+    IpEntry *entry = lookup(shard, addr, 0, now);
+    if (entry) {
+        refill(entry, now);
+        entry->credit -= (int64_t)bytes * 1000;
+        if (entry->credit < 0) {
+            delay_ms = ((uint64_t)-entry->credit + server_config.ip_rate - 1) / server_config.ip_rate;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (delay_ms > 0) metrics_add(METRIC_RECV_THROTTLED, 1);
+    return delay_ms;
+}
@@ -0,0 +1,36 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define ADMISSION_SHARDS 16          // independently locked parts of the address table
+#define ADMISSION_SHARD_SLOTS 1024   // addresses tracked per shard (power of two)
+
+/*
+ * Admission control, configured with server_config.max_conns,
+ * max_conns_per_ip, ip_rate and ip_burst (0 = no limit):
+ *
+ * - a connection is accepted only while fewer than max_conns are open,
+ *   and fewer than max_conns_per_ip are open from the same address;
+ * - the bytes received from each address go through a token bucket of
+ *   ip_burst bytes refilled at ip_rate bytes per second. A connection
+ *   that overdraws it stops reading until the debt is paid back.
+ *
+ * Addresses are tracked in an open-addressing hash table keyed on the
+ * binary IPv4 address, split in shards with a mutex each. An address is
+ * dropped once it has no open connection and a full bucket, so the table
+ * only holds the active clients. Refused connections are counted in the
+ * metrics by reason.
+ */
+int admission_init(void);
+void admission_destroy(void);
+
+int admission_acquire(in_addr_t addr);
+void admission_release(in_addr_t addr);
+int admission_open_count(void);
+
+uint64_t admission_consume(in_addr_t addr, size_t bytes);
+
+#endif /* ADMISSION_H */
@@ -0,0 +1,333 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "append_writer.h"
+#include "data_store.h"
+#include "record_cache.h"
+#include "data_sync.h"
+#include "metrics.h"
+#include "recv_buffer.h"
+#include "async_log.h"
+
+#define WRITER_WAIT_MS 1000   // condition waits time out to re-check for shutdown
+
+/*
+ * AppendRecord:
+ * One complete record queued for the writer. 'data' is owned by the
+ * record once submitted and returned to the buffer pool after it was written.
+ */
+typedef struct AppendRecord {
+    char *data;
+    size_t len;
+    uint64_t seq;
+    uint64_t submit_ns;   // metrics_now_ns() when queued, for the append latency histograms
+    struct AppendRecord *next;
+} AppendRecord;
+
+static pthread_t writer_thread;
+static int writer_started = 0;
+static int writer_stopping = 0;   // set by append_writer_stop(), writer drains the queue and exits
+static int writer_stopped = 0;    // writer thread has exited, nothing else will be committed
+
+/* FIFO of records not yet written, protected by writer_mutex */
+static AppendRecord *queue_head = NULL;
+static AppendRecord *queue_tail = NULL;
+static uint64_t next_seq = 1;
+
+/* Commit progress, protected by writer_mutex */
+static uint64_t committed_seq = 0;
+static uint64_t failed_from = 1, failed_to = 0;  // sequence range of the last failed batch
+
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_committed = PTHREAD_COND_INITIALIZER;
+
+/* eventfds written after each commit, so event loops can resume waiting connections */
+static int listeners[APPEND_WRITER_MAX_LISTENERS];
+static int listener_count = 0;
+
+static void wait_deadline(struct timespec *ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += WRITER_WAIT_MS / 1000;
+    ts->tv_nsec += (WRITER_WAIT_MS % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * write_batch:
+ * Appends every record of the batch, in order, through data_store_append()
+ * (one writev() per IOV_MAX records), then adds it to the record cache
+ * and hands it to data_sync (synced here in sync durability mode).
+ * The iovec array is kept between batches and only grows, so steady
+ * state batches don't allocate.
+ * Returns 0 on success, or -1 on error.
+ */
+static int write_batch(AppendRecord *batch, size_t count) {
+    static struct iovec *iov = NULL;
+    static size_t iov_cap = 0;
+
+    if (count > iov_cap) {
+        struct iovec *new_iov = realloc(iov, count * sizeof(struct iovec));
+        if (!new_iov) {
+            log_msg(LOG_ERR, "realloc (append_writer iovec): %s", strerror(errno));
+            return -1;
+        }
+        iov = new_iov;
+        iov_cap = count;
+    }
+
+    int iovcnt = 0;
+    for (AppendRecord *rec = batch; rec; rec = rec->next) {
+        iov[iovcnt].iov_base = rec->data;
+        iov[iovcnt].iov_len = rec->len;
+        iovcnt++;
+    }
+
+    if (data_store_append(iov, iovcnt) < 0) {
+        return -1;
+    }
+
+    /* The batch is in the file, make it available to readers from memory */
+    size_t bytes = 0;
+    for (AppendRecord *rec = batch; rec; rec = rec->next) {
+        record_cache_append(rec->data, rec->len);
+        bytes += rec->len;
+    }
+
+    /* A batch that can't be made durable fails, its records are not answered */
+    return data_sync_appended(bytes);
+}
+
+static void notify_listeners(void) {
+    uint64_t one = 1;
+    for (int i = 0; i < listener_count; i++) {
+        if (write(listeners[i], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            log_msg(LOG_ERR, "write (append_writer listener): %s", strerror(errno));
+        }
+    }
+}
+
+/*
+ * writer_thread_func:
+ * Takes everything queued so far as one batch, writes it, then publishes
+ * the last sequence number of the batch as committed.
+ */
+static void *writer_thread_func(void *arg) {
+    (void)arg; // quiet unused variable warning
+    metrics_thread_init();
+
+    while (1) {
+        pthread_mutex_lock(&writer_mutex);
+        while (queue_head == NULL && !writer_stopping) {
+            struct timespec ts;
+            wait_deadline(&ts);
+            pthread_cond_timedwait(&writer_not_empty, &writer_mutex, &ts);
+        }
+        if (queue_head == NULL && writer_stopping) {
+            pthread_mutex_unlock(&writer_mutex);
+            break;
+        }
+        AppendRecord *batch = queue_head;
+        uint64_t first_seq = queue_head->seq;
+        uint64_t last_seq = queue_tail->seq;
+        queue_head = queue_tail = NULL;
+        pthread_mutex_unlock(&writer_mutex);
+
+        uint64_t taken_ns = metrics_now_ns();
+        for (AppendRecord *rec = batch; rec; rec = rec->next) {
+            metrics_observe(METRIC_APPEND_QUEUE, taken_ns - rec->submit_ns);
+        }
+
+        int rc = write_batch(batch, last_seq - first_seq + 1);
+
+        pthread_mutex_lock(&writer_mutex);
+        if (rc != 0) {
+            failed_from = first_seq;
+            failed_to = last_seq;
+        }
+        committed_seq = last_seq;
+        pthread_cond_broadcast(&writer_committed);
+        notify_listeners();
+        pthread_mutex_unlock(&writer_mutex);
+
+        uint64_t done_ns = metrics_now_ns();
+        metrics_add(METRIC_APPEND_BATCHES, 1);
+        metrics_add(rc == 0 ? METRIC_RECORDS_APPENDED : METRIC_APPEND_FAILURES, last_seq - first_seq + 1);
+
+        while (batch) {
+            if (rc == 0) metrics_observe(METRIC_APPEND_LATENCY, done_ns - batch->submit_ns);
+            AppendRecord *next = batch->next;
+            buffer_pool_free(batch->data);
+            free(batch);
+            batch = next;
+        }
+    }
+
+    pthread_mutex_lock(&writer_mutex);
+    writer_stopped = 1;
+    pthread_cond_broadcast(&writer_committed);
+    notify_listeners();
+    pthread_mutex_unlock(&writer_mutex);
+
+    log_msg(LOG_INFO, "Exiting append writer thread, tid: %lu", pthread_self());
+    return NULL;
+}
+
+/*
+ * append_writer_start:
+ * Creates the writer thread, and the flusher thread in periodic
+ * durability mode.
+ * Returns 0 on success, or -1 on error.
+ */
+int append_writer_start(void) {
+    if (data_sync_start() < 0) {
+        return -1;
+    }
+
+    int rc = pthread_create(&writer_thread, NULL, writer_thread_func, NULL);
+    if (rc != 0) {
+        log_msg(LOG_ERR, "pthread_create (append_writer): %s", strerror(rc));
+        data_sync_stop();
+        return -1;
+    }
+    writer_started = 1;
+    return 0;
+}
+
+/*
+ * append_writer_stop:
+ * Lets the writer flush what is still queued, then joins it and stops
+ * data_sync.
+ * Call after every thread that submits records has been joined.
+ */
+void append_writer_stop(void) {
+    if (!writer_started) return;
+
+    pthread_mutex_lock(&writer_mutex);
+    writer_stopping = 1;
+    pthread_cond_signal(&writer_not_empty);
+    pthread_mutex_unlock(&writer_mutex);
+
+    pthread_join(writer_thread, NULL);
+    writer_started = 0;
+
+    /* Everything is written, sync what the flusher didn't yet */
+    data_sync_stop();
+}
+
+/*
+ * append_writer_submit:
+ * Queues a complete record. Ownership of 'data' (allocated with
+ * buffer_pool_alloc()) passes to the writer, also on failure.
+ * Returns the record sequence number, or 0 if the writer is stopped.
+ */
+uint64_t append_writer_submit(char *data, size_t len) {
+    AppendRecord *rec = (AppendRecord *)malloc(sizeof(AppendRecord));
+    if (!rec) {
+        log_msg(LOG_ERR, "AppendRecord malloc: %s", strerror(errno));
+        buffer_pool_free(data);
+        return 0;
+    }
+    rec->data = data;
+    rec->len = len;
+    rec->submit_ns = metrics_now_ns();
+    rec->next = NULL;
+
+    pthread_mutex_lock(&writer_mutex);
+    if (writer_stopping || writer_stopped) {
+        pthread_mutex_unlock(&writer_mutex);
+        buffer_pool_free(data);
+        free(rec);
+        return 0;
+    }
+    uint64_t seq = next_seq++;
+    rec->seq = seq;
+    if (queue_tail) queue_tail->next = rec;
+    else queue_head = rec;
+    queue_tail = rec;
+    pthread_cond_signal(&writer_not_empty);
+    pthread_mutex_unlock(&writer_mutex);
+
+    /* 'rec' may already be written and freed by the writer here */
+    return seq;
+}
+
+/* Commit state of record 'seq', called with writer_mutex held */
+static int record_status(uint64_t seq) {
+    if (committed_seq < seq) {
+        return writer_stopped ? -1 : 1;
+    }
+    return (seq >= failed_from && seq <= failed_to) ? -1 : 0;
+}
+
+/*
+ * append_writer_wait:
+ * Blocks until the record with sequence number 'seq' was written.
+ * Returns 0 on success, or -1 if its write failed or the writer stopped first.
+ */
+int append_writer_wait(uint64_t seq) {
+    int ret;
+
+    pthread_mutex_lock(&writer_mutex);
+    while ((ret = record_status(seq)) == 1) {
+        struct timespec ts;
+        wait_deadline(&ts);
+        pthread_cond_timedwait(&writer_committed, &writer_mutex, &ts);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+
+    return ret;
+}
+
+/*
+ * append_writer_poll:
+ * Non-blocking version of append_writer_wait(), for event loops.
+ * Returns 0 if record 'seq' was written, 1 if it is still pending,
+ * or -1 if its write failed or the writer stopped first.
+ */
+int append_writer_poll(uint64_t seq) {
+    pthread_mutex_lock(&writer_mutex);
+    int ret = record_status(seq);
+    pthread_mutex_unlock(&writer_mutex);
+    return ret;
+}
+
+/*
+ * append_writer_add_listener:
+ * Registers an eventfd that is written after every commit.
+ * Returns 0 on success, or -1 if there are too many listeners.
+ */
+int append_writer_add_listener(int event_fd) {
+    int ret = -1;
+    pthread_mutex_lock(&writer_mutex);
+    if (listener_count < APPEND_WRITER_MAX_LISTENERS) {
+        listeners[listener_count++] = event_fd;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&writer_mutex);
+    if (ret < 0) {
+        log_msg(LOG_ERR, "append_writer_add_listener: too many listeners");
+    }
+    return ret;
+}
+
+void append_writer_remove_listener(int event_fd) {
+    pthread_mutex_lock(&writer_mutex);
+    for (int i = 0; i < listener_count; i++) {
+        if (listeners[i] == event_fd) {
+            listeners[i] = listeners[--listener_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&writer_mutex);
+}
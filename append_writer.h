@@ -0,0 +1,30 @@
+#ifndef APPEND_WRITER_H
+#define APPEND_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define APPEND_WRITER_MAX_LISTENERS 64 // event loops that can be notified of commits
+
+/*
+ * The append writer is the only thread writing DATA_FILE_PATH.
+ * Connections hand it complete newline-terminated records; it appends
+ * everything queued since its last write with a single writev() (group
+ * commit), so records never interleave and no lock is held across
+ * network I/O.
+ *
+ * Each submitted record gets a sequence number, used to wait (threads) or
+ * poll (event loops, woken through a listener eventfd) until it is in the file
+ * (and on disk, with sync durability, see data_sync.h).
+ */
+int append_writer_start(void);
+void append_writer_stop(void);
+
+uint64_t append_writer_submit(char *data, size_t len);
+int append_writer_wait(uint64_t seq);
+int append_writer_poll(uint64_t seq);
+
+int append_writer_add_listener(int event_fd);
+void append_writer_remove_listener(int event_fd);
+
+#endif /* APPEND_WRITER_H */
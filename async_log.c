@@ -0,0 +1,308 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "async_log.h"
+#include "simple_stream_server.h"
+
+#define LOG_DRAIN_MS 100         // the logger drains at least this often
+#define LOG_REPORT_MS 1000       // lost messages are reported at most this often
+
+typedef struct LogSlot {
+    int priority;
+    char msg[LOG_MSG_MAX];
+} LogSlot;
+
+/*
+ * LogRing:
+ * Single-producer/single-consumer ring of one thread's messages. The
+ * owning thread writes slots and publishes them by moving 'tail', the
+ * logger thread syslog()s them and moves 'head'.
+ */
+typedef struct LogRing {
+    _Alignas(64) _Atomic unsigned tail;  // written by the owning thread
+    _Alignas(64) _Atomic unsigned head;  // written by the logger
+
+    /* Owning thread only */
+    uint64_t tokens_ms;          // rate limit: token bucket, in 1/1000 message
+    uint64_t last_ms;
+    _Atomic uint64_t dropped;    // ring full
+    _Atomic uint64_t suppressed; // over the rate limit
+
+    /* Logger only */
+    uint64_t reported_dropped;
+    uint64_t reported_suppressed;
+
+    atomic_int orphaned;         // the owning thread exited, freed once drained
+    struct LogRing *next;        // 'rings' list, see ring_unlink()
+
+    LogSlot slots[LOG_RING_SLOTS];
+} LogRing;
+
+static __thread LogRing *local_ring = NULL;
+
+/* Every thread's ring. Threads push at the head (CAS), only the logger unlinks */
+static _Atomic(LogRing *) rings = NULL;
+
+static atomic_int log_level = LOG_INFO;
+static atomic_int logger_running = 0;
+
+static pthread_t logger_thread;
+static int logger_stopping = 0;          // protected by logger_mutex
+static pthread_mutex_t logger_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logger_wakeup = PTHREAD_COND_INITIALIZER;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: the logger frees the ring after draining it */
+static void ring_orphan(void *arg) {
+    LogRing *ring = arg;
+    atomic_store_explicit(&ring->orphaned, 1, memory_order_release);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, ring_orphan);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static LogRing *thread_ring(void) {
+    if (local_ring) return local_ring;
+
+    pthread_once(&ring_key_once, create_ring_key);
+
+    void *mem;
+    if (posix_memalign(&mem, 64, sizeof(LogRing)) != 0) {
+        return NULL;
+    }
+    LogRing *ring = mem;
+    memset(ring, 0, sizeof(*ring));
+    ring->last_ms = now_ms();
+    ring->tokens_ms = (uint64_t)server_config.log_rate * 1000;
+
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+/*
+ * rate_allow:
+ * Token bucket of server_config.log_rate messages per second, holding at
+ * most one second worth of messages.
+ * Returns 1 if the message may be logged.
+ */
+static int rate_allow(LogRing *ring) {
+    if (server_config.log_rate <= 0) return 1;
+
+    uint64_t capacity = (uint64_t)server_config.log_rate * 1000;
+    uint64_t now = now_ms();
+    ring->tokens_ms += (now - ring->last_ms) * server_config.log_rate;
+    if (ring->tokens_ms > capacity) ring->tokens_ms = capacity;
+    ring->last_ms = now;
+
+    if (ring->tokens_ms < 1000) return 0;
+    ring->tokens_ms -= 1000;
+    return 1;
+}
+
+static inline void bump(_Atomic uint64_t *value) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/*
+ * log_msg:
+ * syslog() replacement, see async_log.h. Never blocks: a message that
+ * doesn't fit in the thread's ring is dropped.
+ */
+void log_msg(int priority, const char *fmt, ...) {
+    if (LOG_PRI(priority) > atomic_load_explicit(&log_level, memory_order_relaxed)) return;
+
+    va_list ap;
+    LogRing *ring = atomic_load_explicit(&logger_running, memory_order_acquire) ? thread_ring() : NULL;
+    if (!ring) {
+        va_start(ap, fmt);
+        vsyslog(priority, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    if (!rate_allow(ring)) {
+        bump(&ring->suppressed);
+        return;
+    }
+
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= LOG_RING_SLOTS) {
+        bump(&ring->dropped);
+        return;
+    }
+
+    LogSlot *slot = &ring->slots[tail % LOG_RING_SLOTS];
+    slot->priority = priority;
+    va_start(ap, fmt);
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    /* Wake the logger early when the ring is half full, otherwise it drains on its own */
+    if (tail + 1 - head == LOG_RING_SLOTS / 2) {
+        pthread_cond_signal(&logger_wakeup);
+    }
+}
+
+/* Removes a drained orphan ring from 'rings', logger thread only */
+static void ring_unlink(LogRing *ring) {
+    LogRing *expected = ring;
+    if (atomic_compare_exchange_strong(&rings, &expected, ring->next)) return;
+
+    /* Not the head any more (threads pushed meanwhile), only the logger changes 'next' links */
+    LogRing *prev = atomic_load(&rings);
+    while (prev->next != ring) prev = prev->next;
+    prev->next = ring->next;
+}
+
+/* Messages lost since the last report, logger only */
+static uint64_t lost_dropped = 0;
+static uint64_t lost_suppressed = 0;
+static uint64_t last_report_ms = 0;
+
+/* syslog()s the messages of one ring and collects what it lost since the last drain */
+static void drain_ring(LogRing *ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while (head != tail) {
+        LogSlot *slot = &ring->slots[head % LOG_RING_SLOTS];
+        syslog(slot->priority, "%s", slot->msg);
+        head++;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+
+    uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    uint64_t suppressed = atomic_load_explicit(&ring->suppressed, memory_order_relaxed);
+    lost_dropped += dropped - ring->reported_dropped;
+    lost_suppressed += suppressed - ring->reported_suppressed;
+    ring->reported_dropped = dropped;
+    ring->reported_suppressed = suppressed;
+}
+
+/* Drains every ring, frees those of exited threads and reports lost messages ('force': now) */
+static void drain_all(int force) {
+    LogRing *ring = atomic_load_explicit(&rings, memory_order_acquire);
+    while (ring) {
+        LogRing *next = ring->next;
+        /* Checked before draining, so nothing written before the thread exited is missed */
+        int orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+        drain_ring(ring);
+        if (orphaned) {
+            ring_unlink(ring);
+            free(ring);
+        }
+        ring = next;
+    }
+
+    uint64_t now = now_ms();
+    if ((lost_dropped || lost_suppressed) && (force || now - last_report_ms >= LOG_REPORT_MS)) {
+        syslog(LOG_WARNING, "%llu log messages dropped (buffer full), %llu suppressed (rate limit)",
+               (unsigned long long)lost_dropped, (unsigned long long)lost_suppressed);
+        lost_dropped = lost_suppressed = 0;
+        last_report_ms = now;
+    }
+}
+
+static void wait_deadline(struct timespec *ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += LOG_DRAIN_MS * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void *logger_thread_func(void *arg) {
+    (void)arg; // quiet unused variable warning
+
+    /* Signal handlers stop the server and join this thread, they must run elsewhere */
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&logger_mutex);
+    while (!logger_stopping) {
+        pthread_mutex_unlock(&logger_mutex);
+        drain_all(0);
+        pthread_mutex_lock(&logger_mutex);
+
+        struct timespec ts;
+        wait_deadline(&ts);
+        if (!logger_stopping) {
+            pthread_cond_timedwait(&logger_wakeup, &logger_mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&logger_mutex);
+
+    drain_all(1);
+    return NULL;
+}
+
+/*
+ * async_log_start:
+ * Creates the logger thread, log_msg() buffers messages from now on.
+ * Returns 0 on success, or -1 on error (log_msg() keeps calling syslog()).
+ */
+int async_log_start(void) {
+    async_log_set_level(server_config.log_level);
+
+    int rc = pthread_create(&logger_thread, NULL, logger_thread_func, NULL);
+    if (rc != 0) {
+        syslog(LOG_ERR, "pthread_create (logger): %s", strerror(rc));
+        return -1;
+    }
+    atomic_store_explicit(&logger_running, 1, memory_order_release);
+    return 0;
+}
+
+/*
+ * async_log_stop:
+ * Drains every buffered message and joins the logger thread. Call once
+ * every other thread was joined; log_msg() calls syslog() afterwards.
+ */
+void async_log_stop(void) {
+    if (!atomic_exchange(&logger_running, 0)) return;
+
+    pthread_mutex_lock(&logger_mutex);
+    logger_stopping = 1;
+    pthread_cond_signal(&logger_wakeup);
+    pthread_mutex_unlock(&logger_mutex);
+
+    pthread_join(logger_thread, NULL);
+}
+
+void async_log_set_level(int level) {
+    if (level < LOG_EMERG) level = LOG_EMERG;
+    if (level > LOG_DEBUG) level = LOG_DEBUG;
+    atomic_store(&log_level, level);
+}
+
+/* Async-signal-safe, used by the SIGUSR1/SIGUSR2 handlers */
+void async_log_adjust_level(int delta) {
+    async_log_set_level(atomic_load(&log_level) + delta);
+}
@@ -0,0 +1,35 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <syslog.h>
+
+#define LOG_RING_SLOTS 64        // messages buffered per thread before new ones are dropped
+#define LOG_MSG_MAX 248          // longer messages are truncated
+#define DEFAULT_LOG_RATE 1000    // messages per second and thread, 0 = unlimited
+
+/*
+ * Asynchronous logging. log_msg() formats the message into a ring of
+ * the calling thread and returns; a logger thread drains every ring to
+ * syslog(). A caller never blocks on the syslog socket, and never takes
+ * a lock once its ring exists, so logging is safe inside critical
+ * sections and on the connection hot path.
+ *
+ * Messages above the current level are discarded before formatting. The
+ * level starts at server_config.log_level and can be changed at runtime
+ * (SIGUSR1 logs more, SIGUSR2 logs less). Each thread may log at most
+ * server_config.log_rate messages per second; messages over the limit,
+ * or that find the ring full, are counted and reported by the logger.
+ *
+ * Order is kept between the messages of one thread, not across threads.
+ * Before async_log_start() and after async_log_stop(), log_msg() calls
+ * syslog() directly.
+ */
+int async_log_start(void);
+void async_log_stop(void);
+
+void log_msg(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void async_log_set_level(int level);
+void async_log_adjust_level(int delta);
+
+#endif /* ASYNC_LOG_H */
@@ -0,0 +1,480 @@
+/*
+* bench.c
+*
+* Load generator for simple_stream_server. Every client thread keeps one
+* connection busy at a time: it connects, sends one line, reads the reply
+* until the server closes the connection and checks that the reply holds
+* the line it sent. Latency is measured from the moment the request was
+* due (not when it was actually sent), so a slow server can't hide its
+* queueing delay by slowing the clients down.
+*
+* With -z the client first asks for compressed replies ("?compress lz4"),
+* and decompresses every reply before checking it.
+*/
+
+#define _GNU_SOURCE // memmem()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "lz_codec.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_LINE_SIZE 64
+#define DEFAULT_DURATION 10
+#define MIN_LINE_SIZE 32         // room for the unique tag at the start of every line
+#define REPLY_BUF_INITIAL (64 * 1024)
+#define COMPRESS_REQUEST "?compress lz4\n"
+#define WIRE_STORED 0x80000000u  // block sent uncompressed (see wire_compress.h in the server)
+
+typedef struct BenchConfig {
+    const char *host;
+    const char *port;
+    int connections;    // concurrent client threads, one connection each
+    size_t line_size;   // bytes per line, including the '\n'
+    double rate;        // requests per second over all connections, 0 = as fast as possible
+    int duration;       // seconds
+    int compress;       // ask for compressed replies
+} BenchConfig;
+
+static BenchConfig config = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .connections = DEFAULT_CONNECTIONS,
+    .line_size = DEFAULT_LINE_SIZE,
+    .rate = 0,
+    .duration = DEFAULT_DURATION,
+    .compress = 0,
+};
+
+/* Per client thread results, merged once every thread is joined */
+typedef struct ClientStats {
+    pthread_t tid;
+    int id;
+    uint64_t requests;   // completed and validated
+    uint64_t errors;     // connect/send/recv failures
+    uint64_t invalid;    // replies that don't contain the line sent
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t *latencies; // nanoseconds, one per completed request
+    size_t latency_count;
+    size_t latency_cap;
+} ClientStats;
+
+static struct addrinfo *server_addr;
+static uint64_t deadline_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t when_ns) {
+    uint64_t now = now_ns();
+    if (when_ns <= now) return;
+
+    uint64_t delta = when_ns - now;
+    struct timespec ts = { .tv_sec = delta / 1000000000ULL, .tv_nsec = delta % 1000000000ULL };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static int record_latency(ClientStats *stats, uint64_t latency) {
+    if (stats->latency_count == stats->latency_cap) {
+        size_t new_cap = stats->latency_cap ? stats->latency_cap * 2 : 4096;
+        uint64_t *p = realloc(stats->latencies, new_cap * sizeof(uint64_t));
+        if (!p) return -1;
+        stats->latencies = p;
+        stats->latency_cap = new_cap;
+    }
+    stats->latencies[stats->latency_count++] = latency;
+    return 0;
+}
+
+/* Fills 'line' with a tag unique to this client and request, padded to the line size */
+static void build_line(char *line, int client, uint64_t seq) {
+    int n = snprintf(line, config.line_size, "bench-%d-%llu-", client, (unsigned long long)seq);
+    memset(line + n, 'x', config.line_size - 1 - n);
+    line[config.line_size - 1] = '\n';
+}
+
+static int connect_server(void) {
+    int sockfd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+    if (sockfd < 0) return -1;
+
+    if (connect(sockfd, server_addr->ai_addr, server_addr->ai_addrlen) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return sockfd;
+}
+
+static int send_all(int sockfd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint32_t get32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+/*
+ * decompress_reply:
+ * Decodes the compressed replies in 'wire' (the empty answer to
+ * "?compress lz4", then the reply to the line) into 'plain', grown as
+ * needed. Returns the length of the line's reply, or -1 if malformed.
+ */
+static ssize_t decompress_reply(const char *wire, size_t len, char **plain, size_t *plain_cap) {
+    size_t pos = 0, out = 0;
+    for (int reply = 0; reply < 2; reply++) {
+        while (1) {
+            if (len - pos < 4) return -1;
+            uint32_t size = get32(wire + pos);
+            pos += 4;
+            if (size == 0) break;
+            if (reply == 0 || len - pos < 4) return -1;
+
+            uint32_t raw = get32(wire + pos);
+            pos += 4;
+            size &= ~WIRE_STORED;
+            if (len - pos < size) return -1;
+            if (*plain_cap - out < raw) {
+                size_t cap = *plain_cap;
+                while (cap - out < raw) cap *= 2;
+                char *p = realloc(*plain, cap);
+                if (!p) return -1;
+                *plain = p;
+                *plain_cap = cap;
+            }
+
+            if (get32(wire + pos - 8) & WIRE_STORED) {
+                if (size != raw) return -1;
+                memcpy(*plain + out, wire + pos, size);
+            } else if (lz_decompress(wire + pos, size, *plain + out, raw) != (ssize_t)raw) {
+                return -1;
+            }
+            pos += size;
+            out += raw;
+        }
+    }
+    return pos == len ? (ssize_t)out : -1;
+}
+
+/*
+ * run_request:
+ * One request/reply exchange. The reply (the whole stored data) is
+ * received into 'reply', grown as needed, and decompressed into 'plain'
+ * with config.compress.
+ * Returns 0 if the reply is valid, 1 if it doesn't contain the line
+ * sent, or -1 on a connection error.
+ */
+static int run_request(ClientStats *stats, const char *line, char **reply, size_t *reply_cap,
+                       char **plain, size_t *plain_cap) {
+    int sockfd = connect_server();
+    if (sockfd < 0) return -1;
+
+    if ((config.compress && send_all(sockfd, COMPRESS_REQUEST, sizeof(COMPRESS_REQUEST) - 1) < 0) ||
+        send_all(sockfd, line, config.line_size) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    stats->bytes_sent += config.line_size + (config.compress ? sizeof(COMPRESS_REQUEST) - 1 : 0);
+
+    size_t len = 0;
+    while (1) {
+        if (*reply_cap - len < 4096) {
+            char *p = realloc(*reply, *reply_cap * 2);
+            if (!p) {
+                close(sockfd);
+                return -1;
+            }
+            *reply = p;
+            *reply_cap *= 2;
+        }
+
+        ssize_t n = recv(sockfd, *reply + len, *reply_cap - len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(sockfd);
+            return -1;
+        }
+        if (n == 0) break;
+        len += n;
+    }
+    close(sockfd);
+    stats->bytes_received += len;
+
+    const char *data = *reply;
+    if (config.compress) {
+        ssize_t plain_len = decompress_reply(*reply, len, plain, plain_cap);
+        if (plain_len < 0) {
+            return 1;
+        }
+        data = *plain;
+        len = plain_len;
+    }
+
+    /* Other clients' lines may be stored after ours, so search the whole reply */
+    if (len == 0 || data[len - 1] != '\n' || !memmem(data, len, line, config.line_size)) {
+        return 1;
+    }
+    return 0;
+}
+
+static void *client_thread(void *arg) {
+    ClientStats *stats = (ClientStats *)arg;
+
+    char *line = malloc(config.line_size);
+    size_t reply_cap = REPLY_BUF_INITIAL;
+    char *reply = malloc(reply_cap);
+    size_t plain_cap = REPLY_BUF_INITIAL;
+    char *plain = malloc(plain_cap);
+    if (!line || !reply || !plain) {
+        fprintf(stderr, "client %d: out of memory\n", stats->id);
+        free(line);
+        free(reply);
+        free(plain);
+        return NULL;
+    }
+
+    /* Every client sends its share of the total rate, clients start staggered */
+    uint64_t interval = config.rate > 0 ? (uint64_t)(1e9 * config.connections / config.rate) : 0;
+    uint64_t due = now_ns() + interval * stats->id / config.connections;
+
+    for (uint64_t seq = 0; ; seq++) {
+        if (interval) sleep_until(due);
+        uint64_t start = interval ? due : now_ns();
+        if (start >= deadline_ns) break;
+
+        build_line(line, stats->id, seq);
+        int rc = run_request(stats, line, &reply, &reply_cap, &plain, &plain_cap);
+        if (rc < 0) {
+            stats->errors++;
+        } else if (rc > 0) {
+            stats->invalid++;
+        } else {
+            stats->requests++;
+            if (record_latency(stats, now_ns() - start) < 0) {
+                fprintf(stderr, "client %d: out of memory\n", stats->id);
+                break;
+            }
+        }
+        due += interval;
+    }
+
+    free(line);
+    free(reply);
+    free(plain);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted 'values', in microseconds */
+static double percentile_us(const uint64_t *values, size_t count, double p) {
+    if (count == 0) return 0;
+    size_t rank = (size_t)(p / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return values[rank - 1] / 1000.0;
+}
+
+static void print_report(ClientStats *stats, double elapsed) {
+    uint64_t requests = 0, errors = 0, invalid = 0, sent = 0, received = 0;
+    size_t count = 0;
+
+    for (int i = 0; i < config.connections; i++) {
+        requests += stats[i].requests;
+        errors += stats[i].errors;
+        invalid += stats[i].invalid;
+        sent += stats[i].bytes_sent;
+        received += stats[i].bytes_received;
+        count += stats[i].latency_count;
+    }
+
+    uint64_t *all = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!all) {
+        fprintf(stderr, "report: out of memory\n");
+        return;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < config.connections; i++) {
+        memcpy(all + pos, stats[i].latencies, stats[i].latency_count * sizeof(uint64_t));
+        pos += stats[i].latency_count;
+    }
+    qsort(all, count, sizeof(uint64_t), compare_u64);
+
+    printf("connections:    %d concurrent, %zu byte lines, rate %s\n", config.connections,
+           config.line_size, config.rate > 0 ? "limited" : "unlimited");
+    printf("duration:       %.2f s\n", elapsed);
+    printf("requests:       %llu ok, %llu errors, %llu invalid replies\n",
+           (unsigned long long)requests, (unsigned long long)errors, (unsigned long long)invalid);
+    printf("connections/s:  %.1f\n", requests / elapsed);
+    printf("sent:           %.1f bytes/s\n", sent / elapsed);
+    printf("received:       %.1f bytes/s\n", received / elapsed);
+    printf("latency (us):   p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           percentile_us(all, count, 50), percentile_us(all, count, 99),
+           percentile_us(all, count, 99.9), count ? all[count - 1] / 1000.0 : 0);
+
+    free(all);
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-H host] [-p port] [-c connections] [-l line_size] [-r rate] [-d seconds] [-z]\n"
+        "  -H, --host        server address (default %s)\n"
+        "  -p, --port        server port (default %s)\n"
+        "  -c, --connections concurrent connections, one client thread each (default %d)\n"
+        "  -l, --line-size   bytes per line including the '\\n', at least %d (default %d)\n"
+        "  -r, --rate        total requests per second, 0 = as fast as possible (default 0)\n"
+        "  -d, --duration    seconds to run (default %d)\n"
+        "  -z, --compress    ask for compressed replies (server started with --compress)\n",
+        prog, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_CONNECTIONS, MIN_LINE_SIZE, DEFAULT_LINE_SIZE,
+        DEFAULT_DURATION);
+}
+
+static int parse_args(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "host",        required_argument, NULL, 'H' },
+        { "port",        required_argument, NULL, 'p' },
+        { "connections", required_argument, NULL, 'c' },
+        { "line-size",   required_argument, NULL, 'l' },
+        { "rate",        required_argument, NULL, 'r' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "compress",    no_argument,       NULL, 'z' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:c:l:r:d:zh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'H':
+                config.host = optarg;
+                break;
+            case 'p':
+                config.port = optarg;
+                break;
+            case 'c':
+                config.connections = atoi(optarg);
+                if (config.connections <= 0) {
+                    fprintf(stderr, "Invalid connections: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'l': {
+                long size = atol(optarg);
+                if (size < MIN_LINE_SIZE) {
+                    fprintf(stderr, "Invalid line size: %s (minimum %d)\n", optarg, MIN_LINE_SIZE);
+                    return -1;
+                }
+                config.line_size = size;
+                break;
+            }
+            case 'r':
+                config.rate = atof(optarg);
+                if (config.rate < 0) {
+                    fprintf(stderr, "Invalid rate: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'd':
+                config.duration = atoi(optarg);
+                if (config.duration <= 0) {
+                    fprintf(stderr, "Invalid duration: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'z':
+                config.compress = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (parse_args(argc, argv) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rv = getaddrinfo(config.host, config.port, &hints, &server_addr);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return EXIT_FAILURE;
+    }
+
+    ClientStats *stats = calloc(config.connections, sizeof(ClientStats));
+    if (!stats) {
+        fprintf(stderr, "calloc: %s\n", strerror(errno));
+        freeaddrinfo(server_addr);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = now_ns();
+    deadline_ns = start + (uint64_t)config.duration * 1000000000ULL;
+
+    int started = 0;
+    for (; started < config.connections; started++) {
+        stats[started].id = started;
+        if (pthread_create(&stats[started].tid, NULL, client_thread, &stats[started]) != 0) {
+            fprintf(stderr, "pthread_create failed, running with %d connections\n", started);
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(stats[i].tid, NULL);
+    }
+    config.connections = started;
+
+    print_report(stats, (now_ns() - start) / 1e9);
+
+    uint64_t failures = 0;
+    for (int i = 0; i < started; i++) {
+        failures += stats[i].errors + stats[i].invalid;
+        free(stats[i].latencies);
+    }
+    free(stats);
+    freeaddrinfo(server_addr);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
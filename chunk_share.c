@@ -0,0 +1,170 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "chunk_share.h"
+#include "metrics.h"
+#include "async_log.h"
+
+/* Chunks by start offset. Several chunks may share a start when an older one is too short. */
+static SharedChunk *buckets[CHUNK_SHARE_BUCKETS];
+static SharedChunk *idle_head = NULL;  // most recently released
+static SharedChunk *idle_tail = NULL;  // next to be evicted
+static int idle_count = 0;
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loaded_cond = PTHREAD_COND_INITIALIZER;
+
+static SharedChunk **bucket_of(off_t start) {
+    return &buckets[(size_t)(start / SHARED_CHUNK_SIZE) % CHUNK_SHARE_BUCKETS];
+}
+
+static void bucket_remove(SharedChunk *chunk) {
+    SharedChunk **link = bucket_of(chunk->start);
+    while (*link != chunk) link = &(*link)->next;
+    *link = chunk->next;
+}
+
+static void idle_remove(SharedChunk *chunk) {
+    if (chunk->idle_prev) chunk->idle_prev->idle_next = chunk->idle_next;
+    else idle_head = chunk->idle_next;
+    if (chunk->idle_next) chunk->idle_next->idle_prev = chunk->idle_prev;
+    else idle_tail = chunk->idle_prev;
+    chunk->idle_prev = chunk->idle_next = NULL;
+    idle_count--;
+}
+
+/*
+ * chunk_share_acquire:
+ * Returns a reference to the chunk holding 'offset': one being loaded or
+ * already loaded far enough by another reply, otherwise a new one. For a
+ * new chunk '*load' is set, and the caller must read the store from
+ * chunk->start into chunk->data and call chunk_share_loaded(). A chunk
+ * still loading can be waited for with chunk_share_wait().
+ * Returns NULL on allocation failure.
+ */
+SharedChunk *chunk_share_acquire(off_t offset, int *load) {
+    return chunk_share_acquire_from(offset - offset % SHARED_CHUNK_SIZE, offset, load);
+}
+
+/*
+ * chunk_share_acquire_from:
+ * Same as chunk_share_acquire(), for chunks starting at 'start' instead of
+ * the SHARED_CHUNK_SIZE multiple below 'offset': the blocks of compressed
+ * segments, which start at the segment start too (see data_store.c).
+ * 'start' must be in the same SHARED_CHUNK_SIZE slot as 'offset'.
+ */
+SharedChunk *chunk_share_acquire_from(off_t start, off_t offset, int *load) {
+    SharedChunk **bucket = bucket_of(start);
+
+    pthread_mutex_lock(&table_mutex);
+    for (SharedChunk *chunk = *bucket; chunk; chunk = chunk->next) {
+        if (chunk->start == start &&
+            (chunk->state == CHUNK_LOADING || (chunk->state == CHUNK_READY && chunk_share_avail(chunk, offset) > 0))) {
+            if (chunk->refs++ == 0) idle_remove(chunk);
+            pthread_mutex_unlock(&table_mutex);
+            metrics_add(METRIC_CHUNKS_SHARED, 1);
+            *load = 0;
+            return chunk;
+        }
+    }
+
+    SharedChunk *chunk = malloc(sizeof(SharedChunk));
+    if (!chunk) {
+        pthread_mutex_unlock(&table_mutex);
+        log_msg(LOG_ERR, "SharedChunk malloc: %s", strerror(errno));
+        return NULL;
+    }
+    chunk->start = start;
+    chunk->len = 0;
+    chunk->state = CHUNK_LOADING;
+    chunk->refs = 1;
+    chunk->waiters = NULL;
+    chunk->idle_prev = chunk->idle_next = NULL;
+    chunk->next = *bucket;
+    *bucket = chunk;
+    pthread_mutex_unlock(&table_mutex);
+
+    metrics_add(METRIC_CHUNKS_READ, 1);
+    *load = 1;
+    return chunk;
+}
+
+/* Called by the loader with the bytes read into chunk->data, or -1 if the read failed */
+void chunk_share_loaded(SharedChunk *chunk, ssize_t len) {
+    pthread_mutex_lock(&table_mutex);
+    if (len > 0) {
+        chunk->len = len;
+        chunk->state = CHUNK_READY;
+    } else {
+        chunk->state = CHUNK_FAILED;
+    }
+    pthread_cond_broadcast(&loaded_cond);
+    pthread_mutex_unlock(&table_mutex);
+}
+
+/*
+ * chunk_share_wait:
+ * Blocks until the chunk is loaded, for the threads that block anyway.
+ * Returns 0 when it is ready, or -1 if its read failed.
+ */
+int chunk_share_wait(SharedChunk *chunk) {
+    pthread_mutex_lock(&table_mutex);
+    while (chunk->state == CHUNK_LOADING) {
+        pthread_cond_wait(&loaded_cond, &table_mutex);
+    }
+    int rc = chunk->state == CHUNK_READY ? 0 : -1;
+    pthread_mutex_unlock(&table_mutex);
+    return rc;
+}
+
+/* Takes one more reference to a chunk already held */
+void chunk_share_retain(SharedChunk *chunk) {
+    pthread_mutex_lock(&table_mutex);
+    chunk->refs++;
+    pthread_mutex_unlock(&table_mutex);
+}
+
+/*
+ * chunk_share_release:
+ * Drops a reference taken by chunk_share_acquire() or chunk_share_retain().
+ * A loaded chunk nobody uses goes to the front of the idle list, and the
+ * least recently used idle chunk beyond CHUNK_SHARE_IDLE is freed.
+ */
+void chunk_share_release(SharedChunk *chunk) {
+    pthread_mutex_lock(&table_mutex);
+    if (--chunk->refs > 0) {
+        pthread_mutex_unlock(&table_mutex);
+        return;
+    }
+
+    SharedChunk *victim = chunk;
+    if (chunk->state == CHUNK_READY) {
+        chunk->idle_prev = NULL;
+        chunk->idle_next = idle_head;
+        if (idle_head) idle_head->idle_prev = chunk;
+        else idle_tail = chunk;
+        idle_head = chunk;
+        idle_count++;
+
+        victim = idle_count > CHUNK_SHARE_IDLE ? idle_tail : NULL;
+        if (victim) idle_remove(victim);
+    }
+    if (victim) bucket_remove(victim);
+    pthread_mutex_unlock(&table_mutex);
+
+    free(victim);
+}
+
+/* Frees the idle chunks, at shutdown once no reply is left */
+void chunk_share_destroy(void) {
+    pthread_mutex_lock(&table_mutex);
+    while (idle_tail) {
+        SharedChunk *chunk = idle_tail;
+        idle_remove(chunk);
+        bucket_remove(chunk);
+        free(chunk);
+    }
+    pthread_mutex_unlock(&table_mutex);
+}
@@ -0,0 +1,61 @@
+#ifndef CHUNK_SHARE_H
+#define CHUNK_SHARE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SHARED_CHUNK_SIZE (64 * 1024)  // bytes per shared read, chunks start at multiples of it
+#define CHUNK_SHARE_BUCKETS 256        // hash buckets of the table of chunks
+#define CHUNK_SHARE_IDLE 64            // unused chunks kept for replies a little behind (4M)
+
+/*
+ * Replies read from the flat data file (copy send method, uring loop) go
+ * through shared chunks: aligned SHARED_CHUNK_SIZE pieces of the store,
+ * read once and reference counted, so clients answered at the same time
+ * (every client of a group commit asks for the same snapshot) cost one
+ * read per chunk instead of one per client. Store bytes never change, so
+ * a chunk is valid for any reply covering it. The last CHUNK_SHARE_IDLE
+ * chunks nobody uses anymore are kept, so replies that lag a little behind
+ * the others still find them; longer term caching is left to the page
+ * cache and the record cache. Blocks of compressed segments are
+ * decompressed into shared chunks the same way (see data_store.c).
+ */
+
+typedef enum ChunkState {
+    CHUNK_LOADING = 0,  // being read by the caller that created it
+    CHUNK_READY,
+    CHUNK_FAILED,
+} ChunkState;
+
+/*
+ * SharedChunk:
+ * Bytes [start, start + len) of the store. 'data' is read-only once the
+ * chunk is ready.
+ */
+typedef struct SharedChunk {
+    off_t start;               // store offset of data[0], a multiple of SHARED_CHUNK_SIZE (or a segment start)
+    size_t len;                // bytes loaded, fewer than SHARED_CHUNK_SIZE at the end of the store
+    ChunkState state;
+    int refs;                  // users, the chunk is idle at 0
+    void *waiters;             // owner-defined list of who waits for a loading chunk (uring loop)
+    struct SharedChunk *next;  // hash bucket chain
+    struct SharedChunk *idle_prev; // LRU list of idle chunks, evicted beyond CHUNK_SHARE_IDLE
+    struct SharedChunk *idle_next;
+    char data[SHARED_CHUNK_SIZE];
+} SharedChunk;
+
+SharedChunk *chunk_share_acquire(off_t offset, int *load);
+SharedChunk *chunk_share_acquire_from(off_t start, off_t offset, int *load);
+void chunk_share_loaded(SharedChunk *chunk, ssize_t len);
+int chunk_share_wait(SharedChunk *chunk);
+void chunk_share_retain(SharedChunk *chunk);
+void chunk_share_release(SharedChunk *chunk);
+void chunk_share_destroy(void);
+
+/* Bytes of 'chunk' from store offset 'offset' on, 0 if it doesn't reach that far */
+static inline size_t chunk_share_avail(const SharedChunk *chunk, off_t offset) {
+    off_t end = chunk->start + (off_t)chunk->len;
+    return offset >= chunk->start && offset < end ? (size_t)(end - offset) : 0;
+}
+
+#endif /* CHUNK_SHARE_H */
@@ -9,176 +9,274 @@
 #include <syslog.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <stdint.h>
+#include <poll.h>
 
 #include "connection_handler.h"
 #include "simple_stream_server.h"
 #include "thread_list.h"
+#include "append_writer.h"
+#include "data_store.h"
+#include "file_send.h"
+#include "recv_buffer.h"
+#include "query.h"
+#include "metrics.h"
+#include "async_log.h"
+#include "timer_wheel.h"
+#include "admission.h"
+#include "wire_compress.h"
+#include "hot_restart.h"
 
-extern pthread_mutex_t file_mutex;
 extern volatile sig_atomic_t keep_running;
 
 
-// Receives dada from client and appends to DATA_FILE_PATH, creating this file if it doesn’t exist.
-int recv_client_data_and_append_to_file(int client_sockfd)
-{
-    // Set a receive timeout
-    struct timeval tv;
-    tv.tv_sec = 1;     // 1 seconds
-    tv.tv_usec = 0;
-    if (setsockopt(client_sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        syslog(LOG_ERR, "setsockopt(SO_RCVTIMEO): %s", strerror(errno));
-        close(client_sockfd);
-        return -1;
+// Returns 1 (and logs it) when the idle deadline, or the read deadline once a packet started,
+// expired 'start' + timeout milliseconds.
+static int deadline_passed(int client_sockfd, int reading, uint64_t start) {
+    int timeout_ms = reading ? server_config.read_timeout_ms : server_config.idle_timeout_ms;
+    if (timeout_ms <= 0 || timer_now_ms() - start < (uint64_t)timeout_ms) {
+        return 0;
     }
-    
-    int ret = -1;
-    char buffer[1024];
-    ssize_t bytes_read;
-    int acquired_file_mutex = 0;
+    log_msg(LOG_INFO, "%s timeout, socket: %u", reading ? "Read" : "Idle", client_sockfd);
+    metrics_add(METRIC_CONNECTIONS_TIMED_OUT, 1);
+    return 1;
+}
 
-    #if USE_SYSCALL_FILE
-    int fd = INVALID_FILE;   // file descriptor
-    #else
-    FILE *fd = INVALID_FILE; // file pointer
-    #endif
+// Receives one packet from the client and hands it to the append writer, which appends it to DATA_FILE_PATH.
+// Bytes already in 'packet' (pipelined after the previous packet) are used first,
+// bytes received after the '\n' are kept in 'packet' for the next call. Once 'served', the connection
+// is closed between packets while a takeover drains (see hot_restart.h).
+// Returns 0 when the packet was appended, 1 when it was a query (filled in 'query'), or -1 on error.
+int recv_client_data_and_append_to_file(int client_sockfd, in_addr_t addr, RecvBuffer *packet, Query *query, int served)
+{
+    ssize_t bytes_read;
 
     /* We dont read the client data at once because it can be very large, 
-     * therefore we only received a total of 'sizeof(buffer)' bytes, and append it.
-     * Repeat the processes in a loop until all the data has been received. */
+     * therefore each recv() fills the free space of a growable buffer
+     * (server_config.recv_buf_initial up to recv_buf_max bytes).
+     * The packet is accumulated until the '\n' arrives and then queued to the
+     * append writer as one record, so no lock is held while waiting on the client. */
+    /* Blocking sockets have no loop to run timers: the deadlines are checked each time the
+     * SO_RCVTIMEO timeout wakes recv() up. Between packets the client may stay idle for
+     * idle_timeout_ms, once a packet started it must be complete within read_timeout_ms. */
+    int reading = packet->len > 0;
+    uint64_t deadline_start = timer_now_ms();
+
      while(keep_running) {
-        bytes_read = recv(client_sockfd, buffer, sizeof(buffer), 0);
+        // If found '\n', the packet is complete: queue it and wait until it is in the file
+        char *nl = recv_buffer_find_newline(packet);
+        if (nl) {
+            size_t len = nl - packet->data + 1;
+            if (query_parse(packet->data, len, query)) {
+                recv_buffer_consume(packet, len);
+                return 1;
+            }
+
+            char *record = recv_buffer_take(packet, len);
+            if (!record) {
+                return -1;
+            }
+            uint64_t seq = append_writer_submit(record, len);
+            if (seq == 0 || append_writer_wait(seq) != 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        if (recv_buffer_reserve(packet) < 0) {
+            log_msg(LOG_ERR, "packet too large or out of memory, socket: %u", client_sockfd);
+            break;
+        }
+
+        bytes_read = recv(client_sockfd, packet->data + packet->len, packet->cap - packet->len, 0);
 
         if (bytes_read < 0) {
             if(errno == EWOULDBLOCK || errno == EAGAIN) {
-                //printf("timeout, try again\n");
+                if (served && packet->len == 0 && hot_restart_state() != HOT_RESTART_RUNNING) {
+                    break;
+                }
+                if (deadline_passed(client_sockfd, reading, deadline_start)) {
+                    break;
+                }
                 continue;
             } else {
-                syslog(LOG_ERR, "recv: %s", strerror(errno));
+                log_msg(LOG_ERR, "recv: %s", strerror(errno));
                 break;
             }
         } else if (bytes_read == 0) {
-            syslog(LOG_INFO, "Connection closed by peer, socket: %u", client_sockfd);
+            log_msg(LOG_INFO, "Connection closed by peer, socket: %u", client_sockfd);
             break;
         }
-        
-        // If fd = INVALID_FILE, it is the first iteration, then acquire mutex and open the file
-        if (fd == INVALID_FILE) {
-            // lock file_mutex to avoid writing in parallel with other threads
-            pthread_mutex_lock(&file_mutex);
-            acquired_file_mutex = 1;
-            // open file
-            #if USE_SYSCALL_FILE
-            fd = open(DATA_FILE_PATH, O_CREAT | O_WRONLY | O_APPEND, 0644);
-            #else
-            fd = fopen(DATA_FILE_PATH, "a");
-            #endif 
-                
-            if (fd == INVALID_FILE) {
-                syslog(LOG_ERR, "%s (recv_client_data_and_append_to_file): %s", USE_SYSCALL_FILE ? "open" : "fopen", strerror(errno));
-                break;
-            }
+        packet->len += bytes_read;
+        metrics_add(METRIC_BYTES_RECEIVED, bytes_read);
+
+        /* Over the byte rate of its address: this thread is the connection's, just wait
+         * (a second at a time, so keep_running is still checked) */
+        uint64_t throttle_ms = admission_consume(addr, bytes_read);
+        while (throttle_ms > 0 && keep_running) {
+            uint64_t step = throttle_ms < 1000 ? throttle_ms : 1000;
+            usleep(step * 1000);
+            throttle_ms -= step;
         }
+        if (!reading) {
+            reading = 1;
+            deadline_start = timer_now_ms();
+        } else if (deadline_passed(client_sockfd, reading, deadline_start)) {
+            break; // bytes trickling in don't extend the read deadline
+        }
+    }
 
-        // Append data to file
-        #if USE_SYSCALL_FILE
-        write(fd, buffer, bytes_read);
-        #else
-        fwrite(buffer, 1, bytes_read, fd);
-        #endif 
+    return -1;
+}
+
+// Returns the full content of DATA_FILE_PATH to the client as soon as the received data packet completes,
+// or only the part requested by 'query' (when not NULL). With 'compress', the reply is sent as
+// compressed blocks (see wire_compress.h).
+int send_file_data_to_client(int client_sockfd, const Query *query, int compress) {
+    DataSnapshot snap;
+
+    /* Records appended after this point are not part of the reply */
+    data_store_snapshot(&snap);
+
+    /* The socket is non-blocking while the reply is sent, and waits for it to be writable a
+     * second at a time, so keep_running and the send timeout are checked (a blocking sendfile()
+     * would wait for the client forever). This thread doesn't read the next packet meanwhile,
+     * so a slow client only throttles itself. */
+    int flags = fcntl(client_sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(client_sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_msg(LOG_ERR, "fcntl(O_NONBLOCK): %s", strerror(errno));
+        return -1;
+    }
+
+    uint64_t start_ns = metrics_now_ns();
+    uint64_t progress_ms = timer_now_ms();
+    if (query) query_resolve(query, &snap);
+    off_t offset = snap.start;
+    WireReply wire;
+    wire_reply_init(&wire, offset, snap.end);
+    int rc;
+    while (1) {
+        uint64_t before = compress ? wire.bytes : (uint64_t)offset;
+        rc = compress ? wire_reply_send(&wire, client_sockfd) : file_send_range(client_sockfd, &offset, snap.end);
+        if (rc == 0) {
+            break;
+        }
+        if (rc < 0 || !keep_running) {
+            break;
+        }
 
-        // If found '\n', stop reading
-        if (memchr(buffer, '\n', bytes_read)) {
-            ret = 0;
+        if ((compress ? wire.bytes : (uint64_t)offset) > before) {
+            progress_ms = timer_now_ms();
+        } else if (server_config.send_timeout_ms > 0 &&
+                   timer_now_ms() - progress_ms >= (uint64_t)server_config.send_timeout_ms) {
+            log_msg(LOG_INFO, "Send timeout, socket: %u", client_sockfd);
+            metrics_add(METRIC_SLOW_CLOSED_TIMEOUT, 1);
+            rc = -1;
             break;
         }
+        struct pollfd pfd = { .fd = client_sockfd, .events = POLLOUT };
+        poll(&pfd, 1, 1000);
+    }
+    wire_reply_release(&wire);
+    if (rc != 0) {
+        return -1;
+    }
+    metrics_observe(METRIC_SEND_LATENCY, metrics_now_ns() - start_ns);
 
-        memset(buffer, 0, sizeof(buffer));
+    /* Back to blocking, recv() relies on SO_RCVTIMEO */
+    if (fcntl(client_sockfd, F_SETFL, flags) < 0) {
+        log_msg(LOG_ERR, "fcntl: %s", strerror(errno));
+        return -1;
     }
 
-    #if USE_SYSCALL_FILE
-    if(fd != INVALID_FILE) close(fd);
-    #else
-    if(fd != INVALID_FILE) fclose(fd);
-    #endif 
-    
-    if(acquired_file_mutex)
-        pthread_mutex_unlock(&file_mutex);    
-    
-    return ret;
+    return 0;
 }
 
-// Returns the full content of DATA_FILE_PATH to the client as soon as the received data packet completes.
-int send_file_data_to_client(int client_sockfd) {
-    int ret = -1;
-    char buffer[1024];
-    ssize_t bytes_read;
+/*
+ * handle_client:
+ * Reads one packet from the client socket, appends it to DATA_FILE_PATH,
+ * returns the file content and closes the socket.
+ * With server_config.keep_alive, packets are served in order until the
+ * client closes the connection. A "?compress lz4" packet is answered
+ * without ending the connection, and makes the later replies compressed.
+ * Shared by the per-connection threads and the worker pool.
+ */
+void handle_client(int client_sockfd, const char *ip_str, in_addr_t addr) {
+    log_msg(LOG_INFO, "New client connection, socket: %u (thread: %lu)", client_sockfd, pthread_self());
 
-    #if USE_SYSCALL_FILE
-    int fd = open(DATA_FILE_PATH, O_RDONLY);
-    #else
-    FILE *fd = fopen(DATA_FILE_PATH, "r");
-    #endif
-
-    if (fd == INVALID_FILE) {
-        syslog(LOG_ERR, "%s (send_file_data_to_client): %s", USE_SYSCALL_FILE ? "open" : "fopen", strerror(errno));
-    } else {
-        // We dont read the file at once because it can be very large, 
-        // therefore we only read a total of 'sizeof(buffer)' bytes, and send it.
-        // Repeat the processes in a loop until all the data has been send.
-        do {
-            #if USE_SYSCALL_FILE
-            bytes_read = read(fd, buffer, sizeof(buffer));
-            #else
-            bytes_read = fread(buffer, 1, sizeof(buffer), fd);
-            #endif
-            if(bytes_read > 0) {
-                send(client_sockfd, buffer, bytes_read, 0);
-            }
-        } while(bytes_read > 0);
+    // Set a receive timeout, so keep_running and the idle/read deadlines are checked while the client is idle
+    struct timeval tv;
+    tv.tv_sec = 1;     // 1 seconds
+    tv.tv_usec = 0;
+    if (setsockopt(client_sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        log_msg(LOG_ERR, "setsockopt(SO_RCVTIMEO): %s", strerror(errno));
+        close(client_sockfd);
+        admission_release(addr);
+        metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+        return;
+    }
 
-        ret = 0;
+    RecvBuffer packet = { 0 };  // received bytes, kept across packets of the same connection
+    int compress = 0;           // replies are compressed, negotiated with "?compress lz4"
+    int served = 0;             // a packet was answered
+    int last = 0;               // the reply being sent is the last one, nothing more is appended
+    while (keep_running) {
+        /* Read data from the client socket */
+        Query query;
+        int rc = recv_client_data_and_append_to_file(client_sockfd, addr, &packet, &query, served);
+        if (rc < 0) {
+            break;
+        }
+        int negotiate = rc == 1 && query.type == QUERY_COMPRESS;
+        if (negotiate) {
+            compress = 1;
+        } else {
+            served = 1;
+        }
+        /* A takeover doesn't wait for the last reply, it ends the connection while draining */
+        if (!negotiate && (!server_config.keep_alive || hot_restart_state() != HOT_RESTART_RUNNING)) {
+            last = 1;
+            hot_restart_finishing(1);
+        }
+        /* Return the file content (or the queried part of it) to the client socket */
+        if (send_file_data_to_client(client_sockfd, rc == 1 ? &query : NULL, compress) != 0) {
+            break;
+        }
+        if (last) {
+            break;
+        }
     }
 
-    #if USE_SYSCALL_FILE
-    if(fd != INVALID_FILE) close(fd);
-    #else
-    if(fd != INVALID_FILE) fclose(fd);
-    #endif 
+    recv_buffer_release(&packet);
+    close(client_sockfd);
+    if (last) {
+        hot_restart_finishing(-1);
+    }
+    admission_release(addr);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
 
-    return ret;
+    log_msg(LOG_INFO, "Closed connection from %s", ip_str);
 }
 
 /*
  * connection_handler:
  * Reads data from the client socket until an error or end-of-stream, 
  * then writes the data to file specified at DATA_FILE_PATH.
- * Uses file_mutex to avoid interleaving data from multiple clients.
+ * The append writer serializes records, so data from multiple clients never interleaves.
  */
  void *connection_handler(void *args) {
-    ThreadArgs* threadArgs = (ThreadArgs*)args;
-    char ip_str[INET_ADDRSTRLEN];
-
-    int client_sockfd = threadArgs->client_sockfd;
-    strncpy(ip_str, threadArgs->ip_str, sizeof(ip_str));
-
-    free(args);
-    
-    syslog(LOG_INFO, "New client connection, socket: %u (thread: %lu)", client_sockfd, pthread_self());
-
-    /* Read data from the client socket */
-    if(recv_client_data_and_append_to_file(client_sockfd) == 0) {
-        /* Return the file content to the client socket */
-        send_file_data_to_client(client_sockfd);
-    }
+    metrics_thread_init();
 
-    close(client_sockfd);
+    /* The arguments live in the thread slot until this thread is joined */
+    int slot = (int)(intptr_t)args;
+    ThreadArgs *threadArgs = thread_slot_args(slot);
 
-    syslog(LOG_INFO, "Closed connection from %s", ip_str);
+    handle_client(threadArgs->client_sockfd, threadArgs->ip_str, threadArgs->addr);
     
-    syslog(LOG_INFO, "Exiting thread id: %lu,", pthread_self());
+    log_msg(LOG_INFO, "Exiting thread id: %lu,", pthread_self());
     
     /* Set this thread as exited the global client thread list */
-    set_thread_as_exited(pthread_self());
+    set_thread_as_exited(slot);
     
     /* Exit the thread */
     return NULL;
@@ -1,22 +1,22 @@
 #ifndef CONNECTION_HANDLER_H
 #define CONNECTION_HANDLER_H
 
-/*
- * ThreadArgs:
- * A structure to hold the arguments needed by the connection handler thread.
- * In this example, we only store the client socket descriptor.
- */
-typedef struct ThreadArgs {
-    int client_sockfd; // client socket file descriptor
-    char ip_str[INET_ADDRSTRLEN];
-} ThreadArgs;
+#include "thread_list.h"
 
 /*
  * connection_handler:
  * The function that each new thread runs to handle a client connection.
- * Receives the socket descriptor in ThreadArgs, then reads data from the client
- * and writes it to file specified at DATA_FILE_PATH (protected by a mutex).
+ * Receives the handle of its thread slot, whose ThreadArgs hold the socket
+ * descriptor, then reads data from the client
+ * and appends it to file specified at DATA_FILE_PATH (through the append writer).
  */
  void *connection_handler(void *args);
 
+/*
+ * handle_client:
+ * Serves one client on the calling thread and closes its socket.
+ * Used by connection_handler() and by the worker pool threads.
+ */
+void handle_client(int client_sockfd, const char *ip_str, in_addr_t addr);
+
 #endif /* CONNECTION_HANDLER_H */
\ No newline at end of file
@@ -0,0 +1,1029 @@
+#define _GNU_SOURCE // memrchr()
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "data_store.h"
+#include "chunk_share.h"
+#include "lz_codec.h"
+#include "record_index.h"
+#include "simple_stream_server.h"
+#include "metrics.h"
+#include "async_log.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define COMPRESSED_MAGIC "SSLZSEG1"
+
+/*
+ * Segment:
+ * One file of the store. The flat layout uses a single unmapped segment
+ * for DATA_FILE_PATH; the segmented layout maps every segment file.
+ * A compressed segment maps its COMPRESSED_SEGMENT_PATH_FORMAT file
+ * instead, and 'blocks' locates its blocks in the mapping.
+ */
+typedef struct Segment {
+    unsigned id;         // number in the file name
+    int fd;
+    char *base;          // MAP_SHARED mapping of 'size' bytes, NULL for the flat file
+    size_t size;         // capacity of the file
+    off_t start;         // store offset of the first byte
+    size_t used;         // bytes of records, only changed by the append writer, final once sealed
+    const uint64_t *blocks; // compressed segment: file offset of each block and of the file end, NULL when raw
+    atomic_int refs;     // one for the index, one per extent handed out
+} Segment;
+
+/*
+ * CompressedHeader:
+ * Start of a compressed segment file, followed by block_count + 1 file
+ * offsets (the last one is the file size) and the blocks. Blocks follow
+ * the SHARED_CHUNK_SIZE grid of the store, clipped to the segment, so a
+ * decompressed block is a shared chunk (see chunk_share.h). A block as
+ * long as its raw bytes didn't shrink and is stored as is.
+ */
+typedef struct CompressedHeader {
+    char magic[8];         // COMPRESSED_MAGIC
+    uint64_t start;        // store offset of the first byte
+    uint64_t raw_len;      // bytes of records
+    uint64_t block_count;
+} CompressedHeader;
+
+static int segmented = 0;             // server_config.segment_size != 0
+
+/* Flat layout */
+static int append_fd = -1;            // O_APPEND descriptor, used only by the append writer
+static Segment flat_segment = { .fd = -1 }; // shared read-only descriptor, used with pread()
+
+/* Segmented layout: retained segments in store order, protected by index_mutex.
+ * The contents of the last segment are only written by the append writer. */
+static Segment **segments = NULL;
+static size_t segment_count = 0;
+static size_t segment_cap = 0;
+static unsigned next_segment_id = 0;
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic off_t data_start = 0;  // first byte still stored (moves with retention)
+static _Atomic off_t data_length = 0; // bytes of complete records in the store
+
+/* Durability, see data_store_sync() */
+static off_t synced_length = 0;       // bytes known to be on disk, only used by the syncing thread
+static atomic_int dir_dirty = 0;      // a store file was created since the last sync
+
+/* Segment compression (server_config.compress_segments), see compress_main() */
+static pthread_t compress_thread;
+static int compress_started = 0;
+static atomic_int compress_stopping = 0;
+static unsigned sealed_id = 0;        // segments numbered below it are final, protected by index_mutex
+static unsigned next_compress_id = 0; // first segment not looked at yet, only used by the compressor
+static pthread_cond_t compress_wakeup = PTHREAD_COND_INITIALIZER;
+
+static void segment_path(unsigned id, char *path, size_t size) {
+    snprintf(path, size, SEGMENT_PATH_FORMAT, id);
+}
+
+static void compressed_path(unsigned id, char *path, size_t size) {
+    snprintf(path, size, COMPRESSED_SEGMENT_PATH_FORMAT, id);
+}
+
+/* Blocks of a compressed segment, numbered from the SHARED_CHUNK_SIZE slot holding its start */
+static size_t block_index(const Segment *seg, off_t offset) {
+    return offset / SHARED_CHUNK_SIZE - seg->start / SHARED_CHUNK_SIZE;
+}
+
+static off_t block_start(const Segment *seg, size_t i) {
+    off_t start = (seg->start / SHARED_CHUNK_SIZE + (off_t)i) * SHARED_CHUNK_SIZE;
+    return start > seg->start ? start : seg->start;
+}
+
+static off_t block_end(const Segment *seg, size_t i) {
+    off_t end = (seg->start / SHARED_CHUNK_SIZE + (off_t)i + 1) * SHARED_CHUNK_SIZE;
+    off_t seg_end = seg->start + (off_t)seg->used;
+    return end < seg_end ? end : seg_end;
+}
+
+static size_t block_count(const Segment *seg) {
+    return seg->used ? block_index(seg, seg->start + (off_t)seg->used - 1) + 1 : 0;
+}
+
+/* Drops a reference, unmapping and closing the segment with the last one */
+static void segment_put(Segment *seg) {
+    if (atomic_fetch_sub(&seg->refs, 1) != 1) return;
+
+    munmap(seg->base, seg->size);
+    close(seg->fd);
+    free(seg);
+}
+
+/*
+ * segment_create:
+ * Creates, sizes and maps the next segment file, starting at store
+ * offset 'start'. The blocks are allocated up front, so a full disk
+ * fails here instead of raising SIGBUS on a later memcpy.
+ * Returns the segment, or NULL on error.
+ */
+static Segment *segment_create(off_t start, size_t size) {
+    Segment *seg = calloc(1, sizeof(Segment));
+    if (!seg) {
+        log_msg(LOG_ERR, "Segment calloc: %s", strerror(errno));
+        return NULL;
+    }
+    seg->id = next_segment_id++;
+    seg->start = start;
+    seg->size = size;
+    atomic_init(&seg->refs, 1);
+
+    char path[PATH_MAX];
+    segment_path(seg->id, path, sizeof(path));
+
+    seg->fd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg->fd < 0) {
+        log_msg(LOG_ERR, "open (segment %s): %s", path, strerror(errno));
+        free(seg);
+        return NULL;
+    }
+
+    int rc = posix_fallocate(seg->fd, 0, size);
+    if (rc == EINVAL || rc == EOPNOTSUPP) {
+        rc = ftruncate(seg->fd, size) < 0 ? errno : 0;
+    }
+    if (rc != 0) {
+        log_msg(LOG_ERR, "fallocate (segment %s): %s", path, strerror(rc));
+        close(seg->fd);
+        unlink(path);
+        free(seg);
+        return NULL;
+    }
+
+    seg->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->base == MAP_FAILED) {
+        log_msg(LOG_ERR, "mmap (segment %s): %s", path, strerror(errno));
+        close(seg->fd);
+        unlink(path);
+        free(seg);
+        return NULL;
+    }
+
+    atomic_store(&dir_dirty, 1);
+    return seg;
+}
+
+/* Adds a new last segment to the index */
+static int index_push(Segment *seg) {
+    pthread_mutex_lock(&index_mutex);
+    if (segment_count == segment_cap) {
+        size_t new_cap = segment_cap ? segment_cap * 2 : 16;
+        Segment **new_segments = realloc(segments, new_cap * sizeof(Segment *));
+        if (!new_segments) {
+            pthread_mutex_unlock(&index_mutex);
+            log_msg(LOG_ERR, "realloc (segment index): %s", strerror(errno));
+            return -1;
+        }
+        segments = new_segments;
+        segment_cap = new_cap;
+    }
+    segments[segment_count++] = seg;
+    pthread_mutex_unlock(&index_mutex);
+    return 0;
+}
+
+/* Deletes a segment that left the index; readers holding extents keep it mapped */
+static void segment_retire(Segment *seg) {
+    char path[PATH_MAX];
+    if (seg->blocks) compressed_path(seg->id, path, sizeof(path));
+    else segment_path(seg->id, path, sizeof(path));
+    if (unlink(path) < 0) {
+        log_msg(LOG_ERR, "unlink (segment %s): %s", path, strerror(errno));
+    }
+    segment_put(seg);
+}
+
+/*
+ * remove_segment_files:
+ * Deletes every segment file in the data directory, raw or compressed,
+ * including ones left over from an earlier run.
+ */
+static void remove_segment_files(void) {
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s", DATA_FILE_PATH);
+    char *slash = strrchr(dir_path, '/');
+    if (!slash) return;
+    *slash = '\0';
+
+    char prefix[PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s.", slash + 1);
+    size_t prefix_len = strlen(prefix);
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        log_msg(LOG_ERR, "opendir (%s): %s", dir_path, strerror(errno));
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strncmp(name, prefix, prefix_len) != 0) continue;
+        size_t digits = strspn(name + prefix_len, "0123456789");
+        const char *suffix = name + prefix_len + digits;
+        if (digits == 0 || (*suffix != '\0' && strcmp(suffix, ".lz") != 0)) continue;
+
+        char path[PATH_MAX];
+        int n = snprintf(path, sizeof(path), "%s/%s", dir_path, name);
+        if (n < 0 || (size_t)n >= sizeof(path)) continue;
+        if (unlink(path) < 0) {
+            log_msg(LOG_ERR, "unlink (segment %s): %s", path, strerror(errno));
+        }
+    }
+    closedir(dir);
+}
+
+static int write_at(int fd, const void *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data = (const char *)data + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * segment_compress:
+ * Writes a sealed segment to its compressed file, block by block, and
+ * maps it. The file is synced before it replaces the raw one, unless
+ * durability is left to the page cache.
+ * Returns the compressed segment, or NULL on error (or when stopping).
+ */
+static Segment *segment_compress(Segment *seg) {
+    size_t count = block_count(seg);
+    size_t index_size = (count + 1) * sizeof(uint64_t);
+    uint64_t *index = malloc(index_size);
+    char *block = malloc(SHARED_CHUNK_SIZE);
+    Segment *packed = calloc(1, sizeof(Segment));
+    char path[PATH_MAX];
+    compressed_path(seg->id, path, sizeof(path));
+    int fd = -1;
+
+    if (!index || !block || !packed) {
+        log_msg(LOG_ERR, "segment compression malloc: %s", strerror(errno));
+        goto fail;
+    }
+
+    fd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_msg(LOG_ERR, "open (segment %s): %s", path, strerror(errno));
+        goto fail;
+    }
+
+    uint64_t pos = sizeof(CompressedHeader) + index_size;
+    for (size_t i = 0; i < count; i++) {
+        if (atomic_load(&compress_stopping)) goto fail;
+
+        off_t start = block_start(seg, i);
+        size_t raw = block_end(seg, i) - start;
+        const char *data = seg->base + (start - seg->start);
+        size_t len = lz_compress(data, raw, block, raw - 1);
+        if (len > 0) {
+            data = block;
+        } else {
+            len = raw;
+        }
+        if (write_at(fd, data, len, pos) < 0) {
+            log_msg(LOG_ERR, "write (segment %s): %s", path, strerror(errno));
+            goto fail;
+        }
+        index[i] = pos;
+        pos += len;
+    }
+    index[count] = pos;
+
+    CompressedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMPRESSED_MAGIC, sizeof(header.magic));
+    header.start = seg->start;
+    header.raw_len = seg->used;
+    header.block_count = count;
+    if (write_at(fd, &header, sizeof(header), 0) < 0 ||
+        write_at(fd, index, index_size, sizeof(header)) < 0) {
+        log_msg(LOG_ERR, "write (segment %s): %s", path, strerror(errno));
+        goto fail;
+    }
+    if (server_config.durability != DURABILITY_NONE && fdatasync(fd) < 0) {
+        log_msg(LOG_ERR, "fdatasync (segment %s): %s", path, strerror(errno));
+        goto fail;
+    }
+
+    packed->base = mmap(NULL, pos, PROT_READ, MAP_SHARED, fd, 0);
+    if (packed->base == MAP_FAILED) {
+        log_msg(LOG_ERR, "mmap (segment %s): %s", path, strerror(errno));
+        goto fail;
+    }
+    packed->id = seg->id;
+    packed->fd = fd;
+    packed->size = pos;
+    packed->start = seg->start;
+    packed->used = seg->used;
+    packed->blocks = (const uint64_t *)(packed->base + sizeof(CompressedHeader));
+    atomic_init(&packed->refs, 1);
+    atomic_store(&dir_dirty, 1);
+
+    log_msg(LOG_INFO, "Compressed segment %u: %zu -> %llu bytes", seg->id, seg->used, (unsigned long long)pos);
+    metrics_add(METRIC_SEGMENT_BYTES_RAW, seg->used);
+    metrics_add(METRIC_SEGMENT_BYTES_COMPRESSED, pos);
+    free(block);
+    free(index);
+    return packed;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+    free(packed);
+    free(block);
+    free(index);
+    return NULL;
+}
+
+/*
+ * segment_replace:
+ * Puts the compressed copy of a segment in its place in the index and
+ * deletes the raw file. Readers holding extents of the raw segment keep
+ * it mapped until they release them.
+ */
+static void segment_replace(Segment *seg, Segment *packed) {
+    pthread_mutex_lock(&index_mutex);
+    size_t i = 0;
+    while (i < segment_count && segments[i] != seg) i++;
+    if (i == segment_count) {
+        /* Deleted by retention meanwhile */
+        pthread_mutex_unlock(&index_mutex);
+        segment_retire(packed);
+        return;
+    }
+    segments[i] = packed;
+    pthread_mutex_unlock(&index_mutex);
+
+    segment_retire(seg);
+}
+
+/*
+ * compress_main:
+ * Compressor thread: compresses every sealed segment (all but the one
+ * being written), oldest first, off the append path. It is woken up by
+ * data_store_append() each time a batch sealed segments.
+ */
+static void *compress_main(void *arg) {
+    (void)arg;
+    metrics_thread_init();
+
+    pthread_mutex_lock(&index_mutex);
+    while (!atomic_load(&compress_stopping)) {
+        Segment *seg = NULL;
+        for (size_t i = 0; i < segment_count; i++) {
+            if (segments[i]->id >= next_compress_id && segments[i]->id < sealed_id) {
+                seg = segments[i];
+                break;
+            }
+        }
+        if (!seg) {
+            pthread_cond_wait(&compress_wakeup, &index_mutex);
+            continue;
+        }
+        next_compress_id = seg->id + 1;
+        if (seg->used == 0) continue;
+
+        atomic_fetch_add(&seg->refs, 1);
+        pthread_mutex_unlock(&index_mutex);
+
+        Segment *packed = segment_compress(seg);
+        if (packed) segment_replace(seg, packed);
+        segment_put(seg);
+
+        pthread_mutex_lock(&index_mutex);
+    }
+    pthread_mutex_unlock(&index_mutex);
+
+    log_msg(LOG_INFO, "Exiting compressor thread, tid: %lu", pthread_self());
+    return NULL;
+}
+
+static void compress_stop(void) {
+    if (!compress_started) return;
+
+    pthread_mutex_lock(&index_mutex);
+    atomic_store(&compress_stopping, 1);
+    pthread_cond_signal(&compress_wakeup);
+    pthread_mutex_unlock(&index_mutex);
+
+    pthread_join(compress_thread, NULL);
+    compress_started = 0;
+}
+
+static int open_flat(void) {
+    append_fd = open(DATA_FILE_PATH, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+    if (append_fd < 0) {
+        log_msg(LOG_ERR, "open (data_store append): %s", strerror(errno));
+        return -1;
+    }
+
+    flat_segment.fd = open(DATA_FILE_PATH, O_RDONLY | O_CLOEXEC);
+    if (flat_segment.fd < 0) {
+        log_msg(LOG_ERR, "open (data_store read): %s", strerror(errno));
+        return -1;
+    }
+    atomic_init(&flat_segment.refs, 1);
+
+    struct stat st;
+    if (fstat(append_fd, &st) < 0) {
+        log_msg(LOG_ERR, "fstat (data_store): %s", strerror(errno));
+        return -1;
+    }
+    atomic_store(&data_length, st.st_size);
+    atomic_store(&dir_dirty, 1);
+    return 0;
+}
+
+/*
+ * recover_flat:
+ * Validates the data file found at open, left by an earlier run: bytes
+ * after its last newline are the part of a record a crash interrupted,
+ * and are cut off so the next record doesn't extend it. The file is then
+ * mapped for the record index to scan it.
+ * Returns 0 on success, or -1 on error.
+ */
+static int recover_flat(void) {
+    off_t length = atomic_load(&data_length);
+    if (length == 0) {
+        return record_index_open(NULL, 0);
+    }
+
+    char *data = mmap(NULL, length, PROT_READ, MAP_SHARED, flat_segment.fd, 0);
+    if (data == MAP_FAILED) {
+        log_msg(LOG_ERR, "mmap (data_store recovery): %s", strerror(errno));
+        return -1;
+    }
+    madvise(data, length, MADV_SEQUENTIAL);
+
+    const char *last_nl = memrchr(data, '\n', length);
+    off_t valid = last_nl ? last_nl + 1 - data : 0;
+    if (valid < length) {
+        log_msg(LOG_WARNING, "Data file ends with an incomplete record, truncating %lld bytes",
+                (long long)(length - valid));
+        if (ftruncate(append_fd, valid) < 0) {
+            log_msg(LOG_ERR, "ftruncate (data_store recovery): %s", strerror(errno));
+            munmap(data, length);
+            return -1;
+        }
+        atomic_store(&data_length, valid);
+    }
+
+    int rc = record_index_open(data, valid);
+    munmap(data, length);
+    return rc;
+}
+
+/*
+ * data_store_open:
+ * Opens the store in the layout selected by server_config.segment_size.
+ * The flat file keeps data already in it (see recover_flat()), so that
+ * server_config.persist restarts where the last run stopped; the
+ * segmented layout starts empty, deleting segments left over from an
+ * earlier run, and starts the compressor thread with
+ * server_config.compress_segments.
+ * Returns 0 on success, or -1 on error.
+ */
+int data_store_open(void) {
+    segmented = server_config.segment_size != 0;
+    atomic_store(&data_start, 0);
+    atomic_store(&data_length, 0);
+    synced_length = 0;
+
+    if (!segmented) {
+        if (open_flat() < 0 || recover_flat() < 0) {
+            data_store_close();
+            return -1;
+        }
+        return 0;
+    }
+
+    remove_segment_files();
+    next_segment_id = 0;
+    if (record_index_open(NULL, 0) < 0) {
+        data_store_close();
+        return -1;
+    }
+
+    Segment *seg = segment_create(0, server_config.segment_size);
+    if (!seg || index_push(seg) < 0) {
+        if (seg) segment_retire(seg);
+        data_store_close();
+        return -1;
+    }
+
+    if (server_config.compress_segments) {
+        sealed_id = next_compress_id = 0;
+        atomic_store(&compress_stopping, 0);
+        int rc = pthread_create(&compress_thread, NULL, compress_main, NULL);
+        if (rc != 0) {
+            log_msg(LOG_ERR, "pthread_create (compressor): %s", strerror(rc));
+            data_store_close();
+            return -1;
+        }
+        compress_started = 1;
+    }
+    return 0;
+}
+
+/*
+ * data_store_detach:
+ * The store files are handed to a new process (see hot_restart.h): stops
+ * the compressor, the only writer left once the append writer stopped.
+ * Snapshots taken before keep reading the open files.
+ */
+void data_store_detach(void) {
+    compress_stop();
+}
+
+/*
+ * data_store_close:
+ * Stops the compressor and closes the store files and the record index.
+ * Raw segment files are cut down to the bytes actually stored.
+ */
+void data_store_close(void) {
+    compress_stop();
+
+    if (append_fd >= 0) {
+        close(append_fd);
+        append_fd = -1;
+    }
+    if (flat_segment.fd >= 0) {
+        close(flat_segment.fd);
+        flat_segment.fd = -1;
+    }
+
+    pthread_mutex_lock(&index_mutex);
+    for (size_t i = 0; i < segment_count; i++) {
+        Segment *seg = segments[i];
+        if (!seg->blocks && ftruncate(seg->fd, seg->used) < 0) {
+            log_msg(LOG_ERR, "ftruncate (segment %u): %s", seg->id, strerror(errno));
+        }
+        segment_put(seg);
+    }
+    free(segments);
+    segments = NULL;
+    segment_count = segment_cap = 0;
+    pthread_mutex_unlock(&index_mutex);
+
+    record_index_close();
+}
+
+/* Deletes the store files, call after data_store_close() */
+void data_store_remove(void) {
+    remove(DATA_FILE_PATH);
+    remove_segment_files();
+    record_index_remove();
+}
+
+static int append_flat(struct iovec *iov, int iovcnt, off_t length) {
+    off_t written = 0;
+
+    /* Indexed first, writev() consumes the iovec array */
+    for (int i = 0; i < iovcnt; i++) {
+        record_index_append(iov[i].iov_len, 0);
+    }
+
+    while (iovcnt > 0) {
+        int cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t n = writev(append_fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_msg(LOG_ERR, "writev (data_store): %s", strerror(errno));
+            if (written > 0 && ftruncate(append_fd, length) < 0) {
+                log_msg(LOG_ERR, "ftruncate (data_store): %s", strerror(errno));
+            }
+            return -1;
+        }
+        written += n;
+
+        /* Skip fully written entries and advance into a partially written one */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * append_segmented:
+ * Copies the records into the last segment, starting new segments as
+ * they fill up (a record larger than segment_size gets a segment of its
+ * own size). On error the segments started by this batch are deleted.
+ */
+static int append_segmented(struct iovec *iov, int iovcnt) {
+    pthread_mutex_lock(&index_mutex);
+    Segment *seg = segments[segment_count - 1];
+    size_t first_count = segment_count;
+    pthread_mutex_unlock(&index_mutex);
+    size_t first_used = seg->used;
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
+        int boundary = 0;
+
+        if (len > seg->size - seg->used) {
+            size_t size = server_config.segment_size;
+            if (size < len) size = len;
+
+            Segment *next = segment_create(seg->start + seg->used, size);
+            if (!next || index_push(next) < 0) {
+                if (next) segment_retire(next);
+                goto rollback;
+            }
+            seg = next;
+            boundary = 1;
+        }
+
+        memcpy(seg->base + seg->used, iov[i].iov_base, len);
+        seg->used += len;
+        record_index_append(len, boundary);
+    }
+    return 0;
+
+rollback:
+    pthread_mutex_lock(&index_mutex);
+    while (segment_count > first_count) {
+        Segment *extra = segments[--segment_count];
+        pthread_mutex_unlock(&index_mutex);
+        segment_retire(extra);
+        pthread_mutex_lock(&index_mutex);
+    }
+    segments[segment_count - 1]->used = first_used;
+    pthread_mutex_unlock(&index_mutex);
+    return -1;
+}
+
+/*
+ * apply_retention:
+ * Deletes the oldest segments while more than retain_segments are kept
+ * or the stored bytes exceed retain_bytes. The segment being written is
+ * always kept. Called after the new length is published.
+ */
+static void apply_retention(off_t length) {
+    if (server_config.retain_segments == 0 && server_config.retain_bytes == 0) return;
+
+    while (1) {
+        pthread_mutex_lock(&index_mutex);
+        int drop = 0;
+        if (segment_count > 1) {
+            if (server_config.retain_segments > 0 && segment_count > (size_t)server_config.retain_segments) drop = 1;
+            if (server_config.retain_bytes > 0 && length - segments[0]->start > (off_t)server_config.retain_bytes) drop = 1;
+        }
+        if (!drop) {
+            pthread_mutex_unlock(&index_mutex);
+            return;
+        }
+
+        Segment *oldest = segments[0];
+        memmove(segments, segments + 1, (segment_count - 1) * sizeof(Segment *));
+        segment_count--;
+        atomic_store_explicit(&data_start, segments[0]->start, memory_order_release);
+        pthread_mutex_unlock(&index_mutex);
+
+        segment_retire(oldest);
+    }
+}
+
+/*
+ * data_store_append:
+ * Appends all 'iovcnt' buffers (the iovec array may be consumed in the
+ * process). Only the append writer calls this.
+ * On error nothing of the batch becomes visible: the flat file is
+ * truncated back, and segments started by the batch are deleted.
+ * The new length is published after the data is written and indexed.
+ * Returns 0 on success, or -1 on error.
+ */
+int data_store_append(struct iovec *iov, int iovcnt) {
+    off_t length = atomic_load_explicit(&data_length, memory_order_relaxed);
+    off_t added = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        added += iov[i].iov_len;
+    }
+
+    int rc = segmented ? append_segmented(iov, iovcnt) : append_flat(iov, iovcnt, length);
+    if (rc < 0) {
+        record_index_rollback();
+        return -1;
+    }
+    record_index_commit();
+
+    atomic_store_explicit(&data_length, length + added, memory_order_release);
+    if (segmented) {
+        apply_retention(length + added);
+    }
+    if (compress_started) {
+        /* Only now are the segments before the last final: a failed batch takes back the ones it started */
+        pthread_mutex_lock(&index_mutex);
+        unsigned last = segments[segment_count - 1]->id;
+        if (last != sealed_id) {
+            sealed_id = last;
+            pthread_cond_signal(&compress_wakeup);
+        }
+        pthread_mutex_unlock(&index_mutex);
+    }
+    return 0;
+}
+
+/* Fills 'snap' with the range of complete records currently stored */
+void data_store_snapshot(DataSnapshot *snap) {
+    snap->end = atomic_load_explicit(&data_length, memory_order_acquire);
+    snap->start = atomic_load_explicit(&data_start, memory_order_acquire);
+    if (snap->start > snap->end) snap->start = snap->end;
+}
+
+off_t data_store_length(void) {
+    return atomic_load_explicit(&data_length, memory_order_acquire);
+}
+
+/*
+ * segment_find:
+ * Returns the segment holding store offset 'offset', with a reference
+ * taken, and cuts '*len' to the end of that segment.
+ * Returns NULL if 'offset' is no longer stored (deleted by retention).
+ */
+static Segment *segment_find(off_t offset, size_t *len) {
+    pthread_mutex_lock(&index_mutex);
+    if (segment_count == 0 || offset < segments[0]->start) {
+        pthread_mutex_unlock(&index_mutex);
+        return NULL;
+    }
+
+    /* Last segment starting at or before 'offset' */
+    size_t lo = 0, hi = segment_count - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        if (segments[mid]->start <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    Segment *seg = segments[lo];
+    if (lo + 1 < segment_count && (off_t)*len > segments[lo + 1]->start - offset) {
+        *len = segments[lo + 1]->start - offset;
+    }
+    atomic_fetch_add(&seg->refs, 1);
+    pthread_mutex_unlock(&index_mutex);
+    return seg;
+}
+
+/* Decompresses block 'i' of a compressed segment, returns its length or -1 if it is corrupt */
+static ssize_t block_decompress(const Segment *seg, size_t i, char *dst) {
+    size_t raw = block_end(seg, i) - block_start(seg, i);
+    const char *src = seg->base + seg->blocks[i];
+    size_t len = seg->blocks[i + 1] - seg->blocks[i];
+    if (len == raw) {
+        memcpy(dst, src, raw);
+        return raw;
+    }
+    if (lz_decompress(src, len, dst, raw) != (ssize_t)raw) {
+        log_msg(LOG_ERR, "corrupt block %zu of compressed segment %u", i, seg->id);
+        return -1;
+    }
+    return raw;
+}
+
+/*
+ * compressed_extent:
+ * Fills 'ext' for a compressed segment: the block holding 'offset' is
+ * decompressed into a shared chunk, once for every reader of the block
+ * at the same time (see chunk_share.h), and the extent holds the chunk.
+ */
+static int compressed_extent(Segment *seg, off_t offset, size_t len, DataExtent *ext) {
+    size_t i = block_index(seg, offset);
+    int load;
+    SharedChunk *chunk = chunk_share_acquire_from(block_start(seg, i), offset, &load);
+    if (!chunk) {
+        segment_put(seg);
+        return -1;
+    }
+    if (load) {
+        chunk_share_loaded(chunk, block_decompress(seg, i, chunk->data));
+    }
+    if (chunk_share_wait(chunk) < 0) {
+        chunk_share_release(chunk);
+        segment_put(seg);
+        return -1;
+    }
+
+    size_t avail = chunk_share_avail(chunk, offset);
+    ext->segment = seg;
+    ext->chunk = chunk;
+    ext->fd = -1;
+    ext->file_offset = 0;
+    ext->data = chunk->data + (offset - chunk->start);
+    ext->len = len < avail ? len : avail;
+    return 0;
+}
+
+/*
+ * data_store_extent:
+ * Finds the file holding store offset 'offset' and returns, in 'ext', up
+ * to 'len' bytes from there that are contiguous in that file (or in the
+ * decompressed block of a compressed segment). The caller must stay
+ * within a snapshot, and release the extent when done.
+ * Returns 0 on success, or -1 if 'offset' is no longer stored (deleted
+ * by retention).
+ */
+int data_store_extent(off_t offset, size_t len, DataExtent *ext) {
+    ext->chunk = NULL;
+    if (!segmented) {
+        ext->segment = &flat_segment;
+        ext->fd = flat_segment.fd;
+        ext->file_offset = offset;
+        ext->data = NULL;
+        ext->len = len;
+        return 0;
+    }
+
+    Segment *seg = segment_find(offset, &len);
+    if (!seg) {
+        return -1;
+    }
+    if (seg->blocks) {
+        return compressed_extent(seg, offset, len, ext);
+    }
+
+    ext->segment = seg;
+    ext->fd = seg->fd;
+    ext->file_offset = offset - seg->start;
+    ext->data = seg->base + ext->file_offset;
+    ext->len = len;
+    return 0;
+}
+
+void data_store_release_extent(DataExtent *ext) {
+    if (ext->chunk) {
+        chunk_share_release(ext->chunk);
+        ext->chunk = NULL;
+    }
+    if (ext->segment && ext->segment != &flat_segment) {
+        segment_put(ext->segment);
+    }
+    ext->segment = NULL;
+}
+
+/*
+ * data_store_compressed_block:
+ * Copies the compressed bytes of store range [start, end) into 'buf' when
+ * a compressed segment holds exactly that range as one block, so it can
+ * be sent without compressing it again. '*stored' is set if the block
+ * is kept uncompressed.
+ * Returns the bytes copied, or -1 if no such block exists (or doesn't fit).
+ */
+ssize_t data_store_compressed_block(off_t start, off_t end, char *buf, size_t cap, int *stored) {
+    if (!segmented || end <= start) return -1;
+
+    size_t len = end - start;
+    Segment *seg = segment_find(start, &len);
+    if (!seg) return -1;
+
+    ssize_t n = -1;
+    if (seg->blocks) {
+        size_t i = block_index(seg, start);
+        size_t block_len = seg->blocks[i + 1] - seg->blocks[i];
+        if (block_start(seg, i) == start && block_end(seg, i) == end && block_len <= cap) {
+            memcpy(buf, seg->base + seg->blocks[i], block_len);
+            *stored = block_len == (size_t)(end - start);
+            n = block_len;
+        }
+    }
+    segment_put(seg);
+    return n;
+}
+
+/*
+ * data_store_pread:
+ * Reads up to 'len' bytes at 'offset' (possibly fewer, at a segment end).
+ * Returns the number of bytes read, 0 at end of file, or -1 on error.
+ */
+ssize_t data_store_pread(void *buf, size_t len, off_t offset) {
+    DataExtent ext;
+    if (data_store_extent(offset, len, &ext) < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    ssize_t n;
+    if (ext.data) {
+        memcpy(buf, ext.data, ext.len);
+        n = ext.len;
+    } else {
+        do {
+            n = pread(ext.fd, buf, ext.len, ext.file_offset);
+        } while (n < 0 && errno == EINTR);
+    }
+
+    data_store_release_extent(&ext);
+    return n;
+}
+
+/* fsync()s the directory holding the store, so newly created files survive a crash */
+static int sync_data_dir(void) {
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s", DATA_FILE_PATH);
+    char *slash = strrchr(dir_path, '/');
+    if (!slash) return 0;
+    *slash = '\0';
+
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log_msg(LOG_ERR, "open (%s): %s", dir_path, strerror(errno));
+        return -1;
+    }
+    int rc = fsync(fd);
+    if (rc < 0) {
+        log_msg(LOG_ERR, "fsync (%s): %s", dir_path, strerror(errno));
+    }
+    close(fd);
+    return rc;
+}
+
+/*
+ * data_store_sync:
+ * Makes every record appended so far durable: fdatasync() of the flat
+ * file, or msync() of the segment pages written since the last sync
+ * (segments deleted by retention meanwhile are skipped). The directory
+ * is synced too after a store file was created.
+ * Only one thread may sync at a time, the append writer can keep
+ * appending meanwhile.
+ * Returns 0 on success, or -1 on error.
+ */
+int data_store_sync(void) {
+    off_t length = atomic_load_explicit(&data_length, memory_order_acquire);
+
+    if (atomic_exchange(&dir_dirty, 0) && sync_data_dir() < 0) {
+        atomic_store(&dir_dirty, 1);
+        return -1;
+    }
+
+    if (!segmented) {
+        if (fdatasync(append_fd) < 0) {
+            log_msg(LOG_ERR, "fdatasync (data_store): %s", strerror(errno));
+            return -1;
+        }
+        synced_length = length;
+        return 0;
+    }
+
+    uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    off_t from = synced_length;
+    while (from < length) {
+        size_t len = length - from;
+        Segment *seg = segment_find(from, &len);
+        if (!seg) {
+            /* Deleted by retention, continue with the oldest segment left */
+            off_t start = atomic_load_explicit(&data_start, memory_order_acquire);
+            if (start <= from) return -1;
+            from = start;
+            continue;
+        }
+
+        /* A compressed segment was synced when its file was written */
+        int rc = 0;
+        if (!seg->blocks) {
+            /* msync() needs a page aligned address */
+            const char *data = seg->base + (from - seg->start);
+            uintptr_t addr = (uintptr_t)data & ~page_mask;
+            rc = msync((void *)addr, (uintptr_t)data + len - addr, MS_SYNC);
+            if (rc < 0) {
+                log_msg(LOG_ERR, "msync (segment %u): %s", seg->id, strerror(errno));
+            }
+        }
+        from += len;
+        segment_put(seg);
+        if (rc < 0) return -1;
+    }
+    synced_length = length;
+    return 0;
+}
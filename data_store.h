@@ -0,0 +1,82 @@
+#ifndef DATA_STORE_H
+#define DATA_STORE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SEGMENT_PATH_FORMAT DATA_FILE_PATH ".%06u" // segment files, numbered from 0
+#define COMPRESSED_SEGMENT_PATH_FORMAT SEGMENT_PATH_FORMAT ".lz" // segment files once compressed
+
+/*
+ * The data store holds the stream of records, in one of two layouts:
+ *
+ * - flat (server_config.segment_size == 0): DATA_FILE_PATH, kept open for
+ *   the whole server lifetime. One O_APPEND descriptor used only by the
+ *   append writer, and one read-only descriptor shared by every reader
+ *   through pread() (no file position is shared).
+ *
+ * - segmented: fixed-size segment files (SEGMENT_PATH_FORMAT), each mapped
+ *   in memory for both appending (memcpy, no syscall per record) and
+ *   reading. When a record doesn't fit in the current segment a new one
+ *   is started, and the oldest segments are deleted to stay within the
+ *   retention limits (server_config.retain_segments/retain_bytes).
+ *   Records never span segments. With server_config.compress_segments,
+ *   a background thread rewrites each sealed segment (every one but the
+ *   last) as a file of LZ4-compressed blocks with a block index
+ *   (COMPRESSED_SEGMENT_PATH_FORMAT), which replaces the raw file.
+ *
+ * Either way, store offsets are contiguous: the logical length is kept in
+ * memory and only advances after a complete append, so readers never see
+ * part of a record. Every record appended is added to the record index
+ * (see record_index.h) before it becomes visible.
+ */
+
+struct Segment;
+struct SharedChunk;
+
+/*
+ * DataSnapshot:
+ * A consistent byte range of the stored data, [start, end).
+ * Bytes in this range never change once handed out (but the oldest may
+ * be deleted by retention in the segmented layout).
+ */
+typedef struct DataSnapshot {
+    off_t start;
+    off_t end;
+} DataSnapshot;
+
+/*
+ * DataExtent:
+ * A piece of the store held contiguously by one file, returned by
+ * data_store_extent(). The file (and mapping) stays valid until the
+ * extent is released, even if retention deletes its segment meanwhile.
+ * The bytes of a compressed segment are only in memory: 'fd' is -1.
+ */
+typedef struct DataExtent {
+    struct Segment *segment; // reference held until data_store_release_extent()
+    struct SharedChunk *chunk; // decompressed block of a compressed segment, held likewise
+    int fd;                  // file holding the bytes, for sendfile()/splice()/pread(), -1 if none
+    off_t file_offset;       // where the bytes start in 'fd'
+    const char *data;        // the bytes in memory (segmented layout), NULL for the flat file
+    size_t len;
+} DataExtent;
+
+int data_store_open(void);
+void data_store_close(void);
+void data_store_detach(void);
+void data_store_remove(void);
+
+int data_store_append(struct iovec *iov, int iovcnt);
+
+void data_store_snapshot(DataSnapshot *snap);
+off_t data_store_length(void);
+ssize_t data_store_pread(void *buf, size_t len, off_t offset);
+
+int data_store_extent(off_t offset, size_t len, DataExtent *ext);
+void data_store_release_extent(DataExtent *ext);
+ssize_t data_store_compressed_block(off_t start, off_t end, char *buf, size_t cap, int *stored);
+
+int data_store_sync(void);
+
+#endif /* DATA_STORE_H */
@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "data_sync.h"
+#include "data_store.h"
+#include "simple_stream_server.h"
+#include "metrics.h"
+#include "async_log.h"
+
+static pthread_t flusher_thread;
+static int flusher_started = 0;
+static int flusher_stopping = 0;  // set by data_sync_stop(), the flusher syncs what is left and exits
+
+/* Bytes appended and not synced yet, protected by sync_mutex */
+static size_t pending_bytes = 0;
+
+static DataSyncStats stats;       // protected by sync_mutex
+
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_wakeup = PTHREAD_COND_INITIALIZER;
+
+/*
+ * sync_store:
+ * Syncs the data store and counts the outcome, 'bytes' being what the
+ * sync made durable.
+ * Returns 0 on success, or -1 on error.
+ */
+static int sync_store(size_t bytes) {
+    uint64_t start = metrics_now_ns();
+    int rc = data_store_sync();
+    uint64_t elapsed = metrics_now_ns() - start;
+
+    pthread_mutex_lock(&sync_mutex);
+    if (rc == 0) {
+        stats.syncs++;
+        stats.bytes += bytes;
+        stats.total_ns += elapsed;
+        if (elapsed > stats.max_ns) stats.max_ns = elapsed;
+    } else {
+        stats.failures++;
+    }
+    pthread_mutex_unlock(&sync_mutex);
+    return rc;
+}
+
+static void interval_deadline(struct timespec *ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += server_config.sync_interval_ms / 1000;
+    ts->tv_nsec += (server_config.sync_interval_ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * flusher_thread_func:
+ * Periodic durability. Sleeps until something is appended, then syncs
+ * it sync_interval_ms later, or as soon as sync_bytes are pending.
+ */
+static void *flusher_thread_func(void *arg) {
+    (void)arg; // quiet unused variable warning
+    metrics_thread_init();
+
+    while (1) {
+        pthread_mutex_lock(&sync_mutex);
+        while (pending_bytes == 0 && !flusher_stopping) {
+            pthread_cond_wait(&sync_wakeup, &sync_mutex);
+        }
+
+        struct timespec ts;
+        interval_deadline(&ts);
+        while (!flusher_stopping &&
+               (server_config.sync_bytes == 0 || pending_bytes < server_config.sync_bytes)) {
+            if (pthread_cond_timedwait(&sync_wakeup, &sync_mutex, &ts) == ETIMEDOUT) break;
+        }
+
+        size_t bytes = pending_bytes;
+        pending_bytes = 0;
+        int stopping = flusher_stopping;
+        pthread_mutex_unlock(&sync_mutex);
+
+        if (bytes > 0 && sync_store(bytes) < 0) {
+            /* Retried with the next interval */
+            pthread_mutex_lock(&sync_mutex);
+            pending_bytes += bytes;
+            pthread_mutex_unlock(&sync_mutex);
+        }
+        if (stopping) break;
+    }
+
+    log_msg(LOG_INFO, "Exiting flusher thread, tid: %lu", pthread_self());
+    return NULL;
+}
+
+/*
+ * data_sync_start:
+ * Creates the flusher thread in periodic durability mode.
+ * Returns 0 on success, or -1 on error.
+ */
+int data_sync_start(void) {
+    if (server_config.durability != DURABILITY_PERIODIC) return 0;
+
+    int rc = pthread_create(&flusher_thread, NULL, flusher_thread_func, NULL);
+    if (rc != 0) {
+        log_msg(LOG_ERR, "pthread_create (flusher): %s", strerror(rc));
+        return -1;
+    }
+    flusher_started = 1;
+    return 0;
+}
+
+/*
+ * data_sync_stop:
+ * Syncs what is still pending, joins the flusher and logs the counters.
+ * Call after the append writer was stopped.
+ */
+void data_sync_stop(void) {
+    if (flusher_started) {
+        pthread_mutex_lock(&sync_mutex);
+        flusher_stopping = 1;
+        pthread_cond_signal(&sync_wakeup);
+        pthread_mutex_unlock(&sync_mutex);
+
+        pthread_join(flusher_thread, NULL);
+        flusher_started = 0;
+    }
+
+    if (server_config.durability == DURABILITY_NONE) return;
+
+    DataSyncStats s;
+    data_sync_get_stats(&s);
+    log_msg(LOG_INFO, "Data syncs: %llu (%llu failed), %llu bytes, avg %llu us, max %llu us",
+           (unsigned long long)s.syncs, (unsigned long long)s.failures, (unsigned long long)s.bytes,
+           (unsigned long long)(s.syncs ? s.total_ns / s.syncs / 1000 : 0),
+           (unsigned long long)(s.max_ns / 1000));
+}
+
+/*
+ * data_sync_appended:
+ * Called by the append writer after each batch of 'len' bytes was
+ * appended, before its records are answered. Syncs it right away in
+ * sync mode, otherwise only accounts for it.
+ * Returns 0 on success, or -1 if the batch could not be made durable.
+ */
+int data_sync_appended(size_t len) {
+    switch (server_config.durability) {
+        case DURABILITY_SYNC:
+            return sync_store(len);
+        case DURABILITY_PERIODIC:
+            pthread_mutex_lock(&sync_mutex);
+            pending_bytes += len;
+            /* Wakes the flusher for the first unsynced bytes, and when sync_bytes is reached */
+            if (pending_bytes == len ||
+                (server_config.sync_bytes > 0 && pending_bytes >= server_config.sync_bytes)) {
+                pthread_cond_signal(&sync_wakeup);
+            }
+            pthread_mutex_unlock(&sync_mutex);
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+void data_sync_get_stats(DataSyncStats *out) {
+    pthread_mutex_lock(&sync_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&sync_mutex);
+}
@@ -0,0 +1,45 @@
+#ifndef DATA_SYNC_H
+#define DATA_SYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_SYNC_INTERVAL_MS 100       // periodic durability: longest time data stays unsynced
+#define DEFAULT_SYNC_BYTES (4 * 1024 * 1024) // periodic durability: unsynced bytes that trigger an early sync
+
+/*
+ * Durability of the data store, selected with server_config.durability:
+ *
+ * - none: records are answered once they are in the page cache, the
+ *   kernel writes them back whenever it wants.
+ * - periodic: a background flusher syncs the store every
+ *   sync_interval_ms, or earlier once sync_bytes are unsynced. Records
+ *   are answered before they are synced (at most one interval is lost).
+ * - sync: the append writer syncs every batch before its records are
+ *   answered. Group commit shares one sync between all the records of
+ *   a batch.
+ *
+ * Syncs are data_store_sync() calls, their latency is counted in
+ * DataSyncStats.
+ */
+
+/*
+ * DataSyncStats:
+ * Counters of the syncs done since the server started.
+ */
+typedef struct DataSyncStats {
+    uint64_t syncs;     // successful syncs
+    uint64_t failures;  // failed syncs
+    uint64_t bytes;     // bytes made durable
+    uint64_t total_ns;  // time spent in successful syncs
+    uint64_t max_ns;    // slowest successful sync
+} DataSyncStats;
+
+int data_sync_start(void);
+void data_sync_stop(void);
+
+int data_sync_appended(size_t len);
+
+void data_sync_get_stats(DataSyncStats *stats);
+
+#endif /* DATA_SYNC_H */
@@ -0,0 +1,708 @@
+#define _GNU_SOURCE // accept4()
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "event_loop.h"
+#include "simple_stream_server.h"
+#include "append_writer.h"
+#include "data_store.h"
+#include "recv_buffer.h"
+#include "query.h"
+#include "metrics.h"
+#include "async_log.h"
+#include "admission.h"
+#include "out_queue.h"
+#include "hot_restart.h"
+
+#define MAX_EVENTS 256          // events fetched per epoll_wait() call
+#define EPOLL_TIMEOUT_MS 1000   // wake up at least once a second to check keep_running, sooner for timers
+
+extern volatile sig_atomic_t keep_running;
+
+/*
+ * ConnState:
+ * Each connection walks RECV -> APPEND -> SEND and is then closed,
+ * mirroring the blocking connection_handler(). With keep-alive the reply
+ * is queued to the output queue and the connection goes back to RECV
+ * right away, so the next packets are read while it is being sent.
+ * Queries skip APPEND.
+ */
+typedef enum ConnState {
+    CONN_RECV,    // accumulating bytes until a '\n' is received
+    CONN_APPEND,  // packet queued to the append writer, waiting for it to be written
+    CONN_SEND,    // last reply queued, closed once the output queue is empty
+} ConnState;
+
+/*
+ * Deadline:
+ * What the connection timer is armed for. Only CONN_RECV waits on the
+ * client, the other states wait on the server and have no deadline.
+ */
+typedef enum Deadline {
+    DEADLINE_NONE,
+    DEADLINE_IDLE,  // no byte of the next packet yet, server_config.idle_timeout_ms
+    DEADLINE_READ,  // packet started, server_config.read_timeout_ms from its first byte
+    DEADLINE_SLOW,  // reads stopped over max_pending, server_config.slow_timeout_ms (disconnect policy)
+} Deadline;
+
+/*
+ * Connection:
+ * Per-client state kept by the event loop instead of a thread stack.
+ * Buffers are only allocated while they are needed, so idle clients
+ * cost little more than this struct and a socket.
+ */
+typedef struct Connection {
+    int fd;                        // client socket (non-blocking)
+    char ip_str[INET_ADDRSTRLEN];
+    in_addr_t addr;                // client address, released from admission control on close
+    ConnState state;
+
+    RecvBuffer rbuf;               // received bytes of the current packet, taken from the pool on first read
+
+    uint64_t append_seq;           // append writer sequence number while in CONN_APPEND
+    struct Connection *wait_prev;  // links in loop->wait_head while in CONN_APPEND
+    struct Connection *wait_next;
+
+    OutQueue out;                  // replies not sent yet, flushed on EPOLLOUT
+    int compress;                  // replies are compressed, negotiated with "?compress lz4"
+    int served;                    // a packet was answered, closed between packets while a takeover drains
+    int finishing;                 // final reply queued, nothing more is appended (see hot_restart_finishing())
+    Timer stall;                   // armed while the output queue waits on the client, server_config.send_timeout_ms
+
+    Timer timer;                   // idle, read or slow consumer deadline in loop->timers
+    Deadline deadline;
+    Timer throttle;                // armed while reads are paused by the byte rate of the address
+
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+/* Raise the open file limit to its hard maximum so the loop can hold many idle clients */
+static void raise_nofile_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            log_msg(LOG_ERR, "setrlimit(RLIMIT_NOFILE): %s", strerror(errno));
+        }
+    }
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_msg(LOG_ERR, "fcntl(O_NONBLOCK): %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void wait_list_remove(EventLoop *loop, Connection *conn) {
+    if (conn->wait_prev) conn->wait_prev->wait_next = conn->wait_next;
+    else loop->wait_head = conn->wait_next;
+    if (conn->wait_next) conn->wait_next->wait_prev = conn->wait_prev;
+    else loop->wait_tail = conn->wait_prev;
+    conn->wait_prev = conn->wait_next = NULL;
+}
+
+static void conn_close(EventLoop *loop, Connection *conn) {
+    if (conn->state == CONN_APPEND) wait_list_remove(loop, conn);
+    timer_cancel(&loop->timers, &conn->timer);
+    timer_cancel(&loop->timers, &conn->throttle);
+    timer_cancel(&loop->timers, &conn->stall);
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->finishing) hot_restart_finishing(-1);
+    admission_release(conn->addr);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    loop->conn_count--;
+
+    log_msg(LOG_INFO, "Closed connection from %s", conn->ip_str);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+
+    recv_buffer_release(&conn->rbuf);
+    out_queue_release(&conn->out);
+    free(conn);
+}
+
+/* Deadline expired: the client was idle for too long, or is sending its packet too slowly */
+static void on_conn_timer(Timer *timer, void *arg) {
+    EventLoop *loop = arg;
+    Connection *conn = (Connection *)((char *)timer - offsetof(Connection, timer));
+
+    if (conn->deadline == DEADLINE_SLOW) {
+        log_msg(LOG_INFO, "Slow consumer, closing connection from %s", conn->ip_str);
+        metrics_add(METRIC_SLOW_CLOSED_PENDING, 1);
+    } else {
+        log_msg(LOG_INFO, "%s timeout, closing connection from %s",
+                conn->deadline == DEADLINE_IDLE ? "Idle" : "Read", conn->ip_str);
+        metrics_add(METRIC_CONNECTIONS_TIMED_OUT, 1);
+    }
+    conn_close(loop, conn);
+}
+
+/*
+ * conn_wait_recv:
+ * Called each time a connection waits for more bytes. Between packets
+ * the idle deadline is pushed back, while a packet is partially received
+ * the read deadline set at its first byte is kept: trickling bytes does
+ * not keep a connection open (slowloris).
+ */
+static void conn_wait_recv(EventLoop *loop, Connection *conn) {
+    if (conn->rbuf.len == 0) {
+        conn->deadline = DEADLINE_IDLE;
+        if (server_config.idle_timeout_ms > 0) {
+            timer_add(&loop->timers, &conn->timer, server_config.idle_timeout_ms, on_conn_timer, loop);
+        } else {
+            timer_cancel(&loop->timers, &conn->timer);
+        }
+    } else if (conn->deadline != DEADLINE_READ) {
+        conn->deadline = DEADLINE_READ;
+        if (server_config.read_timeout_ms > 0) {
+            timer_add(&loop->timers, &conn->timer, server_config.read_timeout_ms, on_conn_timer, loop);
+        } else {
+            timer_cancel(&loop->timers, &conn->timer);
+        }
+    }
+}
+
+/*
+ * Return values of the per-state handlers below.
+ */
+#define CONN_CLOSED   -1  // the connection was closed and freed
+#define CONN_WAIT      0  // waiting for an event (socket readiness or append commit)
+#define CONN_PROGRESS  1  // state changed, run the handler of the new state
+
+/* The client read nothing of its pending output for server_config.send_timeout_ms */
+static void on_stall_timer(Timer *timer, void *arg) {
+    EventLoop *loop = arg;
+    Connection *conn = (Connection *)((char *)timer - offsetof(Connection, stall));
+
+    log_msg(LOG_INFO, "Send timeout, closing connection from %s", conn->ip_str);
+    metrics_add(METRIC_SLOW_CLOSED_TIMEOUT, 1);
+    conn_close(loop, conn);
+}
+
+/*
+ * conn_flush:
+ * Sends the output queue until it is empty or the socket buffer is full
+ * (resumed on the next EPOLLOUT edge). The send timeout runs from the
+ * last time the client took some bytes.
+ */
+static int conn_flush(EventLoop *loop, Connection *conn) {
+    if (out_queue_empty(&conn->out)) {
+        return CONN_PROGRESS;
+    }
+
+    size_t before = conn->out.bytes;
+    int rc = out_queue_flush(&conn->out, conn->fd);
+    if (rc < 0) {
+        conn_close(loop, conn);
+        return CONN_CLOSED;
+    }
+    if (rc == 0 || server_config.send_timeout_ms == 0) {
+        timer_cancel(&loop->timers, &conn->stall);
+    } else if (conn->out.bytes < before || !timer_armed(&conn->stall)) {
+        timer_add(&loop->timers, &conn->stall, server_config.send_timeout_ms, on_stall_timer, loop);
+    }
+    return CONN_PROGRESS;
+}
+
+/*
+ * conn_send:
+ * Last reply of a connection without keep-alive: closes it once the
+ * output queue is empty.
+ */
+static int conn_send(EventLoop *loop, Connection *conn) {
+    if (!out_queue_empty(&conn->out)) {
+        return CONN_WAIT;
+    }
+    conn_close(loop, conn);
+    return CONN_CLOSED;
+}
+
+/* The last reply is queued: a takeover doesn't wait for the connection anymore */
+static void conn_finish(Connection *conn) {
+    conn->state = CONN_SEND;
+    if (!conn->finishing) {
+        conn->finishing = 1;
+        hot_restart_finishing(1);
+    }
+}
+
+/*
+ * conn_queue_reply:
+ * Queues the snapshot (or the part of it requested by 'query', when not
+ * NULL) to the output queue once the packet was written, and moves the
+ * connection on: back to CONN_RECV with keep-alive (or after "?compress
+ * lz4", which doesn't end the connection), to CONN_SEND otherwise or
+ * while a takeover drains.
+ */
+static int conn_queue_reply(EventLoop *loop, Connection *conn, const Query *query) {
+    int negotiate = query && query->type == QUERY_COMPRESS;
+    if (negotiate) {
+        conn->compress = 1;
+    }
+
+    DataSnapshot snap;
+    data_store_snapshot(&snap);
+    if (query) query_resolve(query, &snap);
+    int rc = conn->compress ? out_queue_push_compressed(&conn->out, snap.start, snap.end)
+                            : out_queue_push_range(&conn->out, snap.start, snap.end);
+    if (rc < 0) {
+        log_msg(LOG_ERR, "output queue full, socket: %u", conn->fd);
+        conn_close(loop, conn);
+        return CONN_CLOSED;
+    }
+    if (negotiate) {
+        conn->state = CONN_RECV;
+    } else if (server_config.keep_alive && hot_restart_state() == HOT_RESTART_RUNNING) {
+        conn->state = CONN_RECV;
+        conn->served = 1;
+    } else {
+        conn_finish(conn);
+    }
+
+    return CONN_PROGRESS;
+}
+
+/*
+ * conn_over_pending:
+ * Applies server_config.slow_consumer before the next packet is handled,
+ * when the client left more than max_pending bytes (or OUT_QUEUE_SLOTS
+ * replies) unread. Returns CONN_WAIT to stop reading until the queue
+ * drains, or CONN_PROGRESS to go on.
+ */
+static int conn_over_pending(EventLoop *loop, Connection *conn) {
+    if (conn->out.bytes <= server_config.max_pending && !out_queue_full(&conn->out)) {
+        if (conn->deadline == DEADLINE_SLOW) {
+            /* Caught up in time */
+            timer_cancel(&loop->timers, &conn->timer);
+            conn->deadline = DEADLINE_NONE;
+        }
+        return CONN_PROGRESS;
+    }
+
+    if (server_config.slow_consumer == SLOW_CONSUMER_DROP) {
+        metrics_add(METRIC_REPLIES_DROPPED, out_queue_drop(&conn->out));
+        return CONN_PROGRESS;
+    }
+
+    /* The socket stays readable, conn_run() reads on once the output drained.
+     * The send timeout replaces the idle and read deadlines meanwhile, with the
+     * disconnect policy the client must also catch up within slow_timeout_ms. */
+    if (server_config.slow_consumer == SLOW_CONSUMER_DISCONNECT && server_config.slow_timeout_ms > 0) {
+        if (conn->deadline != DEADLINE_SLOW) {
+            conn->deadline = DEADLINE_SLOW;
+            timer_add(&loop->timers, &conn->timer, server_config.slow_timeout_ms, on_conn_timer, loop);
+        }
+    } else {
+        timer_cancel(&loop->timers, &conn->timer);
+        conn->deadline = DEADLINE_NONE;
+    }
+    return CONN_WAIT;
+}
+
+/*
+ * conn_packet:
+ * Handles the complete packet at the start of the receive buffer.
+ * Bytes after it (pipelined packets) stay in the buffer.
+ * Queries are answered right away, data packets are queued to the append
+ * writer and the connection waits in CONN_APPEND until it was written.
+ */
+static int conn_packet(EventLoop *loop, Connection *conn, size_t len) {
+    /* The next packet gets deadlines of its own */
+    timer_cancel(&loop->timers, &conn->timer);
+    conn->deadline = DEADLINE_NONE;
+
+    Query query;
+    if (query_parse(conn->rbuf.data, len, &query)) {
+        recv_buffer_consume(&conn->rbuf, len);
+        return conn_queue_reply(loop, conn, &query);
+    }
+
+    char *record = recv_buffer_take(&conn->rbuf, len);
+    conn->append_seq = record ? append_writer_submit(record, len) : 0;
+    if (conn->append_seq == 0) {
+        conn_close(loop, conn);
+        return CONN_CLOSED;
+    }
+
+    conn->state = CONN_APPEND;
+    conn->wait_prev = loop->wait_tail;
+    conn->wait_next = NULL;
+    if (loop->wait_tail) loop->wait_tail->wait_next = conn;
+    else loop->wait_head = conn;
+    loop->wait_tail = conn;
+    return CONN_WAIT;
+}
+
+static void conn_run(EventLoop *loop, Connection *conn);
+
+/* The address is back under its byte rate: read what the client sent meanwhile */
+static void on_throttle_timer(Timer *timer, void *arg) {
+    EventLoop *loop = arg;
+    Connection *conn = (Connection *)((char *)timer - offsetof(Connection, throttle));
+    conn_run(loop, conn);
+}
+
+/*
+ * conn_recv:
+ * Drains the socket (required with EPOLLET) into the packet buffer, after
+ * checking the bytes already buffered for a pipelined packet.
+ * Only newly received bytes are scanned for '\n'.
+ */
+static int conn_recv(EventLoop *loop, Connection *conn) {
+    /* Paused until the client read its replies, or by the byte rate (on_throttle_timer() reads on) */
+    if (conn_over_pending(loop, conn) == CONN_WAIT || timer_armed(&conn->throttle)) {
+        return CONN_WAIT;
+    }
+
+    while (1) {
+        char *nl = recv_buffer_find_newline(&conn->rbuf);
+        if (nl) {
+            return conn_packet(loop, conn, nl - conn->rbuf.data + 1);
+        }
+
+        if (recv_buffer_reserve(&conn->rbuf) < 0) {
+            log_msg(LOG_ERR, "packet too large or out of memory, socket: %u", conn->fd);
+            conn_close(loop, conn);
+            return CONN_CLOSED;
+        }
+
+        ssize_t n = recv(conn->fd, conn->rbuf.data + conn->rbuf.len, conn->rbuf.cap - conn->rbuf.len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Idle connections don't keep a buffer, unless a partial packet is pending */
+                if (conn->rbuf.len == 0) recv_buffer_release(&conn->rbuf);
+                conn_wait_recv(loop, conn);
+                return CONN_WAIT;
+            }
+            log_msg(LOG_ERR, "recv: %s", strerror(errno));
+            conn_close(loop, conn);
+            return CONN_CLOSED;
+        }
+        if (n == 0) {
+            log_msg(LOG_INFO, "Connection closed by peer, socket: %u", conn->fd);
+            conn_close(loop, conn);
+            return CONN_CLOSED;
+        }
+
+        conn->rbuf.len += n;
+        metrics_add(METRIC_BYTES_RECEIVED, n);
+
+        /* Over the byte rate of its address: stop reading (the socket stays readable,
+         * so no edge is missed) until the debt is paid back. The read deadline still runs. */
+        uint64_t throttle_ms = admission_consume(conn->addr, n);
+        if (throttle_ms > 0) {
+            timer_add(&loop->timers, &conn->throttle, throttle_ms, on_throttle_timer, loop);
+            conn_wait_recv(loop, conn);
+            return CONN_WAIT;
+        }
+    }
+}
+
+/*
+ * conn_run:
+ * Flushes the output queue, then runs the handler of the current state
+ * until the connection has to wait for an event or is closed. Iterative,
+ * so a long run of pipelined packets doesn't grow the stack.
+ */
+static void conn_run(EventLoop *loop, Connection *conn) {
+    int rc = CONN_PROGRESS;
+    while (rc == CONN_PROGRESS) {
+        if (conn_flush(loop, conn) == CONN_CLOSED) {
+            return;
+        }
+        switch (conn->state) {
+            case CONN_RECV:
+                rc = conn_recv(loop, conn);
+                break;
+            case CONN_SEND:
+                rc = conn_send(loop, conn);
+                break;
+            case CONN_APPEND:
+            default:
+                rc = CONN_WAIT;
+                break;
+        }
+    }
+}
+
+/*
+ * resume_appended:
+ * Called when the append writer signals a commit. Records are committed in
+ * sequence order, so only the front of the FIFO has to be checked.
+ */
+static void resume_appended(EventLoop *loop) {
+    uint64_t count;
+    if (read(loop->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_msg(LOG_ERR, "read (notify_fd): %s", strerror(errno));
+    }
+
+    while (loop->wait_head) {
+        Connection *conn = loop->wait_head;
+        int status = append_writer_poll(conn->append_seq);
+        if (status == 1) {
+            break;
+        }
+
+        wait_list_remove(loop, conn);
+        conn->state = CONN_SEND;
+        if (status < 0) {
+            conn_close(loop, conn);
+        } else if (conn_queue_reply(loop, conn, NULL) != CONN_CLOSED) {
+            conn_run(loop, conn);
+        }
+    }
+}
+
+/* Accepts every pending connection on the listening socket */
+static void accept_connections(EventLoop *loop) {
+    while (keep_running) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        int client_sockfd = accept4(loop->listen_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK);
+        if (client_sockfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_msg(LOG_ERR, "accept: %s", strerror(errno));
+            }
+            return;
+        }
+
+        /* Over the connection limits: close it before anything is allocated for it */
+        if (admission_acquire(client_addr.sin_addr.s_addr) != 0) {
+            close(client_sockfd);
+            continue;
+        }
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            log_msg(LOG_ERR, "Connection calloc: %s", strerror(errno));
+            close(client_sockfd);
+            admission_release(client_addr.sin_addr.s_addr);
+            continue;
+        }
+        conn->fd = client_sockfd;
+        conn->addr = client_addr.sin_addr.s_addr;
+        conn->state = CONN_RECV;
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->ip_str, sizeof(conn->ip_str));
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_sockfd, &ev) < 0) {
+            log_msg(LOG_ERR, "epoll_ctl(ADD client): %s", strerror(errno));
+            close(client_sockfd);
+            admission_release(conn->addr);
+            free(conn);
+            continue;
+        }
+
+        conn->next = loop->conns;
+        if (loop->conns) loop->conns->prev = conn;
+        loop->conns = conn;
+        loop->conn_count++;
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+        conn_wait_recv(loop, conn);
+
+        log_msg(LOG_INFO, "Accepted connection from %s", conn->ip_str);
+    }
+}
+
+/*
+ * event_loop_init:
+ * Creates the epoll instance and registers the listening socket with it.
+ * Returns 0 on success, or -1 on error.
+ */
+int event_loop_init(EventLoop *loop, int listen_fd) {
+    memset(loop, 0, sizeof(*loop));
+    loop->listen_fd = listen_fd;
+    loop->notify_fd = -1;
+    timer_wheel_init(&loop->timers);
+
+    raise_nofile_limit();
+
+    if (set_nonblocking(listen_fd) < 0) {
+        return -1;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        log_msg(LOG_ERR, "epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+
+    /* data.ptr == NULL identifies the listening socket */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        log_msg(LOG_ERR, "epoll_ctl(ADD listener): %s", strerror(errno));
+        event_loop_destroy(loop);
+        return -1;
+    }
+    loop->accepting = 1;
+    hot_restart_accepting(1);
+
+    /* data.ptr == loop identifies the append writer notification eventfd */
+    loop->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->notify_fd < 0) {
+        log_msg(LOG_ERR, "eventfd: %s", strerror(errno));
+        event_loop_destroy(loop);
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->notify_fd, &ev) < 0) {
+        log_msg(LOG_ERR, "epoll_ctl(ADD notify_fd): %s", strerror(errno));
+        event_loop_destroy(loop);
+        return -1;
+    }
+    if (append_writer_add_listener(loop->notify_fd) < 0) {
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * update_accepting:
+ * Follows the hot restart state: while a takeover drains, the listener is
+ * taken out of the loop and the connections already answered are closed
+ * between packets (the others get the reply to the packet they send).
+ * Accepts resume if the takeover is aborted.
+ */
+static void update_accepting(EventLoop *loop) {
+    int accept = hot_restart_state() == HOT_RESTART_RUNNING;
+    if (accept == loop->accepting) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, accept ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, loop->listen_fd, &ev) < 0) {
+        log_msg(LOG_ERR, "epoll_ctl(%s listener): %s", accept ? "ADD" : "DEL", strerror(errno));
+        return;
+    }
+    loop->accepting = accept;
+    hot_restart_accepting(accept ? 1 : -1);
+    if (accept) {
+        return;
+    }
+
+    Connection *conn = loop->conns;
+    while (conn) {
+        Connection *next = conn->next;
+        if (conn->state == CONN_RECV && conn->served && conn->rbuf.len == 0) {
+            timer_cancel(&loop->timers, &conn->timer);
+            conn->deadline = DEADLINE_NONE;
+            conn_finish(conn);
+            conn_run(loop, conn); // closed once its output queue is empty
+        }
+        conn = next;
+    }
+}
+
+/*
+ * event_loop_run:
+ * Dispatches socket readiness to the per-connection state machine and
+ * runs the expired timers until keep_running is cleared, or the listener
+ * was handed over and the last connection closed. epoll_wait() sleeps
+ * until the next timer is due, there is no timer thread.
+ */
+void event_loop_run(EventLoop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (keep_running) {
+        update_accepting(loop);
+        if (!loop->accepting && hot_restart_state() == HOT_RESTART_HANDED_OFF && loop->conn_count == 0) {
+            break;
+        }
+
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timer_wheel_timeout(&loop->timers, EPOLL_TIMEOUT_MS));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_msg(LOG_ERR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        int appended = 0;
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+
+            if (conn == NULL) {
+                accept_connections(loop);
+                continue;
+            }
+            if ((void *)conn == (void *)loop) {
+                appended = 1;
+                continue;
+            }
+
+            if (ev & EPOLLERR) {
+                conn_close(loop, conn);
+                continue;
+            }
+
+            if ((conn->state == CONN_RECV && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) ||
+                (!out_queue_empty(&conn->out) && (ev & (EPOLLOUT | EPOLLHUP)))) {
+                conn_run(loop, conn);
+            }
+        }
+
+        /* After the events: a connection whose reply completes (or closed by its timer)
+         * may have had one in 'events' */
+        if (appended) resume_appended(loop);
+        timer_wheel_advance(&loop->timers);
+    }
+}
+
+/*
+ * event_loop_destroy:
+ * Closes every remaining connection and the epoll instance.
+ * The listening socket is owned by the caller.
+ */
+void event_loop_destroy(EventLoop *loop) {
+    while (loop->conns) {
+        conn_close(loop, loop->conns);
+    }
+    if (loop->accepting) {
+        hot_restart_accepting(-1);
+        loop->accepting = 0;
+    }
+    if (loop->notify_fd >= 0) {
+        append_writer_remove_listener(loop->notify_fd);
+        close(loop->notify_fd);
+        loop->notify_fd = -1;
+    }
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+}
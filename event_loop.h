@@ -0,0 +1,30 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "timer_wheel.h"
+
+struct Connection;
+
+/*
+ * EventLoop:
+ * An epoll instance that owns a listening socket and every connection
+ * accepted from it. All sockets are non-blocking and registered
+ * edge-triggered, so a single thread can drive thousands of clients.
+ */
+typedef struct EventLoop {
+    int epfd;                  // epoll file descriptor
+    int listen_fd;             // listening socket (non-blocking)
+    int accepting;             // listen_fd is registered, not while a takeover drains (see hot_restart.h)
+    int notify_fd;             // eventfd written by the append writer after each commit
+    struct Connection *conns;  // doubly linked list of open connections
+    int conn_count;            // number of entries in 'conns'
+    struct Connection *wait_head; // FIFO of connections waiting for their record to be written,
+    struct Connection *wait_tail; // in submit (sequence number) order
+    TimerWheel timers;         // connection deadlines, and the server timers on the main thread's loop
+} EventLoop;
+
+int event_loop_init(EventLoop *loop, int listen_fd);
+void event_loop_run(EventLoop *loop);
+void event_loop_destroy(EventLoop *loop);
+
+#endif /* EVENT_LOOP_H */
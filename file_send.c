@@ -0,0 +1,341 @@
+#define _GNU_SOURCE // splice()
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "file_send.h"
+#include "data_store.h"
+#include "record_cache.h"
+#include "chunk_share.h"
+#include "simple_stream_server.h"
+#include "metrics.h"
+#include "async_log.h"
+
+#define COPY_CHUNK (16 * 1024)          // bytes copied per send() from the record cache
+#define SPLICE_CHUNK (64 * 1024)        // bytes moved through the pipe per splice(), default pipe capacity
+#define SENDFILE_CHUNK (1024 * 1024 * 1024) // cap per sendfile() call
+
+/* Cleared when the kernel rejects sendfile()/splice() for these descriptors */
+static atomic_int sendfile_supported = 1;
+static atomic_int splice_supported = 1;
+
+/* One pipe per thread for splice(), closed when the thread exits */
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_key_once = PTHREAD_ONCE_INIT;
+
+static void pipe_destructor(void *ptr) {
+    int *fds = (int *)ptr;
+    close(fds[0]);
+    close(fds[1]);
+    free(fds);
+}
+
+static void pipe_key_create(void) {
+    pthread_key_create(&pipe_key, pipe_destructor);
+}
+
+static int *thread_pipe(void) {
+    pthread_once(&pipe_key_once, pipe_key_create);
+
+    int *fds = pthread_getspecific(pipe_key);
+    if (fds) return fds;
+
+    fds = malloc(2 * sizeof(int));
+    if (!fds) {
+        log_msg(LOG_ERR, "pipe malloc: %s", strerror(errno));
+        return NULL;
+    }
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_msg(LOG_ERR, "pipe2: %s", strerror(errno));
+        free(fds);
+        return NULL;
+    }
+    pthread_setspecific(pipe_key, fds);
+    return fds;
+}
+
+/* Throws away bytes left in the pipe after a short splice to the socket */
+static void drain_pipe(int fd) {
+    char scratch[4096];
+    while (read(fd, scratch, sizeof(scratch)) > 0);
+}
+
+/*
+ * send_buffer:
+ * Sends 'len' bytes holding the data at *offset, advancing *offset by
+ * what reached the socket; the rest is read again on the next call.
+ * Returns 0 when all was sent, 1 if the socket would block, or -1 on error.
+ */
+static int send_buffer(int sockfd, const char *buffer, size_t len, off_t *offset) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t s = send(sockfd, buffer + sent, len - sent, MSG_NOSIGNAL);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            *offset += sent;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            log_msg(LOG_ERR, "send: %s", strerror(errno));
+            return -1;
+        }
+        sent += s;
+    }
+    *offset += len;
+    return 0;
+}
+
+/*
+ * send_cached:
+ * Sends from the record cache as long as *offset is resident.
+ * Returns 0 when done or the rest isn't resident (*offset tells how far
+ * it got), 1 if the socket would block, or -1 on error.
+ */
+static int send_cached(int sockfd, off_t *offset, off_t end) {
+    char buffer[COPY_CHUNK];
+
+    while (*offset < end) {
+        size_t want = sizeof(buffer);
+        if ((off_t)want > end - *offset) want = end - *offset;
+
+        size_t n = record_cache_read(buffer, want, *offset);
+        if (n == 0) {
+            return 0;
+        }
+
+        int rc = send_buffer(sockfd, buffer, n, offset);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+/*
+ * get_extent:
+ * Looks up where [offset, end) continues, at most 'max_len' bytes.
+ * Returns 0 on success, or -1 if retention deleted the bytes before
+ * they could be sent (a reader slower than the retention limits).
+ */
+static int get_extent(off_t offset, off_t end, size_t max_len, DataExtent *ext) {
+    size_t want = max_len;
+    if ((off_t)want > end - offset) want = end - offset;
+
+    if (data_store_extent(offset, want, ext) < 0) {
+        log_msg(LOG_ERR, "data at offset %lld deleted by retention before it was sent", (long long)offset);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * send_shared:
+ * Sends from the shared chunk holding *offset, reading it from the file
+ * first unless a concurrent reply already did (see chunk_share.h).
+ * The whole chunk is read, up to the current end of the store, so
+ * replies of later snapshots can use it too.
+ */
+static int send_shared(int sockfd, off_t *offset, off_t end) {
+    int load;
+    SharedChunk *chunk = chunk_share_acquire(*offset, &load);
+    if (!chunk) {
+        return -1;
+    }
+
+    if (load) {
+        size_t want = SHARED_CHUNK_SIZE;
+        off_t length = data_store_length();
+        if ((off_t)want > length - chunk->start) want = length - chunk->start;
+        ssize_t n = data_store_pread(chunk->data, want, chunk->start);
+        if (n <= 0) {
+            log_msg(LOG_ERR, "pread (send_copy): %s", n < 0 ? strerror(errno) : "unexpected end of file");
+        }
+        chunk_share_loaded(chunk, n);
+    }
+    if (chunk_share_wait(chunk) < 0) {
+        chunk_share_release(chunk);
+        return -1;
+    }
+
+    /* A chunk loaded before the snapshot grew may stop short, the next call gets a newer one */
+    int rc = 0;
+    size_t avail = chunk_share_avail(chunk, *offset);
+    if (avail > 0) {
+        if ((off_t)avail > end - *offset) avail = end - *offset;
+        rc = send_buffer(sockfd, chunk->data + (*offset - chunk->start), avail, offset);
+    }
+    chunk_share_release(chunk);
+    return rc;
+}
+
+/* Sends an extent only held in memory (a compressed segment block) and releases it */
+static int send_memory(int sockfd, DataExtent *ext, off_t *offset) {
+    int rc = send_buffer(sockfd, ext->data, ext->len, offset);
+    data_store_release_extent(ext);
+    return rc;
+}
+
+static int send_copy(int sockfd, off_t *offset, off_t end) {
+    while (*offset < end) {
+        DataExtent ext;
+        if (get_extent(*offset, end, SENDFILE_CHUNK, &ext) < 0) {
+            return -1;
+        }
+
+        int rc;
+        if (ext.data) {
+            /* Mapped segment (or decompressed block), sent straight from memory */
+            rc = send_memory(sockfd, &ext, offset);
+        } else {
+            /* The flat file is never deleted, no need to hold the extent */
+            data_store_release_extent(&ext);
+            rc = send_shared(sockfd, offset, end);
+        }
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+static int send_splice(int sockfd, off_t *offset, off_t end) {
+    int *fds = thread_pipe();
+    if (!fds) return send_copy(sockfd, offset, end);
+
+    while (*offset < end) {
+        DataExtent ext;
+        if (get_extent(*offset, end, SPLICE_CHUNK, &ext) < 0) {
+            return -1;
+        }
+        if (ext.fd < 0) {
+            int rc = send_memory(sockfd, &ext, offset);
+            if (rc != 0) return rc;
+            continue;
+        }
+
+        /* file -> pipe, the pipe is always empty here */
+        loff_t off = ext.file_offset;
+        ssize_t n = splice(ext.fd, &off, fds[1], NULL, ext.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        data_store_release_extent(&ext);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) {
+                log_msg(LOG_INFO, "splice not supported (%s), falling back to copy", strerror(errno));
+                atomic_store(&splice_supported, 0);
+                return send_copy(sockfd, offset, end);
+            }
+            log_msg(LOG_ERR, "splice (file): %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            log_msg(LOG_ERR, "splice (file): unexpected end of file");
+            return -1;
+        }
+
+        /* pipe -> socket. The pipe is shared by every connection of this thread,
+         * so bytes that don't reach the socket are discarded and resent later. */
+        ssize_t moved = 0;
+        while (moved < n) {
+            ssize_t m = splice(fds[0], NULL, sockfd, NULL, n - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if (m < 0) {
+                if (errno == EINTR) continue;
+                drain_pipe(fds[0]);
+                *offset += moved;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+                log_msg(LOG_ERR, "splice (socket): %s", strerror(errno));
+                return -1;
+            }
+            moved += m;
+        }
+        *offset += n;
+    }
+    return 0;
+}
+
+static int send_sendfile(int sockfd, off_t *offset, off_t end) {
+    while (*offset < end) {
+        DataExtent ext;
+        if (get_extent(*offset, end, SENDFILE_CHUNK, &ext) < 0) {
+            return -1;
+        }
+        if (ext.fd < 0) {
+            int rc = send_memory(sockfd, &ext, offset);
+            if (rc != 0) return rc;
+            continue;
+        }
+
+        /* sendfile() advances file_off by the bytes sent, the descriptor position is untouched */
+        off_t file_off = ext.file_offset;
+        ssize_t n = sendfile(sockfd, ext.fd, &file_off, ext.len);
+        data_store_release_extent(&ext);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            if (errno == EINVAL || errno == ENOSYS) {
+                log_msg(LOG_INFO, "sendfile not supported (%s), falling back to splice", strerror(errno));
+                atomic_store(&sendfile_supported, 0);
+                return send_splice(sockfd, offset, end);
+            }
+            log_msg(LOG_ERR, "sendfile: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            log_msg(LOG_ERR, "sendfile: unexpected end of file");
+            return -1;
+        }
+        *offset += n;
+    }
+    return 0;
+}
+
+static int send_file(int sockfd, off_t *offset, off_t end) {
+    switch (server_config.send_method) {
+        case SEND_METHOD_SENDFILE:
+            if (atomic_load_explicit(&sendfile_supported, memory_order_relaxed)) {
+                return send_sendfile(sockfd, offset, end);
+            }
+            /* fall through */
+        case SEND_METHOD_SPLICE:
+            if (atomic_load_explicit(&splice_supported, memory_order_relaxed)) {
+                return send_splice(sockfd, offset, end);
+            }
+            /* fall through */
+        case SEND_METHOD_COPY:
+        default:
+            return send_copy(sockfd, offset, end);
+    }
+}
+
+/*
+ * send_range:
+ * Sends [*offset, end) of the data store: the part older than the record
+ * cache from the file, the resident tail from memory, and whatever was
+ * evicted meanwhile from the file again.
+ */
+static int send_range(int sockfd, off_t *offset, off_t end) {
+    off_t cached_from = record_cache_start();
+    if (*offset < cached_from) {
+        int rc = send_file(sockfd, offset, cached_from < end ? cached_from : end);
+        if (rc != 0) return rc;
+    }
+
+    int rc = send_cached(sockfd, offset, end);
+    if (rc != 0 || *offset >= end) return rc;
+
+    return send_file(sockfd, offset, end);
+}
+
+/*
+ * file_send_range:
+ * Sends [*offset, end) of the data store (see send_range()), advancing
+ * '*offset' past what was sent and counting it in the metrics.
+ */
+int file_send_range(int sockfd, off_t *offset, off_t end) {
+    off_t start = *offset;
+    int rc = send_range(sockfd, offset, end);
+    metrics_add(METRIC_BYTES_SENT, *offset - start);
+    return rc;
+}
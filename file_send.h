@@ -0,0 +1,19 @@
+#ifndef FILE_SEND_H
+#define FILE_SEND_H
+
+#include <sys/types.h>
+
+/*
+ * file_send_range:
+ * Sends bytes [*offset, end) of the data store to a socket, from the
+ * record cache where resident and otherwise from the file, using the
+ * method selected by server_config.send_method. '*offset' is advanced by
+ * the bytes that actually reached the socket, so on a non-blocking socket
+ * the call can be repeated once it is writable again.
+ *
+ * Returns 0 when the whole range was sent, 1 if the socket would block,
+ * or -1 on error.
+ */
+int file_send_range(int sockfd, off_t *offset, off_t end);
+
+#endif /* FILE_SEND_H */
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE // accept4(), MSG_CMSG_CLOEXEC
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+
+#include "hot_restart.h"
+#include "append_writer.h"
+#include "data_store.h"
+#include "admission.h"
+#include "metrics.h"
+#include "async_log.h"
+#include "timer_wheel.h"
+
+#define CONTROL_POLL_MS 1000        // wake up at least once a second to check keep_running
+#define SETTLE_POLL_MS 10           // how often the handoff checks whether the loops settled
+#define DRAIN_POLL_MS 100           // how often server_stop() checks whether the connections closed
+#define TAKEOVER_REQUEST "takeover\n"
+#define TAKEOVER_REPLY_MS (HOT_RESTART_SETTLE_MS + 5000) // the new process gives up waiting after it
+
+extern volatile sig_atomic_t keep_running;
+
+static atomic_int state = HOT_RESTART_RUNNING;
+static atomic_int accepting = 0;   // loops accepting connections, 0 once a drain stopped them all
+static atomic_int finishing = 0;   // open connections that can't append anymore (final reply queued)
+
+static int listeners[HOT_RESTART_MAX_LISTENERS];
+static int listener_count = 0;
+static pthread_mutex_t listener_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int signal_fd = -1;
+static int control_fd = -1;
+static pthread_t control_thread;
+static int control_started = 0;
+
+/* Called from main() before any thread exists, so every thread inherits the mask */
+void hot_restart_block_signals(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/* Registers a listening socket to hand over, the first one is server_sockfd */
+void hot_restart_add_listener(int fd) {
+    pthread_mutex_lock(&listener_mutex);
+    if (listener_count < HOT_RESTART_MAX_LISTENERS) {
+        listeners[listener_count++] = fd;
+    } else {
+        log_msg(LOG_WARNING, "Too many listening sockets, socket %d won't be handed over", fd);
+    }
+    pthread_mutex_unlock(&listener_mutex);
+}
+
+HotRestartState hot_restart_state(void) {
+    return atomic_load(&state);
+}
+
+/* An accept loop starts (+1) or stops (-1) accepting */
+void hot_restart_accepting(int delta) {
+    atomic_fetch_add(&accepting, delta);
+}
+
+/*
+ * hot_restart_finishing:
+ * A connection queued its final reply (+1), or closed after it (-1).
+ * The -1 comes before admission_release(), so the connections that may
+ * still append (admitted minus finishing) are never undercounted.
+ */
+void hot_restart_finishing(int delta) {
+    atomic_fetch_add(&finishing, delta);
+}
+
+/* Connections that may still append a packet, the admitted ones read first */
+static int appending(void) {
+    int open = admission_open_count();
+    return open - atomic_load(&finishing);
+}
+
+/*
+ * hot_restart_wait_drained:
+ * Called by server_stop() after a handoff: waits until every connection
+ * left is closed, or the drain timeout cleared keep_running.
+ */
+void hot_restart_wait_drained(void) {
+    while (keep_running && admission_open_count() > 0) {
+        usleep(DRAIN_POLL_MS * 1000);
+    }
+}
+
+static int send_listeners(int peer) {
+    char ok = 1;
+    struct iovec iov = { .iov_base = &ok, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HOT_RESTART_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    pthread_mutex_lock(&listener_mutex);
+    int count = listener_count;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), listeners, sizeof(int) * count);
+    pthread_mutex_unlock(&listener_mutex);
+
+    if (sendmsg(peer, &msg, MSG_NOSIGNAL) < 0) {
+        log_msg(LOG_ERR, "sendmsg (listening sockets): %s", strerror(errno));
+        return -1;
+    }
+    return count;
+}
+
+/*
+ * hand_off:
+ * Serves a takeover request from 'peer'. Stops accepting, waits for the
+ * packets being received, stops appending and sends the listeners. If the
+ * new process goes away before the store was released, accepting resumes.
+ */
+static void hand_off(int peer) {
+    char request[sizeof(TAKEOVER_REQUEST)];
+    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ssize_t n = recv(peer, request, sizeof(request), 0);
+    if (n != (ssize_t)strlen(TAKEOVER_REQUEST) || memcmp(request, TAKEOVER_REQUEST, n) != 0) {
+        log_msg(LOG_WARNING, "Unknown control request, ignored");
+        return;
+    }
+
+    log_msg(LOG_INFO, "Takeover requested, draining");
+    uint64_t start_ms = timer_now_ms();
+    atomic_store(&state, HOT_RESTART_DRAINING);
+
+    /* The loops stop accepting, answered connections close between packets */
+    while (keep_running && (atomic_load(&accepting) > 0 || appending() > 0) &&
+           timer_now_ms() - start_ms < HOT_RESTART_SETTLE_MS) {
+        struct pollfd pfd = { .fd = peer, .events = POLLIN };
+        if (poll(&pfd, 1, SETTLE_POLL_MS) > 0) {
+            /* The new process sends nothing more: it is gone */
+            log_msg(LOG_WARNING, "Takeover aborted by the new process, accepting again");
+            atomic_store(&state, HOT_RESTART_RUNNING);
+            return;
+        }
+    }
+    if (!keep_running) {
+        return;
+    }
+    if (atomic_load(&accepting) > 0) {
+        log_msg(LOG_ERR, "Accept loops didn't stop, takeover refused");
+        atomic_store(&state, HOT_RESTART_RUNNING);
+        return;
+    }
+    if (appending() > 0) {
+        log_msg(LOG_WARNING, "%d connections still receiving a packet, their packet won't be appended", appending());
+    }
+
+    /* Flushes the records queued, the later ones are refused: the new process is the only writer */
+    append_writer_stop();
+    data_store_detach();
+
+    close(control_fd);
+    control_fd = -1;
+    unlink(HOT_RESTART_SOCKET_PATH);
+
+    int count = send_listeners(peer);
+    atomic_store(&state, HOT_RESTART_HANDED_OFF);
+    if (count < 0) {
+        /* Nothing can be appended anymore, stop instead of draining */
+        log_msg(LOG_ERR, "Takeover failed after the store was released, stopping");
+        keep_running = 0;
+        return;
+    }
+    log_msg(LOG_INFO, "%d listening sockets handed over in %llu ms, draining %d connections",
+            count, (unsigned long long)(timer_now_ms() - start_ms), admission_open_count());
+}
+
+static void *control_thread_func(void *arg) {
+    (void)arg; // quiet unused variable warning
+    metrics_thread_init();
+    uint64_t drain_start = 0;
+
+    while (keep_running) {
+        struct pollfd pfds[2] = {
+            { .fd = signal_fd, .events = POLLIN },
+            { .fd = control_fd, .events = POLLIN }, // ignored once it is -1
+        };
+        int rc = poll(pfds, 2, CONTROL_POLL_MS);
+
+        if (hot_restart_state() == HOT_RESTART_HANDED_OFF && server_config.drain_timeout_ms > 0 &&
+            timer_now_ms() - drain_start >= (uint64_t)server_config.drain_timeout_ms) {
+            log_msg(LOG_INFO, "Drain timeout, closing the %d connections left", admission_open_count());
+            keep_running = 0;
+            break;
+        }
+        if (rc <= 0) {
+            if (rc < 0 && errno != EINTR) {
+                log_msg(LOG_ERR, "poll (control): %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                log_msg(LOG_INFO, "Caught signal %u, exiting", info.ssi_signo);
+                keep_running = 0;
+                break;
+            }
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            int peer = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (peer < 0) {
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    log_msg(LOG_ERR, "accept (control): %s", strerror(errno));
+                }
+                continue;
+            }
+            hand_off(peer);
+            close(peer);
+            if (hot_restart_state() == HOT_RESTART_HANDED_OFF) {
+                drain_start = timer_now_ms();
+            }
+        }
+    }
+
+    log_msg(LOG_INFO, "Exiting control thread, tid: %lu", pthread_self());
+    return NULL;
+}
+
+/* Binds HOT_RESTART_SOCKET_PATH, replacing the socket a killed server may have left */
+static int open_control_socket(void) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_msg(LOG_ERR, "socket (control): %s", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", HOT_RESTART_SOCKET_PATH);
+    unlink(HOT_RESTART_SOCKET_PATH);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        log_msg(LOG_ERR, "bind/listen (%s): %s", HOT_RESTART_SOCKET_PATH, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * hot_restart_start:
+ * Starts the control thread, once the listeners are registered.
+ * Without the control socket the server runs on, it just can't be taken
+ * over. Returns 0 on success, or -1 on error.
+ */
+int hot_restart_start(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        log_msg(LOG_ERR, "signalfd: %s", strerror(errno));
+        return -1;
+    }
+
+    control_fd = open_control_socket();
+    if (control_fd < 0) {
+        log_msg(LOG_WARNING, "Hot restart disabled");
+    }
+
+    int rc = pthread_create(&control_thread, NULL, control_thread_func, NULL);
+    if (rc != 0) {
+        log_msg(LOG_ERR, "pthread_create (control): %s", strerror(rc));
+        hot_restart_stop();
+        return -1;
+    }
+    control_started = 1;
+    return 0;
+}
+
+/* Joins the control thread, after keep_running was cleared */
+void hot_restart_stop(void) {
+    if (control_started) {
+        pthread_join(control_thread, NULL);
+        control_started = 0;
+    }
+    if (control_fd >= 0) {
+        close(control_fd);
+        control_fd = -1;
+        unlink(HOT_RESTART_SOCKET_PATH);
+    }
+    if (signal_fd >= 0) {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+}
+
+/*
+ * hot_restart_takeover:
+ * Asks the running server for its listening sockets, blocking while it
+ * drains. Called before the store is opened: once the sockets arrived,
+ * the old server appends nothing more.
+ * Returns the number of sockets stored in 'fds', or -1 if there is no
+ * server to take over.
+ */
+int hot_restart_takeover(int *fds, int max) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_msg(LOG_ERR, "socket (takeover): %s", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", HOT_RESTART_SOCKET_PATH);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_msg(LOG_WARNING, "connect (%s): %s", HOT_RESTART_SOCKET_PATH, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    struct timeval tv = { .tv_sec = TAKEOVER_REPLY_MS / 1000, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (send(fd, TAKEOVER_REQUEST, strlen(TAKEOVER_REQUEST), MSG_NOSIGNAL) < 0) {
+        log_msg(LOG_ERR, "send (takeover): %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "Waiting for the running server to hand over its listening sockets");
+    char ok = 0;
+    struct iovec iov = { .iov_base = &ok, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HOT_RESTART_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    close(fd);
+    if (n <= 0) {
+        log_msg(LOG_WARNING, "Takeover refused: %s", n < 0 ? strerror(errno) : "no listening socket received");
+        return -1;
+    }
+
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *data = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < received; i++) {
+            /* Back to the flags of create_listen_socket(), each I/O mode sets what it needs */
+            int flags = fcntl(data[i], F_GETFL, 0);
+            if (flags >= 0) fcntl(data[i], F_SETFL, flags & ~O_NONBLOCK);
+            if (count < max) fds[count++] = data[i];
+            else close(data[i]);
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        log_msg(LOG_WARNING, "Some listening sockets were not received");
+    }
+    if (count == 0) {
+        log_msg(LOG_WARNING, "Takeover refused: no listening socket received");
+        return -1;
+    }
+    return count;
+}
@@ -0,0 +1,49 @@
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include "simple_stream_server.h"
+
+#define HOT_RESTART_SOCKET_PATH "/var/tmp/" PROCESS_NAME ".sock" // control socket of the running server
+#define HOT_RESTART_MAX_LISTENERS 64   // listening sockets handed over at most
+#define HOT_RESTART_SETTLE_MS 5000     // longest wait for the packets being received before the handoff
+
+/*
+ * HotRestartState:
+ * Where the running server is in a handoff to a new process.
+ */
+typedef enum HotRestartState {
+    HOT_RESTART_RUNNING = 0, // accepting connections
+    HOT_RESTART_DRAINING,    // takeover requested: not accepting, waiting for the packets being received
+    HOT_RESTART_HANDED_OFF,  // the listening sockets and the store belong to the new process
+} HotRestartState;
+
+/*
+ * Zero-downtime restart: a new server started with --takeover connects to
+ * HOT_RESTART_SOCKET_PATH and receives the listening sockets of the
+ * running one (SCM_RIGHTS), so the port is never closed and connections
+ * arriving meanwhile wait in the listen backlog instead of being refused.
+ *
+ * On the request, the running server stops accepting and waits (at most
+ * HOT_RESTART_SETTLE_MS) until no connection can append anymore:
+ * connections that were already answered are closed between packets, the
+ * others get the reply of the packet they are sending. It then stops the
+ * append writer, so the new process is the only writer of the store, and
+ * sends the listeners. The replies still being sent are finished (at
+ * most server_config.drain_timeout_ms) before it exits.
+ *
+ * SIGINT and SIGTERM are blocked in every thread and read from a signalfd
+ * by the control thread, which also serves the control socket: no work is
+ * done in a signal handler.
+ */
+void hot_restart_block_signals(void);
+int hot_restart_start(void);
+void hot_restart_stop(void);
+int hot_restart_takeover(int *fds, int max);
+
+void hot_restart_add_listener(int fd);
+HotRestartState hot_restart_state(void);
+void hot_restart_accepting(int delta);
+void hot_restart_finishing(int delta);
+void hot_restart_wait_drained(void);
+
+#endif /* HOT_RESTART_H */
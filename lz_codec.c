@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz_codec.h"
+
+#define LZ_MIN_MATCH 4          // shortest match, stored as length - 4
+#define LZ_LAST_LITERALS 5      // the block always ends with this many literals
+#define LZ_MF_LIMIT 12          // no match starts in the last 12 bytes
+#define LZ_MAX_OFFSET 65535     // farthest match, 2-byte offsets
+#define LZ_HASH_LOG 12          // 4096 entries of recent positions, 16K on the stack
+#define LZ_SKIP_TRIGGER 6       // probe less often after 2^6 misses in a row (incompressible data)
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/* Writes the extra bytes of a length that didn't fit in its nibble */
+static unsigned char *put_length(unsigned char *op, size_t n) {
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+/*
+ * put_sequence:
+ * Appends literals [lit, lit + lit_len) and, unless 'match_len' is 0 (last
+ * sequence), a match of 'match_len' bytes 'offset' bytes back.
+ * Returns the new output position, or NULL if it doesn't fit before 'oend'.
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+                                   size_t lit_len, size_t offset, size_t match_len) {
+    size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if (worst > (size_t)(oend - op)) return NULL;
+
+    unsigned char *token = op++;
+    *token = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len > 0) {
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        size_t ml = match_len - LZ_MIN_MATCH;
+        *token |= (unsigned char)(ml < 15 ? ml : 15);
+        if (ml >= 15) op = put_length(op, ml - 15);
+    }
+    return op;
+}
+
+/*
+ * lz_compress:
+ * Compresses 'len' bytes of 'src' into at most 'cap' bytes of 'dst'.
+ * Returns the compressed size, or 0 if it doesn't fit (callers pass
+ * cap = len - 1 to keep blocks that don't shrink uncompressed).
+ */
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;         // first literal not emitted yet
+    const unsigned char *iend = base + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + cap;
+
+    if (len > LZ_MF_LIMIT) {
+        const unsigned char *mf_limit = iend - LZ_MF_LIMIT;
+        const unsigned char *match_limit = iend - LZ_LAST_LITERALS;
+        uint32_t table[1 << LZ_HASH_LOG] = { 0 }; // position + 1 of the last 4 bytes with each hash
+        unsigned misses = 0;
+
+        while (ip < mf_limit) {
+            uint32_t seq = read32(ip);
+            unsigned h = hash4(seq);
+            uint32_t pos = (uint32_t)(ip - base);
+            uint32_t candidate = table[h];
+            table[h] = pos + 1;
+
+            if (candidate == 0 || pos + 1 - candidate > LZ_MAX_OFFSET || read32(base + candidate - 1) != seq) {
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            const unsigned char *match = base + candidate - 1;
+            while (ip > anchor && match > base && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+            const unsigned char *end = ip + LZ_MIN_MATCH;
+            const unsigned char *m = match + LZ_MIN_MATCH;
+            while (end < match_limit && *end == *m) {
+                end++;
+                m++;
+            }
+
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - match, end - ip);
+            if (!op) return 0;
+            ip = anchor = end;
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (!op) return 0;
+    return op - (unsigned char *)dst;
+}
+
+/* Reads the extra bytes of a length whose nibble was 15 */
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *n) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+/*
+ * lz_decompress:
+ * Decompresses a block of 'len' bytes into at most 'cap' bytes of 'dst'.
+ * Every length and offset is checked, so a corrupt block fails instead of
+ * reading or writing out of bounds.
+ * Returns the decompressed size, or -1 if the block is corrupt.
+ */
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, iend, &lit_len) < 0) return -1;
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) break; // last sequence, literals only
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst)) return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, iend, &match_len) < 0) return -1;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) return -1;
+
+        const unsigned char *match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+            op += match_len;
+        } else {
+            /* Overlapping match, repeats the last 'offset' bytes */
+            while (match_len--) *op++ = *match++;
+        }
+    }
+    return op - (unsigned char *)dst;
+}
@@ -0,0 +1,22 @@
+#ifndef LZ_CODEC_H
+#define LZ_CODEC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Block compression in the LZ4 block format: a block is a sequence of
+ * (literals, match) pairs, each a token byte with the literal length in
+ * the high nibble and the match length - 4 in the low nibble (15 means
+ * more length bytes follow, 255 each until a smaller one), the literals,
+ * and the match as a 2-byte little-endian backwards offset. The last
+ * sequence only has literals. Any LZ4 block decoder reads the output.
+ *
+ * The compressor is the greedy single-probe kind: fast, and good enough
+ * for newline text where most lines repeat the ones before them.
+ */
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+#endif /* LZ_CODEC_H */
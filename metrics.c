@@ -0,0 +1,463 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+#include "data_store.h"
+#include "data_sync.h"
+#include "async_log.h"
+
+#define METRICS_BACKLOG 16        // pending scrape connections
+#define METRICS_POLL_MS 1000      // accept waits time out to re-check for shutdown
+#define METRICS_REQUEST_MAX 4096  // request bytes read before answering anyway
+
+/* Upper bounds of the histogram buckets in nanoseconds, the last bucket is +Inf */
+static const uint64_t bucket_bounds[] = {
+    10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000, 2500000000ULL, 5000000000ULL, 10000000000ULL,
+};
+#define BUCKET_COUNT (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+typedef struct Histogram {
+    _Atomic uint64_t buckets[BUCKET_COUNT]; // observations per bucket (not cumulative)
+    _Atomic uint64_t sum_ns;
+} Histogram;
+
+/*
+ * MetricsBlock:
+ * The counters of one thread. Only the owning thread writes them (plain
+ * relaxed load + store, no locked instruction); scrapes read them with
+ * relaxed loads. Cache line aligned so threads don't false-share.
+ */
+typedef struct MetricsBlock {
+    _Alignas(64) _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    Histogram histograms[METRIC_HISTOGRAM_COUNT];
+    struct MetricsBlock *next;    // registry list, protected by registry_mutex
+} MetricsBlock;
+
+static __thread MetricsBlock *local_block = NULL;
+
+/* Registry of the live threads' blocks, and the sum of the exited ones */
+static MetricsBlock *registry = NULL;
+static int registry_threads = 0;
+static MetricsBlock retired;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+
+/* Scrape endpoint */
+static pthread_t metrics_thread;
+static int metrics_started = 0;
+static int metrics_fd = -1;
+static atomic_int metrics_stopping = 0;
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void bump(_Atomic uint64_t *value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline uint64_t load(_Atomic uint64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+/* Adds every counter of 'src' to 'dst', called with registry_mutex held */
+static void block_accumulate(MetricsBlock *dst, MetricsBlock *src) {
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        bump(&dst->counters[i], load(&src->counters[i]));
+    }
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        for (size_t b = 0; b < BUCKET_COUNT; b++) {
+            bump(&dst->histograms[h].buckets[b], load(&src->histograms[h].buckets[b]));
+        }
+        bump(&dst->histograms[h].sum_ns, load(&src->histograms[h].sum_ns));
+    }
+}
+
+/* Thread exit: the block's counts move to the retired totals */
+static void block_retire(void *arg) {
+    MetricsBlock *block = arg;
+
+    pthread_mutex_lock(&registry_mutex);
+    block_accumulate(&retired, block);
+    for (MetricsBlock **p = &registry; *p; p = &(*p)->next) {
+        if (*p == block) {
+            *p = block->next;
+            break;
+        }
+    }
+    registry_threads--;
+    pthread_mutex_unlock(&registry_mutex);
+
+    free(block);
+}
+
+static void create_block_key(void) {
+    pthread_key_create(&block_key, block_retire);
+}
+
+/*
+ * metrics_thread_init:
+ * Registers the calling thread's block. Called at the start of every
+ * server thread (so it is counted in simple_stream_threads), and by the
+ * first update of a thread that didn't.
+ */
+void metrics_thread_init(void) {
+    if (local_block) return;
+
+    pthread_once(&block_key_once, create_block_key);
+
+    void *mem;
+    if (posix_memalign(&mem, 64, sizeof(MetricsBlock)) != 0) {
+        log_msg(LOG_ERR, "metrics block allocation failed");
+        return;
+    }
+    MetricsBlock *block = mem;
+    memset(block, 0, sizeof(*block));
+
+    pthread_mutex_lock(&registry_mutex);
+    block->next = registry;
+    registry = block;
+    registry_threads++;
+    pthread_mutex_unlock(&registry_mutex);
+
+    pthread_setspecific(block_key, block);
+    local_block = block;
+}
+
+static inline MetricsBlock *thread_block(void) {
+    if (!local_block) metrics_thread_init();
+    return local_block;
+}
+
+void metrics_add(MetricCounter counter, uint64_t value) {
+    MetricsBlock *block = thread_block();
+    if (!block) return;
+    bump(&block->counters[counter], value);
+}
+
+void metrics_observe(MetricHistogram histogram, uint64_t ns) {
+    MetricsBlock *block = thread_block();
+    if (!block) return;
+
+    size_t b = 0;
+    while (b < BUCKET_COUNT - 1 && ns > bucket_bounds[b]) b++;
+    bump(&block->histograms[histogram].buckets[b], 1);
+    bump(&block->histograms[histogram].sum_ns, ns);
+}
+
+/*
+ * TextBuf:
+ * Growable buffer the exposition text is rendered into.
+ */
+typedef struct TextBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;   // an allocation failed, the text is incomplete
+} TextBuf;
+
+static void text_printf(TextBuf *buf, const char *fmt, ...) {
+    if (buf->failed) return;
+
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            buf->failed = 1;
+            return;
+        }
+        if ((size_t)n < buf->cap - buf->len) {
+            buf->len += n;
+            return;
+        }
+
+        size_t new_cap = buf->cap * 2 + n;
+        char *new_data = realloc(buf->data, new_cap);
+        if (!new_data) {
+            buf->failed = 1;
+            return;
+        }
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+}
+
+static void render_counter(TextBuf *buf, const char *name, const char *help, uint64_t value) {
+    text_printf(buf, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                name, help, name, name, (unsigned long long)value);
+}
+
+static void render_gauge(TextBuf *buf, const char *name, const char *help, double value) {
+    text_printf(buf, "# HELP %s %s\n# TYPE %s gauge\n%s %.9g\n", name, help, name, name, value);
+}
+
+static void render_histogram(TextBuf *buf, const char *name, const char *help, Histogram *hist) {
+    text_printf(buf, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b < BUCKET_COUNT; b++) {
+        cumulative += load(&hist->buckets[b]);
+        if (b < BUCKET_COUNT - 1) {
+            text_printf(buf, "%s_bucket{le=\"%.9g\"} %llu\n",
+                        name, bucket_bounds[b] / 1e9, (unsigned long long)cumulative);
+        } else {
+            text_printf(buf, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        }
+    }
+    text_printf(buf, "%s_sum %.9f\n%s_count %llu\n",
+                name, load(&hist->sum_ns) / 1e9, name, (unsigned long long)cumulative);
+}
+
+/*
+ * render_metrics:
+ * Sums the blocks of every thread and renders them in the Prometheus
+ * text exposition format.
+ */
+static void render_metrics(TextBuf *buf) {
+    static MetricsBlock sum;      // only the metrics thread renders
+    MetricsBlock *total = &sum;
+    memset(total, 0, sizeof(*total));
+
+    pthread_mutex_lock(&registry_mutex);
+    block_accumulate(total, &retired);
+    for (MetricsBlock *block = registry; block; block = block->next) {
+        block_accumulate(total, block);
+    }
+    int threads = registry_threads;
+    pthread_mutex_unlock(&registry_mutex);
+
+    uint64_t accepted = load(&total->counters[METRIC_CONNECTIONS_ACCEPTED]);
+    uint64_t closed = load(&total->counters[METRIC_CONNECTIONS_CLOSED]);
+
+    render_counter(buf, "simple_stream_connections_accepted_total", "Connections accepted.", accepted);
+    render_counter(buf, "simple_stream_connections_closed_total", "Connections closed.", closed);
+    render_gauge(buf, "simple_stream_connections_active", "Connections currently open.",
+                 accepted > closed ? (double)(accepted - closed) : 0);
+    render_counter(buf, "simple_stream_connections_timed_out_total", "Connections closed by the idle or read timeout.",
+                   load(&total->counters[METRIC_CONNECTIONS_TIMED_OUT]));
+    text_printf(buf, "# HELP simple_stream_connections_rejected_total Connections refused by admission control.\n"
+                     "# TYPE simple_stream_connections_rejected_total counter\n"
+                     "simple_stream_connections_rejected_total{reason=\"max_connections\"} %llu\n"
+                     "simple_stream_connections_rejected_total{reason=\"max_per_ip\"} %llu\n"
+                     "simple_stream_connections_rejected_total{reason=\"ip_table_full\"} %llu\n",
+                (unsigned long long)load(&total->counters[METRIC_REJECTED_MAX_CONNS]),
+                (unsigned long long)load(&total->counters[METRIC_REJECTED_PER_IP]),
+                (unsigned long long)load(&total->counters[METRIC_REJECTED_IP_TABLE_FULL]));
+    render_counter(buf, "simple_stream_recv_throttled_total", "Reads paused by the per-address byte rate.",
+                   load(&total->counters[METRIC_RECV_THROTTLED]));
+    render_counter(buf, "simple_stream_replies_dropped_total", "Replies discarded because the client read too slowly.",
+                   load(&total->counters[METRIC_REPLIES_DROPPED]));
+    text_printf(buf, "# HELP simple_stream_slow_consumers_closed_total Connections closed because the client read too slowly.\n"
+                     "# TYPE simple_stream_slow_consumers_closed_total counter\n"
+                     "simple_stream_slow_consumers_closed_total{reason=\"max_pending\"} %llu\n"
+                     "simple_stream_slow_consumers_closed_total{reason=\"send_timeout\"} %llu\n",
+                (unsigned long long)load(&total->counters[METRIC_SLOW_CLOSED_PENDING]),
+                (unsigned long long)load(&total->counters[METRIC_SLOW_CLOSED_TIMEOUT]));
+    render_counter(buf, "simple_stream_received_bytes_total", "Bytes received from clients.",
+                   load(&total->counters[METRIC_BYTES_RECEIVED]));
+    render_counter(buf, "simple_stream_sent_bytes_total", "Bytes of replies sent to clients.",
+                   load(&total->counters[METRIC_BYTES_SENT]));
+    text_printf(buf, "# HELP simple_stream_shared_chunks_total Chunks of the data file read for replies, and reused by concurrent replies.\n"
+                     "# TYPE simple_stream_shared_chunks_total counter\n"
+                     "simple_stream_shared_chunks_total{result=\"read\"} %llu\n"
+                     "simple_stream_shared_chunks_total{result=\"shared\"} %llu\n",
+                (unsigned long long)load(&total->counters[METRIC_CHUNKS_READ]),
+                (unsigned long long)load(&total->counters[METRIC_CHUNKS_SHARED]));
+    text_printf(buf, "# HELP simple_stream_compressed_segment_bytes_total Bytes of sealed segments compressed, before and after compression.\n"
+                     "# TYPE simple_stream_compressed_segment_bytes_total counter\n"
+                     "simple_stream_compressed_segment_bytes_total{form=\"raw\"} %llu\n"
+                     "simple_stream_compressed_segment_bytes_total{form=\"compressed\"} %llu\n",
+                (unsigned long long)load(&total->counters[METRIC_SEGMENT_BYTES_RAW]),
+                (unsigned long long)load(&total->counters[METRIC_SEGMENT_BYTES_COMPRESSED]));
+    text_printf(buf, "# HELP simple_stream_compressed_blocks_total Blocks of compressed replies, by where they came from.\n"
+                     "# TYPE simple_stream_compressed_blocks_total counter\n"
+                     "simple_stream_compressed_blocks_total{source=\"compressed\"} %llu\n"
+                     "simple_stream_compressed_blocks_total{source=\"segment\"} %llu\n"
+                     "simple_stream_compressed_blocks_total{source=\"cache\"} %llu\n",
+                (unsigned long long)load(&total->counters[METRIC_WIRE_BLOCKS_COMPRESSED]),
+                (unsigned long long)load(&total->counters[METRIC_WIRE_BLOCKS_SEGMENT]),
+                (unsigned long long)load(&total->counters[METRIC_WIRE_BLOCKS_CACHED]));
+    text_printf(buf, "# HELP simple_stream_compressed_reply_bytes_total Store bytes sent in compressed replies, and their size on the wire.\n"
+                     "# TYPE simple_stream_compressed_reply_bytes_total counter\n"
+                     "simple_stream_compressed_reply_bytes_total{form=\"raw\"} %llu\n"
+                     "simple_stream_compressed_reply_bytes_total{form=\"wire\"} %llu\n",
+                (unsigned long long)load(&total->counters[METRIC_WIRE_BYTES_RAW]),
+                (unsigned long long)load(&total->counters[METRIC_WIRE_BYTES_COMPRESSED]));
+    render_counter(buf, "simple_stream_records_appended_total", "Records written to the data store.",
+                   load(&total->counters[METRIC_RECORDS_APPENDED]));
+    render_counter(buf, "simple_stream_append_batches_total", "Group commits of the append writer.",
+                   load(&total->counters[METRIC_APPEND_BATCHES]));
+    render_counter(buf, "simple_stream_append_failures_total", "Records whose write or sync failed.",
+                   load(&total->counters[METRIC_APPEND_FAILURES]));
+    render_histogram(buf, "simple_stream_append_queue_seconds",
+                     "Time records wait for the append writer.", &total->histograms[METRIC_APPEND_QUEUE]);
+    render_histogram(buf, "simple_stream_append_latency_seconds",
+                     "Time from record submission until it is stored.", &total->histograms[METRIC_APPEND_LATENCY]);
+    render_histogram(buf, "simple_stream_send_latency_seconds",
+                     "Time to send a reply.", &total->histograms[METRIC_SEND_LATENCY]);
+    render_gauge(buf, "simple_stream_threads", "Server threads running.", threads);
+    render_gauge(buf, "simple_stream_store_bytes", "Bytes of records in the data store.",
+                 (double)data_store_length());
+
+    DataSyncStats sync;
+    data_sync_get_stats(&sync);
+    render_counter(buf, "simple_stream_syncs_total", "Data store syncs.", sync.syncs);
+    render_counter(buf, "simple_stream_sync_failures_total", "Failed data store syncs.", sync.failures);
+    text_printf(buf, "# HELP simple_stream_sync_seconds_total Time spent syncing the data store.\n"
+                     "# TYPE simple_stream_sync_seconds_total counter\n"
+                     "simple_stream_sync_seconds_total %.9f\n", sync.total_ns / 1e9);
+    render_gauge(buf, "simple_stream_sync_max_seconds", "Slowest data store sync.", sync.max_ns / 1e9);
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * serve_scrape:
+ * Reads the HTTP request (whatever the path) and answers with the
+ * metrics, closing the connection.
+ */
+static void serve_scrape(int fd) {
+    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char request[METRICS_REQUEST_MAX + 1];
+    size_t len = 0;
+    while (len < METRICS_REQUEST_MAX) {
+        ssize_t n = recv(fd, request + len, METRICS_REQUEST_MAX - len, 0);
+        if (n <= 0) break;
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+
+    TextBuf body = { 0 };
+    render_metrics(&body);
+    if (body.failed) {
+        const char *error = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, error, strlen(error));
+        free(body.data);
+        return;
+    }
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n", body.len);
+    if (send_all(fd, header, header_len) == 0) {
+        send_all(fd, body.data, body.len);
+    }
+    free(body.data);
+}
+
+static void *metrics_thread_func(void *arg) {
+    (void)arg; // quiet unused variable warning
+    metrics_thread_init();
+
+    while (!atomic_load(&metrics_stopping)) {
+        struct pollfd pfd = { .fd = metrics_fd, .events = POLLIN };
+        int rc = poll(&pfd, 1, METRICS_POLL_MS);
+        if (rc <= 0) {
+            if (rc < 0 && errno != EINTR) {
+                log_msg(LOG_ERR, "poll (metrics): %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        int fd = accept(metrics_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                log_msg(LOG_ERR, "accept (metrics): %s", strerror(errno));
+            }
+            continue;
+        }
+        serve_scrape(fd);
+        close(fd);
+    }
+
+    log_msg(LOG_INFO, "Exiting metrics thread, tid: %lu", pthread_self());
+    return NULL;
+}
+
+/*
+ * metrics_server_start:
+ * Listens on 127.0.0.1:'port' and serves scrapes from a thread of its own.
+ * Returns 0 on success, or -1 on error.
+ */
+int metrics_server_start(int port) {
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_fd < 0) {
+        log_msg(LOG_ERR, "socket (metrics): %s", strerror(errno));
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(metrics_fd, METRICS_BACKLOG) < 0) {
+        log_msg(LOG_ERR, "bind/listen (metrics port %d): %s", port, strerror(errno));
+        close(metrics_fd);
+        metrics_fd = -1;
+        return -1;
+    }
+
+    int rc = pthread_create(&metrics_thread, NULL, metrics_thread_func, NULL);
+    if (rc != 0) {
+        log_msg(LOG_ERR, "pthread_create (metrics): %s", strerror(rc));
+        close(metrics_fd);
+        metrics_fd = -1;
+        return -1;
+    }
+    metrics_started = 1;
+
+    log_msg(LOG_INFO, "Metrics on 127.0.0.1:%d", port);
+    return 0;
+}
+
+void metrics_server_stop(void) {
+    if (!metrics_started) return;
+
+    atomic_store(&metrics_stopping, 1);
+    pthread_join(metrics_thread, NULL);
+    metrics_started = 0;
+
+    close(metrics_fd);
+    metrics_fd = -1;
+}
@@ -0,0 +1,63 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Server metrics, scraped over HTTP in the Prometheus text format from
+ * 127.0.0.1:server_config.metrics_port (disabled when 0).
+ *
+ * Every thread updates its own block of counters, registered the first
+ * time it records something, so the hot path takes no lock and shares no
+ * cache line with other threads. A scrape sums the blocks of the live
+ * threads and the totals of the threads that already exited.
+ */
+
+/* Monotonic counters */
+typedef enum MetricCounter {
+    METRIC_CONNECTIONS_ACCEPTED = 0,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_CONNECTIONS_TIMED_OUT, // closed by the idle or read timeout
+    METRIC_REJECTED_MAX_CONNS,    // refused by admission control: server_config.max_conns open
+    METRIC_REJECTED_PER_IP,       // refused by admission control: max_conns_per_ip open from the address
+    METRIC_REJECTED_IP_TABLE_FULL, // refused by admission control: no room to track the address
+    METRIC_RECV_THROTTLED,        // reads paused because the address overdrew its byte rate
+    METRIC_REPLIES_DROPPED,       // replies discarded by the drop slow consumer policy
+    METRIC_SLOW_CLOSED_PENDING,   // closed by the disconnect slow consumer policy
+    METRIC_SLOW_CLOSED_TIMEOUT,   // closed because pending output made no progress for send_timeout_ms
+    METRIC_CHUNKS_READ,           // shared chunks read from the data file, see chunk_share.h
+    METRIC_CHUNKS_SHARED,         // reply chunks served by a chunk another reply read
+    METRIC_SEGMENT_BYTES_RAW,     // bytes of segments compressed, before compression
+    METRIC_SEGMENT_BYTES_COMPRESSED, // size of the compressed segment files written
+    METRIC_WIRE_BLOCKS_COMPRESSED, // compressed reply blocks compressed for a reply, see wire_compress.h
+    METRIC_WIRE_BLOCKS_SEGMENT,   // compressed reply blocks copied from a compressed segment
+    METRIC_WIRE_BLOCKS_CACHED,    // compressed reply blocks found in the cache
+    METRIC_WIRE_BYTES_RAW,        // store bytes sent in compressed replies
+    METRIC_WIRE_BYTES_COMPRESSED, // what they took on the wire
+    METRIC_BYTES_RECEIVED,
+    METRIC_BYTES_SENT,
+    METRIC_RECORDS_APPENDED,
+    METRIC_APPEND_BATCHES,
+    METRIC_APPEND_FAILURES,     // records whose batch failed to be written or synced
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+/* Latency histograms, observed in nanoseconds */
+typedef enum MetricHistogram {
+    METRIC_APPEND_QUEUE = 0,    // record submitted -> taken by the append writer
+    METRIC_APPEND_LATENCY,      // record submitted -> written (and synced) by the append writer
+    METRIC_SEND_LATENCY,        // reply started -> last byte handed to the socket
+    METRIC_HISTOGRAM_COUNT
+} MetricHistogram;
+
+uint64_t metrics_now_ns(void);
+
+void metrics_thread_init(void);
+void metrics_add(MetricCounter counter, uint64_t value);
+void metrics_observe(MetricHistogram histogram, uint64_t ns);
+
+int metrics_server_start(int port);
+void metrics_server_stop(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+#include "out_queue.h"
+#include "file_send.h"
+#include "recv_buffer.h"
+#include "metrics.h"
+#include "async_log.h"
+
+static OutItem *push(OutQueue *q, off_t off, off_t end, char *data) {
+    if (out_queue_full(q)) {
+        return NULL;
+    }
+    OutItem *item = &q->items[(q->head + q->count) % OUT_QUEUE_SLOTS];
+    item->off = off;
+    item->end = end > off ? end : off;
+    item->data = data;
+    item->started = 0;
+    item->compressed = 0;
+    item->start_ns = metrics_now_ns();
+    q->count++;
+    q->bytes += item->end - item->off;
+    return item;
+}
+
+/* Frees what a sent or discarded item holds */
+static void item_release(OutItem *item) {
+    if (item->data) buffer_pool_free(item->data);
+    item->data = NULL;
+    if (item->compressed) wire_reply_release(&item->wire);
+    item->compressed = 0;
+}
+
+static void pop(OutQueue *q) {
+    OutItem *item = &q->items[q->head];
+    q->bytes -= item->end - item->off;
+    item_release(item);
+    q->head = (q->head + 1) % OUT_QUEUE_SLOTS;
+    q->count--;
+}
+
+/*
+ * out_queue_push_range:
+ * Queues bytes [off, end) of the data store.
+ * Returns 0 on success, or -1 when the queue is full.
+ */
+int out_queue_push_range(OutQueue *q, off_t off, off_t end) {
+    return push(q, off, end, NULL) ? 0 : -1;
+}
+
+/*
+ * out_queue_push_compressed:
+ * Queues bytes [off, end) of the data store as a compressed reply (see
+ * wire_compress.h). 'bytes' counts them uncompressed.
+ * Returns 0 on success, or -1 when the queue is full.
+ */
+int out_queue_push_compressed(OutQueue *q, off_t off, off_t end) {
+    OutItem *item = push(q, off, end, NULL);
+    if (!item) {
+        return -1;
+    }
+    item->compressed = 1;
+    wire_reply_init(&item->wire, item->off, item->end);
+    return 0;
+}
+
+/*
+ * out_queue_push_data:
+ * Queues 'len' bytes of a buffer_pool_alloc() block, freed by the queue
+ * once sent. Returns 0 on success, or -1 when the queue is full (the
+ * block still belongs to the caller).
+ */
+int out_queue_push_data(OutQueue *q, char *data, size_t len) {
+    return push(q, 0, (off_t)len, data) ? 0 : -1;
+}
+
+static int send_data(int sockfd, OutItem *item) {
+    while (item->off < item->end) {
+        ssize_t s = send(sockfd, item->data + item->off, item->end - item->off, MSG_NOSIGNAL);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            log_msg(LOG_ERR, "send: %s", strerror(errno));
+            return -1;
+        }
+        item->off += s;
+        metrics_add(METRIC_BYTES_SENT, s);
+    }
+    return 0;
+}
+
+/*
+ * out_queue_flush:
+ * Sends queued replies in order until the queue is empty or the socket
+ * buffer is full. Each completed reply is observed in the send latency.
+ * Returns 0 when the queue is empty, 1 if the socket would block, or -1
+ * on error.
+ */
+int out_queue_flush(OutQueue *q, int sockfd) {
+    while (q->count > 0) {
+        OutItem *item = &q->items[q->head];
+        off_t before = item->off;
+        int rc;
+        if (item->compressed) {
+            rc = wire_reply_send(&item->wire, sockfd);
+            item->off = rc == 0 ? item->end : item->wire.off;
+            if (item->wire.bytes > 0) item->started = 1;
+        } else {
+            rc = item->data ? send_data(sockfd, item) : file_send_range(sockfd, &item->off, item->end);
+            if (item->off > before) item->started = 1;
+        }
+        q->bytes -= item->off - before;
+        if (rc != 0) {
+            return rc;
+        }
+
+        metrics_observe(METRIC_SEND_LATENCY, metrics_now_ns() - item->start_ns);
+        pop(q);
+    }
+    return 0;
+}
+
+/*
+ * out_queue_drop:
+ * Discards every reply the client got no byte of yet. A partially sent
+ * reply is kept, so the client never sees a truncated one.
+ * Returns the number of replies dropped.
+ */
+unsigned out_queue_drop(OutQueue *q) {
+    unsigned keep = (q->count > 0 && q->items[q->head].started) ? 1 : 0;
+    unsigned dropped = q->count - keep;
+    while (q->count > keep) {
+        /* Drop from the tail, the head may be the one kept */
+        OutItem *item = &q->items[(q->head + q->count - 1) % OUT_QUEUE_SLOTS];
+        q->bytes -= item->end - item->off;
+        item_release(item);
+        q->count--;
+    }
+    return dropped;
+}
+
+/* Frees the in-memory chunks and compressed blocks still queued, when the connection is closed */
+void out_queue_release(OutQueue *q) {
+    while (q->count > 0) {
+        pop(q);
+    }
+}
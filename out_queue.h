@@ -0,0 +1,52 @@
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "wire_compress.h"
+
+#define DEFAULT_MAX_PENDING (4 * 1024 * 1024) // reply bytes queued on a connection before the slow consumer policy applies
+#define OUT_QUEUE_SLOTS 16                    // replies queued on a connection at most
+
+/*
+ * OutItem:
+ * One queued reply: a range of the data store, sent with
+ * file_send_range() or as compressed blocks, or an in-memory chunk owned
+ * by the queue.
+ */
+typedef struct OutItem {
+    off_t off;          // next byte to send: data store offset, or index in 'data'
+    off_t end;          // end of the range, or length of 'data'
+    char *data;         // chunk from buffer_pool_alloc(), NULL for a data store range
+    int started;        // some bytes reached the socket, the item can't be dropped anymore
+    int compressed;     // the range is sent through 'wire'
+    WireReply wire;     // send state of a compressed range, 'off' follows wire.off
+    uint64_t start_ns;  // metrics_now_ns() when the reply was queued, for the send latency
+} OutItem;
+
+/*
+ * OutQueue:
+ * Pending output of a non-blocking connection, a FIFO of replies sent in
+ * order as the socket accepts them. The ring is part of the connection,
+ * so queuing a reply allocates nothing.
+ */
+typedef struct OutQueue {
+    OutItem items[OUT_QUEUE_SLOTS];
+    unsigned head;      // index of the oldest item
+    unsigned count;     // items queued
+    size_t bytes;       // bytes left to send over every item
+} OutQueue;
+
+static inline int out_queue_empty(const OutQueue *q) { return q->count == 0; }
+static inline int out_queue_full(const OutQueue *q) { return q->count == OUT_QUEUE_SLOTS; }
+
+int out_queue_push_range(OutQueue *q, off_t off, off_t end);
+int out_queue_push_compressed(OutQueue *q, off_t off, off_t end);
+int out_queue_push_data(OutQueue *q, char *data, size_t len);
+int out_queue_flush(OutQueue *q, int sockfd);
+unsigned out_queue_drop(OutQueue *q);
+void out_queue_release(OutQueue *q);
+
+#endif /* OUT_QUEUE_H */
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "query.h"
+#include "data_store.h"
+#include "record_index.h"
+#include "simple_stream_server.h"
+
+/* Parses the decimal argument of a query up to the terminating '\n' */
+static int parse_argument(const char *arg, const char *end, unsigned long long *value) {
+    if (arg == end) return -1;
+
+    unsigned long long v = 0;
+    for (const char *p = arg; p < end; p++) {
+        if (*p < '0' || *p > '9') return -1;
+        if (v > (~0ULL - 9) / 10) return -1; // overflow
+        v = v * 10 + (*p - '0');
+    }
+    *value = v;
+    return 0;
+}
+
+/*
+ * query_parse:
+ * Checks whether a complete packet (ending with '\n') is a query.
+ * Returns 1 and fills 'query' if it is, or 0 if it is plain data.
+ */
+int query_parse(const char *packet, size_t len, Query *query) {
+    static const char offset_cmd[] = "?offset ";
+    static const char record_cmd[] = "?record ";
+    static const char range_cmd[] = "?range ";
+    static const char tail_cmd[] = "?tail ";
+    static const char compress_cmd[] = "?compress lz4";
+
+    if (len < 2 || packet[0] != '?') {
+        return 0;
+    }
+
+    /* Allow "\r\n" line endings from telnet-like clients */
+    const char *end = packet + len - 1;
+    if (end > packet && end[-1] == '\r') end--;
+
+    if (server_config.wire_compress && (size_t)(end - packet) == sizeof(compress_cmd) - 1 &&
+        memcmp(packet, compress_cmd, sizeof(compress_cmd) - 1) == 0) {
+        query->type = QUERY_COMPRESS;
+        query->value = 0;
+        return 1;
+    }
+    if (!server_config.incremental) {
+        return 0;
+    }
+
+    const char *arg;
+    query->end = 0;
+    if (len > sizeof(offset_cmd) - 1 && memcmp(packet, offset_cmd, sizeof(offset_cmd) - 1) == 0) {
+        query->type = QUERY_OFFSET;
+        arg = packet + sizeof(offset_cmd) - 1;
+    } else if (len > sizeof(record_cmd) - 1 && memcmp(packet, record_cmd, sizeof(record_cmd) - 1) == 0) {
+        query->type = QUERY_RECORD;
+        arg = packet + sizeof(record_cmd) - 1;
+    } else if (len > sizeof(tail_cmd) - 1 && memcmp(packet, tail_cmd, sizeof(tail_cmd) - 1) == 0) {
+        query->type = QUERY_TAIL;
+        arg = packet + sizeof(tail_cmd) - 1;
+    } else if (len > sizeof(range_cmd) - 1 && memcmp(packet, range_cmd, sizeof(range_cmd) - 1) == 0) {
+        /* Two arguments, "N M" */
+        query->type = QUERY_RANGE;
+        arg = packet + sizeof(range_cmd) - 1;
+        const char *space = memchr(arg, ' ', end - arg);
+        if (!space || parse_argument(space + 1, end, &query->end) != 0) {
+            return 0;
+        }
+        end = space;
+    } else {
+        return 0;
+    }
+
+    return parse_argument(arg, end, &query->value) == 0 ? 1 : 0;
+}
+
+/*
+ * query_resolve:
+ * Narrows 'snap' to the part of the stored data the reply to 'query'
+ * holds (empty, at the end of the snapshot, for "?compress lz4").
+ */
+void query_resolve(const Query *query, DataSnapshot *snap) {
+    switch (query->type) {
+        case QUERY_OFFSET:
+            if (query->value >= (unsigned long long)snap->end) snap->start = snap->end;
+            else if ((off_t)query->value > snap->start) snap->start = (off_t)query->value;
+            break;
+        case QUERY_RECORD:
+            snap->start = record_index_offset(query->value, snap);
+            break;
+        case QUERY_RANGE: {
+            off_t end = query->end > query->value ? record_index_offset(query->end, snap) : snap->start;
+            snap->start = record_index_offset(query->value, snap);
+            snap->end = end > snap->start ? end : snap->start;
+            break;
+        }
+        case QUERY_TAIL: {
+            unsigned long long count = record_index_count(snap);
+            snap->start = record_index_offset(count > query->value ? count - query->value : 0, snap);
+            break;
+        }
+        case QUERY_COMPRESS:
+            snap->start = snap->end;
+            break;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "data_store.h"
+
+/*
+ * Incremental read protocol (enabled with --incremental).
+ *
+ * A packet of the exact form "?offset N\n" or "?record N\n" is a query,
+ * not data: it is not appended, and the reply only contains the stored
+ * data from byte offset N, or from the start of record N (records are
+ * newline-terminated lines, numbered from 0), to the end of the store.
+ * Tailing clients can then fetch only what they have not received yet.
+ * "?range N M\n" replies with records N to M - 1 only, and "?tail N\n"
+ * with the last N records. Records are found through the record index
+ * (see record_index.h) and keep their numbers when retention deletes the
+ * oldest ones. Any other packet is appended and answered as usual.
+ *
+ * Compressed replies (enabled with --compress): "?compress lz4\n" makes
+ * every later reply of the connection compressed (see wire_compress.h).
+ * It is answered with an empty compressed reply, just the end mark, and
+ * doesn't count as the packet of a connection without keep-alive: the
+ * connection stays open for the packet to answer compressed.
+ */
+
+typedef enum QueryType {
+    QUERY_OFFSET,    // reply from a byte offset
+    QUERY_RECORD,    // reply from the start of a record
+    QUERY_RANGE,     // reply with a range of records
+    QUERY_TAIL,      // reply with the last records
+    QUERY_COMPRESS,  // switch the connection to compressed replies
+} QueryType;
+
+typedef struct Query {
+    QueryType type;
+    unsigned long long value;  // offset, first record, or record count of QUERY_TAIL
+    unsigned long long end;    // QUERY_RANGE: record the reply stops before
+} Query;
+
+int query_parse(const char *packet, size_t len, Query *query);
+void query_resolve(const Query *query, DataSnapshot *snap);
+
+#endif /* QUERY_H */
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdatomic.h>
+
+#include "record_cache.h"
+#include "async_log.h"
+
+static char *cache_buf = NULL;          // ring storage, NULL when the cache is disabled
+static size_t cache_size = 0;
+static _Atomic off_t cache_start = 0;   // lowest store offset still resident
+static _Atomic off_t cache_end = 0;     // store offset after the last cached byte
+
+/*
+ * record_cache_init:
+ * Allocates a cache of 'size' bytes for a store currently 'length' bytes
+ * long. Data already stored is not loaded, only what is appended from now on.
+ * A size of 0 disables the cache.
+ * Returns 0 on success, or -1 on error.
+ */
+int record_cache_init(size_t size, off_t length) {
+    atomic_store(&cache_start, length);
+    atomic_store(&cache_end, length);
+    if (size == 0) {
+        return 0;
+    }
+
+    cache_buf = malloc(size);
+    if (!cache_buf) {
+        log_msg(LOG_ERR, "record cache malloc: %s", strerror(errno));
+        return -1;
+    }
+    cache_size = size;
+    return 0;
+}
+
+void record_cache_destroy(void) {
+    free(cache_buf);
+    cache_buf = NULL;
+    cache_size = 0;
+}
+
+/* Copies 'len' bytes into the ring at store offset 'offset', wrapping around */
+static void ring_write(off_t offset, const char *data, size_t len) {
+    size_t pos = (size_t)(offset % (off_t)cache_size);
+    size_t first = cache_size - pos;
+    if (first > len) first = len;
+
+    memcpy(cache_buf + pos, data, first);
+    memcpy(cache_buf, data + first, len - first);
+}
+
+static void ring_read(off_t offset, char *buf, size_t len) {
+    size_t pos = (size_t)(offset % (off_t)cache_size);
+    size_t first = cache_size - pos;
+    if (first > len) first = len;
+
+    memcpy(buf, cache_buf + pos, first);
+    memcpy(buf + first, cache_buf, len - first);
+}
+
+/*
+ * record_cache_append:
+ * Adds bytes just appended to the store. Only the append writer calls
+ * this, after the write succeeded, so the cache never holds bytes the
+ * file doesn't. The start is moved past the bytes about to be
+ * overwritten before they are, so readers can detect a torn copy.
+ */
+void record_cache_append(const char *data, size_t len) {
+    if (!cache_buf || len == 0) return;
+
+    off_t end = atomic_load_explicit(&cache_end, memory_order_relaxed);
+    off_t new_end = end + len;
+
+    /* Only the last cache_size bytes of a huge batch fit */
+    if (len > cache_size) {
+        data += len - cache_size;
+        end = new_end - cache_size;
+        len = cache_size;
+    }
+
+    off_t new_start = new_end - (off_t)cache_size;
+    if (new_start > atomic_load_explicit(&cache_start, memory_order_relaxed)) {
+        atomic_store_explicit(&cache_start, new_start, memory_order_relaxed);
+        /* Orders the start update before the overwriting stores below */
+        atomic_thread_fence(memory_order_release);
+    }
+
+    ring_write(end, data, len);
+    atomic_store_explicit(&cache_end, new_end, memory_order_release);
+}
+
+/* Lowest store offset currently resident (equal to the end when nothing is) */
+off_t record_cache_start(void) {
+    if (!cache_buf) return atomic_load_explicit(&cache_end, memory_order_relaxed);
+    return atomic_load_explicit(&cache_start, memory_order_acquire);
+}
+
+/*
+ * record_cache_read:
+ * Copies up to 'len' bytes at store offset 'offset' into 'buf'.
+ * Returns the number of bytes copied, or 0 if 'offset' is not resident
+ * (never cached, already overwritten, or overwritten during the copy).
+ */
+size_t record_cache_read(void *buf, size_t len, off_t offset) {
+    if (!cache_buf) return 0;
+
+    off_t end = atomic_load_explicit(&cache_end, memory_order_acquire);
+    off_t start = atomic_load_explicit(&cache_start, memory_order_acquire);
+    if (offset < start || offset >= end) {
+        return 0;
+    }
+    if ((off_t)len > end - offset) len = end - offset;
+
+    ring_read(offset, buf, len);
+
+    /* If the writer moved the start past 'offset' meanwhile, the copy may be torn */
+    atomic_thread_fence(memory_order_acquire);
+    if (offset < atomic_load_explicit(&cache_start, memory_order_relaxed)) {
+        return 0;
+    }
+    return len;
+}
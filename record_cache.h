@@ -0,0 +1,28 @@
+#ifndef RECORD_CACHE_H
+#define RECORD_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DEFAULT_CACHE_SIZE (8 * 1024 * 1024) // bytes of recent records kept in memory
+
+/*
+ * The record cache keeps the most recently appended bytes of the data
+ * store in memory, in a ring of server_config.cache_size bytes, so the
+ * tail of the log (what most clients ask for) is sent without reading
+ * DATA_FILE_PATH. Byte 'offset' of the store lives at offset % size.
+ *
+ * It has a single writer, the append writer thread, which adds every
+ * batch after it was written to the file. Readers take no lock: a read
+ * copies the bytes out and then checks that the writer didn't wrap over
+ * them meanwhile, otherwise the caller reads the file instead.
+ */
+int record_cache_init(size_t size, off_t length);
+void record_cache_destroy(void);
+
+void record_cache_append(const char *data, size_t len);
+
+off_t record_cache_start(void);
+size_t record_cache_read(void *buf, size_t len, off_t offset);
+
+#endif /* RECORD_CACHE_H */
@@ -0,0 +1,483 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdatomic.h>
+
+#include "record_index.h"
+#include "data_store.h"
+#include "recv_buffer.h"
+#include "simple_stream_server.h"
+#include "metrics.h"
+#include "async_log.h"
+
+#define INDEX_BLOCK_ENTRIES 4096      // entries per block (64K)
+#define INDEX_MAX_BLOCKS 16384        // blocks at most, 4TB of store at one entry per 64K
+#define INDEX_MAGIC "SSRIDX01"        // start of RECORD_INDEX_PATH, followed by the entries
+#define INDEX_MAGIC_LEN 8
+#define LOOKUP_SCAN_CHUNK (64 * 1024) // bytes read per pread() while scanning from an entry
+#define SCAN_PART_MIN (32 * 1024 * 1024) // least bytes worth a scan thread of their own at open
+#define SCAN_MAX_THREADS 64
+
+/*
+ * IndexEntry:
+ * Record 'record' starts at store offset 'offset'. Persisted as is, in
+ * host byte order.
+ */
+typedef struct IndexEntry {
+    uint64_t record;
+    uint64_t offset;
+} IndexEntry;
+
+static IndexEntry *blocks[INDEX_MAX_BLOCKS];
+static _Atomic size_t entry_count = 0; // entries readers may use, published after the entries themselves
+
+/* Writer state (the append writer, or data_store_open()) */
+static size_t pending_count = 0;      // entries including the batch not committed yet
+static size_t persisted_count = 0;    // entries written to RECORD_INDEX_PATH
+static uint64_t next_record = 0;      // number of the next record
+static off_t next_offset = 0;         // where it starts
+static off_t tail_length = 0;         // store length, past next_offset when the store ends with a partial line
+static uint64_t committed_record = 0; // the same, as of the last commit
+static off_t committed_offset = 0;
+static off_t committed_length = 0;
+static int index_fd = -1;             // RECORD_INDEX_PATH, -1 once a write failed
+static int full_logged = 0;
+
+static IndexEntry *entry_at(size_t i) {
+    return &blocks[i / INDEX_BLOCK_ENTRIES][i % INDEX_BLOCK_ENTRIES];
+}
+
+/* Returns the block holding entry 'i', allocated if needed, or NULL when the index is full */
+static IndexEntry *reserve_block(size_t i) {
+    if (i / INDEX_BLOCK_ENTRIES >= INDEX_MAX_BLOCKS) {
+        if (!full_logged) {
+            log_msg(LOG_WARNING, "record index full, later records are found by scanning");
+            full_logged = 1;
+        }
+        return NULL;
+    }
+
+    IndexEntry **block = &blocks[i / INDEX_BLOCK_ENTRIES];
+    if (!*block) {
+        *block = malloc(INDEX_BLOCK_ENTRIES * sizeof(IndexEntry));
+        if (!*block) {
+            log_msg(LOG_ERR, "record index malloc: %s", strerror(errno));
+        }
+    }
+    return *block;
+}
+
+static void add_entry(uint64_t record, off_t offset) {
+    IndexEntry *block = reserve_block(pending_count);
+    if (!block) return;
+
+    block[pending_count % INDEX_BLOCK_ENTRIES] = (IndexEntry){ record, (uint64_t)offset };
+    pending_count++;
+}
+
+/*
+ * record_end:
+ * The record starting at next_offset ends at 'end'. It gets an entry if
+ * it is the first record, starts a segment ('boundary') or is far enough
+ * from the last entry.
+ */
+static void record_end(off_t end, int boundary) {
+    IndexEntry *last = pending_count > 0 ? entry_at(pending_count - 1) : NULL;
+    if (!last || boundary || next_record - last->record >= RECORD_INDEX_RECORDS ||
+        next_offset - (off_t)last->offset >= RECORD_INDEX_BYTES) {
+        add_entry(next_record, next_offset);
+    }
+    next_record++;
+    next_offset = end;
+}
+
+static void stop_persisting(const char *what) {
+    log_msg(LOG_ERR, "%s (record index): %s", what, strerror(errno));
+    close(index_fd);
+    index_fd = -1;
+    unlink(RECORD_INDEX_PATH); // never trusted partially written
+}
+
+/* Appends the committed entries not written yet to RECORD_INDEX_PATH */
+static void persist(void) {
+    while (index_fd >= 0 && persisted_count < pending_count) {
+        size_t block_end = (persisted_count / INDEX_BLOCK_ENTRIES + 1) * INDEX_BLOCK_ENTRIES;
+        size_t n = (block_end < pending_count ? block_end : pending_count) - persisted_count;
+        size_t len = n * sizeof(IndexEntry);
+        ssize_t w = write(index_fd, entry_at(persisted_count), len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w != (ssize_t)len) {
+            if (w >= 0) errno = EIO;
+            stop_persisting("write");
+            return;
+        }
+        persisted_count += n;
+    }
+}
+
+/*
+ * load_entries:
+ * Reads the entries of RECORD_INDEX_PATH that fit the 'length' bytes of
+ * 'data': increasing, starting with record 0 at offset 0, and the last
+ * one at the start of a line. Returns the number of entries kept.
+ */
+static size_t load_entries(const char *data, off_t length) {
+    int fd = open(RECORD_INDEX_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+
+    char magic[INDEX_MAGIC_LEN];
+    if (read(fd, magic, sizeof(magic)) != (ssize_t)sizeof(magic) || memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    IndexEntry prev = { 0, 0 };
+    IndexEntry *block;
+    while ((block = reserve_block(pending_count)) != NULL) {
+        block += pending_count % INDEX_BLOCK_ENTRIES;
+        size_t room = INDEX_BLOCK_ENTRIES - pending_count % INDEX_BLOCK_ENTRIES;
+        ssize_t n = read(fd, block, room * sizeof(IndexEntry));
+        if (n <= 0) break;
+
+        size_t got = n / sizeof(IndexEntry);
+        size_t valid = 0;
+        while (valid < got) {
+            IndexEntry e = block[valid];
+            int first = pending_count + valid == 0;
+            if (first ? (e.record != 0 || e.offset != 0)
+                      : (e.record <= prev.record || e.offset <= prev.offset || (off_t)e.offset >= length)) {
+                break;
+            }
+            prev = e;
+            valid++;
+        }
+        pending_count += valid;
+        if (valid < got || (size_t)n % sizeof(IndexEntry) != 0) break;
+    }
+    close(fd);
+
+    /* The last entry must still start a line, otherwise the file doesn't match this store */
+    if (pending_count > 0) {
+        IndexEntry *last = entry_at(pending_count - 1);
+        if (last->offset > 0 && data[last->offset - 1] != '\n') {
+            pending_count = 0;
+        }
+    }
+    return pending_count;
+}
+
+/*
+ * ScanPart:
+ * Bytes [start, end) of the store, scanned by one thread at open. Its
+ * entries are those of the records starting in the part, numbered from
+ * the first one; they are renumbered and merged in order once every part
+ * is scanned.
+ */
+typedef struct ScanPart {
+    const char *data;      // the whole store, mapped
+    off_t start;
+    off_t end;
+    int record_start;      // 'start' is the start of a record, not the middle of one
+    uint64_t records;      // records ending in the part
+    off_t last_end;        // where the last of them ends, -1 if none
+    IndexEntry *entries;
+    size_t count;
+    size_t cap;
+    int failed;
+} ScanPart;
+
+static void *scan_part(void *arg) {
+    ScanPart *part = arg;
+    const char *p = part->data + part->start;
+    const char *end = part->data + part->end;
+    off_t next = part->record_start ? part->start : -1; // start of the record being scanned, -1 if before 'start'
+    IndexEntry last = { 0, 0 };
+    const char *nl;
+
+    while ((nl = find_newline(p, end - p)) != NULL) {
+        if (next >= 0 && (part->count == 0 || part->records - last.record >= RECORD_INDEX_RECORDS ||
+                          next - (off_t)last.offset >= RECORD_INDEX_BYTES)) {
+            if (part->count == part->cap) {
+                size_t cap = part->cap ? part->cap * 2 : 1024;
+                IndexEntry *entries = realloc(part->entries, cap * sizeof(IndexEntry));
+                if (!entries) {
+                    part->failed = 1;
+                    return NULL;
+                }
+                part->entries = entries;
+                part->cap = cap;
+            }
+            last = (IndexEntry){ part->records, (uint64_t)next };
+            part->entries[part->count++] = last;
+        }
+        part->records++;
+        next = part->last_end = nl + 1 - part->data;
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+/*
+ * scan_store:
+ * Indexes the records of [from, to) of the mapped store, 'from' being the
+ * start of a record. The range is split among up to one thread per online
+ * CPU, SCAN_PART_MIN bytes each at least.
+ * Returns the number of threads used, or -1 on error.
+ */
+static int scan_store(const char *data, off_t from, off_t to) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    off_t parts_wanted = (to - from) / SCAN_PART_MIN + 1;
+    int nparts = cpus > 1 ? (int)cpus : 1;
+    if (nparts > SCAN_MAX_THREADS) nparts = SCAN_MAX_THREADS;
+    if (nparts > parts_wanted) nparts = (int)parts_wanted;
+
+    ScanPart parts[SCAN_MAX_THREADS];
+    pthread_t threads[SCAN_MAX_THREADS];
+    int started[SCAN_MAX_THREADS];
+    off_t size = (to - from) / nparts;
+    for (int i = 0; i < nparts; i++) {
+        off_t start = from + size * i;
+        parts[i] = (ScanPart){
+            .data = data,
+            .start = start,
+            .end = i == nparts - 1 ? to : start + size,
+            .record_start = start == from || data[start - 1] == '\n',
+            .last_end = -1,
+        };
+    }
+
+    /* The calling thread scans the first part, and any part whose thread couldn't start */
+    for (int i = 1; i < nparts; i++) {
+        started[i] = pthread_create(&threads[i], NULL, scan_part, &parts[i]) == 0;
+    }
+    scan_part(&parts[0]);
+    for (int i = 1; i < nparts; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else scan_part(&parts[i]);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < nparts; i++) {
+        ScanPart *part = &parts[i];
+        failed |= part->failed;
+        for (size_t j = 0; j < part->count && !failed; j++) {
+            uint64_t record = next_record + part->entries[j].record;
+            if (pending_count == 0 || entry_at(pending_count - 1)->record < record) {
+                add_entry(record, part->entries[j].offset);
+            }
+        }
+        next_record += part->records;
+        if (part->last_end >= 0) next_offset = part->last_end;
+        free(part->entries);
+    }
+    if (failed) {
+        log_msg(LOG_ERR, "record index scan: out of memory");
+        return -1;
+    }
+    return nparts;
+}
+
+/*
+ * record_index_open:
+ * Builds the index of a store holding the 'length' bytes mapped at 'data'
+ * (NULL when empty): from the entries of RECORD_INDEX_PATH still valid,
+ * and a scan of the records after them. RECORD_INDEX_PATH is then
+ * rewritten with every entry, and extended by each commit.
+ * Returns 0 on success, or -1 on error.
+ */
+int record_index_open(const char *data, off_t length) {
+    uint64_t start_ns = metrics_now_ns();
+    size_t loaded = length > 0 ? load_entries(data, length) : 0;
+
+    if (loaded > 0) {
+        IndexEntry *last = entry_at(loaded - 1);
+        next_record = last->record;
+        next_offset = last->offset;
+    }
+    off_t scanned = length - next_offset;
+    int threads = scanned > 0 ? scan_store(data, next_offset, length) : 0;
+    if (threads < 0) {
+        record_index_close();
+        return -1;
+    }
+    tail_length = length;
+    record_index_commit(); // publishes the entries, persists nothing: index_fd isn't open yet
+
+    index_fd = open(RECORD_INDEX_PATH, O_CREAT | O_WRONLY | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (index_fd < 0) {
+        log_msg(LOG_ERR, "open (%s): %s", RECORD_INDEX_PATH, strerror(errno));
+    } else {
+        ssize_t w = write(index_fd, INDEX_MAGIC, INDEX_MAGIC_LEN);
+        if (w != INDEX_MAGIC_LEN) {
+            if (w >= 0) errno = EIO;
+            stop_persisting("write");
+        }
+    }
+    persisted_count = 0;
+    persist();
+
+    if (length > 0) {
+        log_msg(LOG_INFO, "Record index: %llu records, %zu entries (%zu loaded, %lld bytes scanned by %d threads in %llu ms)",
+                (unsigned long long)next_record, pending_count, loaded, (long long)scanned, threads,
+                (unsigned long long)((metrics_now_ns() - start_ns) / 1000000));
+    }
+    return 0;
+}
+
+/* Frees the index, the store is closed */
+void record_index_close(void) {
+    if (index_fd >= 0) {
+        close(index_fd);
+        index_fd = -1;
+    }
+    for (size_t i = 0; i < INDEX_MAX_BLOCKS && blocks[i]; i++) {
+        free(blocks[i]);
+        blocks[i] = NULL;
+    }
+    atomic_store(&entry_count, 0);
+    pending_count = persisted_count = 0;
+    next_record = committed_record = 0;
+    next_offset = committed_offset = 0;
+    tail_length = committed_length = 0;
+    full_logged = 0;
+}
+
+/* Deletes RECORD_INDEX_PATH, with the store files */
+void record_index_remove(void) {
+    remove(RECORD_INDEX_PATH);
+}
+
+/*
+ * record_index_append:
+ * Adds the next record, 'len' bytes ending with its '\n', to the batch
+ * being written. 'boundary' is set when it starts a new segment.
+ */
+void record_index_append(size_t len, int boundary) {
+    tail_length += len;
+    record_end(tail_length, boundary);
+}
+
+/* The batch was written: its entries become visible, before its records do */
+void record_index_commit(void) {
+    atomic_store_explicit(&entry_count, pending_count, memory_order_release);
+    committed_record = next_record;
+    committed_offset = next_offset;
+    committed_length = tail_length;
+    persist();
+}
+
+/* The batch failed and was taken back: so are its entries */
+void record_index_rollback(void) {
+    pending_count = atomic_load_explicit(&entry_count, memory_order_relaxed);
+    next_record = committed_record;
+    next_offset = committed_offset;
+    tail_length = committed_length;
+}
+
+/* Index of the last of the first 'count' entries whose field (record or offset) is <= 'value', -1 if none */
+static ssize_t last_entry_at_or_before(size_t count, int by_offset, uint64_t value) {
+    size_t lo = 0, hi = count; // answer in [lo - 1, hi - 1]
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        IndexEntry *e = entry_at(mid);
+        if ((by_offset ? e->offset : e->record) <= value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (ssize_t)lo - 1;
+}
+
+/*
+ * scan_records:
+ * Counts the line ends in [from, to), stopping at the 'skip'th one.
+ * Returns the number counted, and sets '*at' after the last one counted
+ * (to 'from' if none). Returns -1 on a read error.
+ */
+static long long scan_records(off_t from, off_t to, uint64_t skip, off_t *at) {
+    *at = from;
+    if (skip == 0 || from >= to) return 0;
+
+    char *buffer = malloc(LOOKUP_SCAN_CHUNK);
+    if (!buffer) {
+        log_msg(LOG_ERR, "record index lookup malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    uint64_t seen = 0;
+    off_t offset = from;
+    while (offset < to && seen < skip) {
+        size_t want = LOOKUP_SCAN_CHUNK;
+        if ((off_t)want > to - offset) want = to - offset;
+
+        ssize_t n = data_store_pread(buffer, want, offset);
+        if (n <= 0) {
+            log_msg(LOG_ERR, "pread (record index lookup): %s", n < 0 ? strerror(errno) : "unexpected end of file");
+            free(buffer);
+            return -1;
+        }
+
+        const char *p = buffer;
+        const char *end = buffer + n;
+        const char *nl;
+        while (seen < skip && (nl = find_newline(p, end - p)) != NULL) {
+            seen++;
+            *at = offset + (nl - buffer) + 1;
+            p = nl + 1;
+        }
+        offset += n;
+    }
+
+    free(buffer);
+    return (long long)seen;
+}
+
+/*
+ * record_index_offset:
+ * Returns where record 'record' starts within 'snap': the start of the
+ * snapshot if retention deleted it, the end if it isn't stored yet.
+ */
+off_t record_index_offset(unsigned long long record, const DataSnapshot *snap) {
+    size_t count = atomic_load_explicit(&entry_count, memory_order_acquire);
+    if (count == 0 || snap->start >= snap->end) return snap->end;
+
+    /* Segments start with an entry, so the oldest stored record has one */
+    ssize_t oldest = last_entry_at_or_before(count, 1, snap->start);
+    if (oldest < 0 || (off_t)entry_at(oldest)->offset != snap->start) {
+        return snap->start; // index full, the oldest record can't be numbered
+    }
+    if (record <= entry_at(oldest)->record) return snap->start;
+
+    IndexEntry *e = entry_at(last_entry_at_or_before(count, 0, record));
+    if ((off_t)e->offset >= snap->end) return snap->end;
+
+    off_t at;
+    long long seen = scan_records(e->offset, snap->end, record - e->record, &at);
+    return seen == (long long)(record - e->record) ? at : snap->end;
+}
+
+/*
+ * Returns the number of records stored up to the end of 'snap', the
+ * deleted ones included, and the unterminated one a truncated data file
+ * may end with
+ */
+unsigned long long record_index_count(const DataSnapshot *snap) {
+    size_t count = atomic_load_explicit(&entry_count, memory_order_acquire);
+    ssize_t i = count > 0 ? last_entry_at_or_before(count, 1, snap->end) : -1;
+    if (i < 0) return 0;
+
+    IndexEntry *e = entry_at(i);
+    off_t at;
+    long long seen = scan_records(e->offset, snap->end, UINT64_MAX, &at);
+    if (seen < 0) return e->record;
+    return e->record + seen + (at < snap->end);
+}
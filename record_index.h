@@ -0,0 +1,47 @@
+#ifndef RECORD_INDEX_H
+#define RECORD_INDEX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "data_store.h"
+
+#define RECORD_INDEX_PATH DATA_FILE_PATH ".idx" // persisted entries, next to the data file
+#define RECORD_INDEX_RECORDS 1024               // records between two entries at most
+#define RECORD_INDEX_BYTES (64 * 1024)          // store bytes between two entries at most
+
+/*
+ * Sparse record index: where record N starts in the store, records being
+ * the newline-terminated lines numbered from 0 since the store was
+ * created (retention deletes records but doesn't renumber the others).
+ *
+ * The data store adds every appended record while it writes the batch
+ * and commits the batch before its records become visible, so the index
+ * always covers a snapshot. An entry (record number, offset) is kept
+ * every RECORD_INDEX_RECORDS records or RECORD_INDEX_BYTES bytes, and at
+ * the start of every segment, so the oldest stored record always has
+ * one. A lookup is a binary search for the closest entry, then a scan of
+ * at most that many records: O(log n) instead of reading the prefix.
+ *
+ * Entries are only appended, in blocks that never move, and published
+ * with an atomic count: readers take no lock.
+ *
+ * Entries are also appended to RECORD_INDEX_PATH. When the flat file is
+ * opened with data in it, the entries found there are checked against it
+ * and the records after the last one are scanned, instead of the whole
+ * file. A missing or stale index file only costs a full scan, which is
+ * split among threads over a mapping of the file.
+ */
+
+int record_index_open(const char *data, off_t length);
+void record_index_close(void);
+void record_index_remove(void);
+
+void record_index_append(size_t len, int boundary);
+void record_index_commit(void);
+void record_index_rollback(void);
+
+off_t record_index_offset(unsigned long long record, const DataSnapshot *snap);
+unsigned long long record_index_count(const DataSnapshot *snap);
+
+#endif /* RECORD_INDEX_H */
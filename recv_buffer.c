@@ -0,0 +1,212 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "recv_buffer.h"
+#include "simple_stream_server.h"
+#include "async_log.h"
+
+#define RECV_MIN_FREE 1024   // grow the buffer when less than this is left for recv()
+
+/*
+ * BlockHeader:
+ * Stored in front of every block returned by buffer_pool_alloc(),
+ * so buffer_pool_free() knows whether the block fits the pool.
+ */
+typedef struct BlockHeader {
+    size_t cap;
+    struct BlockHeader *next;  // link in the free list while pooled
+} __attribute__((aligned(16))) BlockHeader;
+
+/* Free list of idle blocks of exactly server_config.recv_buf_initial bytes */
+static BlockHeader *pool_head = NULL;
+static int pool_count = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * buffer_pool_alloc:
+ * Returns a block of at least 'size' bytes. Requests that fit the initial
+ * receive buffer size are served from the pool when possible.
+ * Returns NULL on allocation failure.
+ */
+void *buffer_pool_alloc(size_t size) {
+    size_t pool_size = server_config.recv_buf_initial;
+    BlockHeader *hdr = NULL;
+
+    if (size <= pool_size) {
+        pthread_mutex_lock(&pool_mutex);
+        hdr = pool_head;
+        if (hdr) {
+            pool_head = hdr->next;
+            pool_count--;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+        size = pool_size;
+    }
+
+    if (!hdr) {
+        hdr = (BlockHeader *)malloc(sizeof(BlockHeader) + size);
+        if (!hdr) {
+            log_msg(LOG_ERR, "buffer_pool_alloc malloc: %s", strerror(errno));
+            return NULL;
+        }
+        hdr->cap = size;
+    }
+
+    return hdr + 1;
+}
+
+/*
+ * buffer_pool_free:
+ * Returns a block from buffer_pool_alloc() to the pool, or to the
+ * allocator if it was grown or the pool is full.
+ */
+void buffer_pool_free(void *ptr) {
+    if (!ptr) return;
+
+    BlockHeader *hdr = (BlockHeader *)ptr - 1;
+    if (hdr->cap == server_config.recv_buf_initial) {
+        pthread_mutex_lock(&pool_mutex);
+        if (pool_count < RECV_BUF_POOL_MAX) {
+            hdr->next = pool_head;
+            pool_head = hdr;
+            pool_count++;
+            hdr = NULL;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    free(hdr);
+}
+
+/*
+ * recv_buffer_reserve:
+ * Makes sure there is room for the next recv(): allocates the initial
+ * block on first use and doubles the buffer when it gets nearly full.
+ * Returns 0 on success, or -1 if the buffer is full at the maximum
+ * size (packet too large) or memory ran out.
+ */
+int recv_buffer_reserve(RecvBuffer *buf) {
+    if (!buf->data) {
+        buf->data = buffer_pool_alloc(server_config.recv_buf_initial);
+        if (!buf->data) return -1;
+        buf->cap = server_config.recv_buf_initial;
+        buf->len = buf->scanned = 0;
+        return 0;
+    }
+
+    if (buf->cap - buf->len >= RECV_MIN_FREE || buf->cap >= server_config.recv_buf_max) {
+        return buf->len < buf->cap ? 0 : -1;
+    }
+
+    size_t new_cap = buf->cap * 2;
+    if (new_cap > server_config.recv_buf_max) new_cap = server_config.recv_buf_max;
+
+    BlockHeader *hdr = (BlockHeader *)buf->data - 1;
+    BlockHeader *new_hdr = (BlockHeader *)realloc(hdr, sizeof(BlockHeader) + new_cap);
+    if (!new_hdr) {
+        log_msg(LOG_ERR, "recv_buffer_reserve realloc: %s", strerror(errno));
+        return -1;
+    }
+    new_hdr->cap = new_cap;
+    buf->data = (char *)(new_hdr + 1);
+    buf->cap = new_cap;
+    return 0;
+}
+
+/*
+ * recv_buffer_find_newline:
+ * Searches only the bytes received since the last call for '\n'.
+ * Returns a pointer to it, or NULL if the packet is not complete yet.
+ */
+char *recv_buffer_find_newline(RecvBuffer *buf) {
+    if (buf->scanned >= buf->len) return NULL;
+
+    const char *nl = find_newline(buf->data + buf->scanned, buf->len - buf->scanned);
+    buf->scanned = buf->len;
+    return (char *)nl;
+}
+
+/*
+ * recv_buffer_take:
+ * Hands the first 'len' bytes (a complete packet) over to the caller, e.g.
+ * the append writer. Bytes received after the packet (pipelined packets)
+ * are moved to a new block and stay in the buffer, to be scanned again.
+ * Returns the packet storage, or NULL if memory ran out (buffer unchanged).
+ */
+char *recv_buffer_take(RecvBuffer *buf, size_t len) {
+    size_t rest = buf->len - len;
+    if (rest == 0) {
+        return recv_buffer_detach(buf);
+    }
+
+    char *next = buffer_pool_alloc(rest);
+    if (!next) return NULL;
+    memcpy(next, buf->data + len, rest);
+
+    char *packet = buf->data;
+    buf->data = next;
+    buf->cap = ((BlockHeader *)next - 1)->cap;
+    buf->len = rest;
+    buf->scanned = 0;
+    return packet;
+}
+
+/*
+ * recv_buffer_consume:
+ * Drops the first 'len' bytes (a packet that is not kept, e.g. a query),
+ * keeping the bytes received after it.
+ */
+void recv_buffer_consume(RecvBuffer *buf, size_t len) {
+    size_t rest = buf->len - len;
+    if (rest > 0) {
+        memmove(buf->data, buf->data + len, rest);
+    }
+    buf->len = rest;
+    buf->scanned = 0;
+}
+
+/* Hands the storage over to the caller (e.g. the append writer) and resets the buffer */
+char *recv_buffer_detach(RecvBuffer *buf) {
+    char *data = buf->data;
+    buf->data = NULL;
+    buf->len = buf->cap = buf->scanned = 0;
+    return data;
+}
+
+/* Returns the storage to the pool and resets the buffer */
+void recv_buffer_release(RecvBuffer *buf) {
+    buffer_pool_free(recv_buffer_detach(buf));
+}
+
+/*
+ * find_newline:
+ * memchr(data, '\n', len), comparing 16 bytes per instruction with SSE2
+ * where available.
+ */
+#if defined(__SSE2__)
+const char *find_newline(const char *data, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        if (mask) {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+
+    return memchr(data + i, '\n', len - i);
+}
+#else
+const char *find_newline(const char *data, size_t len) {
+    return memchr(data, '\n', len);
+}
+#endif
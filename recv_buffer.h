@@ -0,0 +1,40 @@
+#ifndef RECV_BUFFER_H
+#define RECV_BUFFER_H
+
+#include <stddef.h>
+
+#define DEFAULT_RECV_BUF_INITIAL (16 * 1024)        // first allocation of a packet buffer
+#define DEFAULT_RECV_BUF_MAX     (64 * 1024 * 1024) // largest packet accepted, connection closed beyond it
+#define RECV_BUF_POOL_MAX        1024               // idle initial-size blocks kept for reuse
+
+/*
+ * RecvBuffer:
+ * A growable buffer holding the bytes of the packet being received.
+ * It starts at server_config.recv_buf_initial bytes, doubles as needed
+ * up to server_config.recv_buf_max, and its storage comes from a pool
+ * of blocks reused across connections.
+ *
+ * Blocks are allocated with buffer_pool_alloc(), so a completed packet can
+ * be handed to the append writer as is, which returns it to the pool
+ * with buffer_pool_free() once written.
+ */
+typedef struct RecvBuffer {
+    char *data;
+    size_t len;      // bytes received
+    size_t cap;      // allocated size of 'data'
+    size_t scanned;  // bytes already searched for '\n'
+} RecvBuffer;
+
+void *buffer_pool_alloc(size_t size);
+void buffer_pool_free(void *ptr);
+
+int recv_buffer_reserve(RecvBuffer *buf);
+char *recv_buffer_find_newline(RecvBuffer *buf);
+char *recv_buffer_take(RecvBuffer *buf, size_t len);
+void recv_buffer_consume(RecvBuffer *buf, size_t len);
+char *recv_buffer_detach(RecvBuffer *buf);
+void recv_buffer_release(RecvBuffer *buf);
+
+const char *find_newline(const char *data, size_t len);
+
+#endif /* RECV_BUFFER_H */
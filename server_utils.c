@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // pthread_setaffinity_np()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,45 +13,71 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 
 #include "server_utils.h"
 #include "simple_stream_server.h"
 #include "connection_handler.h"
 #include "thread_list.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "worker_pool.h"
+#include "append_writer.h"
+#include "data_store.h"
+#include "record_cache.h"
+#include "chunk_share.h"
+#include "wire_compress.h"
+#include "metrics.h"
+#include "async_log.h"
+#include "timer_wheel.h"
+#include "admission.h"
+#include "hot_restart.h"
+
+#define TIMESTAMP_INTERVAL_MS 10000 // a "timestamp:" record is appended this often
+#define REAP_INTERVAL_MS 1000       // exited connection threads are joined this often
+#define ACCEPT_POLL_MS 1000         // thread/pool accept loop: wake up at least once a second to check keep_running
 
 #define SIMPLE_SERVER_START 1
 #define FLEXIBLE_SERVER_START (!SIMPLE_SERVER_START)
 
-#define BACKLOG 10   // how many pending connections queue will hold
-
 static int server_sockfd = -1; // server socket file descriptor
+static char server_port[16];   // port given to server_start(), reused by extra reactor listeners
+static int spare_listeners[HOT_RESTART_MAX_LISTENERS]; // taken over with server_sockfd, used by the reactors
+static int spare_count = 0;
 
 extern volatile sig_atomic_t keep_running;
-extern pthread_mutex_t file_mutex;
 extern pthread_mutex_t thread_list_mutex;
-extern pthread_t timer_thread;
 
 
 #if SIMPLE_SERVER_START
 /*
- * server_start: creates a socket, binds it to the specified port, 
+ * create_listen_socket: creates a socket, binds it to the specified port, 
  * and starts listening for incoming connections.
  *
- * Returns 0 on success, or -1 on error.
+ * Returns the socket descriptor on success, or -1 on error.
  */
- int server_start(char *port) {
+static int create_listen_socket(const char *port) {
     struct sockaddr_in server_addr;
 
     /* Create the socket */
-    server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sockfd < 0) {
-        syslog(LOG_ERR, "socket: %s", strerror(errno));
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        log_msg(LOG_ERR, "socket: %s", strerror(errno));
         return -1;
     }
 
-    /* Allow address reuse to avoid "Address already in use" on quick restarts */
+    /* Allow address reuse to avoid "Address already in use" on quick restarts.
+     * SO_REUSEPORT lets every reactor bind its own listener to the same port.
+     * Each option is a separate optname, they can not be OR-ed together. */
     int optval = 1;
-    setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optval, sizeof(optval));
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+        log_msg(LOG_ERR, "setsockopt(SO_REUSEADDR): %s", strerror(errno));
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        log_msg(LOG_ERR, "setsockopt(SO_REUSEPORT): %s", strerror(errno));
+    }
 
     /* Configure server address (IPv4) */
     memset(&server_addr, 0, sizeof(server_addr));
@@ -58,23 +86,20 @@ extern pthread_t timer_thread;
     server_addr.sin_addr.s_addr = INADDR_ANY; /* 0.0.0.0 (bind all interfaces) */
 
     /* Bind the socket to the specified address/port */
-    if (bind(server_sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        syslog(LOG_ERR, "bind: %s", strerror(errno));
-        close(server_sockfd);
-        server_sockfd = -1;
+    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        log_msg(LOG_ERR, "bind: %s", strerror(errno));
+        close(sockfd);
         return -1;
     }
 
     /* Start listening for incoming connections */
-    if (listen(server_sockfd, BACKLOG) < 0) {
-        syslog(LOG_ERR, "listen: %s", strerror(errno));
-        close(server_sockfd);
-        server_sockfd = -1;
+    if (listen(sockfd, server_config.backlog) < 0) {
+        log_msg(LOG_ERR, "listen: %s", strerror(errno));
+        close(sockfd);
         return -1;
     }
 
-    syslog(LOG_INFO, "Server started on port %s\n", port);
-    return 0; /* success */
+    return sockfd; /* success */
 }
 #elif FLEXIBLE_SERVER_START
 void print_addrinfo_node(struct addrinfo *node) {
@@ -118,10 +143,11 @@ Esses passos tornam o seu servidor mais geral e mais robusto, pois:
 -Ele pode usar IPv6 se disponível (caso AF_UNSPEC retorne endereços IPv6 primeiro ou se você mudar para AF_INET6).
 -Ele não fica limitado a apenas um endereço (por exemplo, se a máquina tiver várias interfaces, ele pode tentar cada uma).
 */
-int server_start(char* port) {
+static int create_listen_socket(const char *port) {
     struct addrinfo hints, *servinfo, *p;
     int rv;
     int yes=1;
+    int sockfd = -1;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
@@ -133,7 +159,7 @@ int server_start(char* port) {
         and load up a struct sockaddr for you, taking care of the gritty details (like if it’s IPv4 or IPv6). 
     */
     if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
-        syslog(LOG_ERR, "getaddrinfo failed: %s\n", gai_strerror(rv));
+        log_msg(LOG_ERR, "getaddrinfo failed: %s\n", gai_strerror(rv));
         return -1;
     }
     
@@ -146,35 +172,43 @@ int server_start(char* port) {
             This is generally the first call in the whopping process of writing a socket program, 
             and you can use the result for subsequent calls to listen(), bind(), accept(), or a variety of other functions.
         */
-        if ((server_sockfd = socket(p->ai_family, p->ai_socktype,
+        if ((sockfd = socket(p->ai_family, p->ai_socktype,
                 p->ai_protocol)) == -1) {
-            syslog(LOG_ERR, "socket creation failed: %s", strerror(errno));
+            log_msg(LOG_ERR, "socket creation failed: %s", strerror(errno));
             continue;
         }
         
         // confifure the created socket
         if ( setsockopt(
-                server_sockfd,     // the socket we want to configure 
+                sockfd,     // the socket we want to configure 
                 SOL_SOCKET, 
-                SO_REUSEADDR | SO_REUSEPORT,    // int optname, SO_REUSEADDR allows other sockets to bind() to this port, unless there is an active listening socket bound to the port already. 
+                SO_REUSEADDR,    // int optname, SO_REUSEADDR allows other sockets to bind() to this port, unless there is an active listening socket bound to the port already. 
                                                 // This enables you to get around those “Address already in use” error messages when you try to restart your server after a crash.
                 &yes,         // void *optval, it’s usually a pointer to an int indicating the value in question. 
                               // For booleans, zero is false, and non-zero is true. And that’s an absolute fact, unless it’s different on your system. 
                               // If there is no parameter to be passed, optval can be NULL.
                 sizeof(int)) == -1 //socklen_t optlen, should be set to the length of optval, probably sizeof(int), but varies depending on the option
         ) {
-            syslog(LOG_ERR, "setsockopt failed: %s", strerror(errno));
+            log_msg(LOG_ERR, "setsockopt failed: %s", strerror(errno));
+            close(sockfd);
+            freeaddrinfo(servinfo);
             return -1;
         }
 
+        // SO_REUSEPORT is a separate optname (it can not be OR-ed with SO_REUSEADDR),
+        // it allows each reactor to bind its own listening socket to the same port.
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            log_msg(LOG_ERR, "setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+        }
+
         /* 
             bind() associate a socket with an IP address and port number.
             When a remote machine wants to connect to your server program, it needs two pieces of information: 
             the IP address and the port number. The bind() call allows you to do just that.
         */
-        if (bind(server_sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(server_sockfd);
-            syslog(LOG_ERR, "bind failed: %s", strerror(errno));
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            log_msg(LOG_ERR, "bind failed: %s", strerror(errno));
             continue;
         }
 
@@ -185,49 +219,379 @@ int server_start(char* port) {
     freeaddrinfo(servinfo); // all done with this structure
 
     if (p == NULL)  {
-        syslog(LOG_ERR, "server: failed to bind");
+        log_msg(LOG_ERR, "server: failed to bind");
         return -1;
     }
 
-    if (listen(server_sockfd, BACKLOG) == -1) {
-        syslog(LOG_ERR, "listen: %s", strerror(errno));
+    if (listen(sockfd, server_config.backlog) == -1) {
+        log_msg(LOG_ERR, "listen: %s", strerror(errno));
+        close(sockfd);
         return -1;
     }
 
-    syslog(LOG_INFO, "Server started on port %s\n", port);
-    return 0; //sucess
+    return sockfd; //sucess
 }
 #endif
 
+static void close_listeners(int *fds, int count) {
+    for (int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
+
+/*
+ * server_start: opens the data store and creates the main listening
+ * socket on the specified port, or takes the listening sockets over from
+ * the running server with server_config.takeover.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int server_start(char *port) {
+    /* Before the store is opened: the running server appends nothing more once it handed its sockets over */
+    int fds[HOT_RESTART_MAX_LISTENERS];
+    int taken = 0;
+    if (server_config.takeover) {
+        taken = hot_restart_takeover(fds, HOT_RESTART_MAX_LISTENERS);
+        if (taken < 0) {
+            log_msg(LOG_WARNING, "No server taken over, listening anew");
+            taken = 0;
+        }
+    }
+
+    /* Open DATA_FILE_PATH once, every append and read goes through these descriptors */
+    if (data_store_open() < 0) {
+        close_listeners(fds, taken);
+        return -1;
+    }
+
+    /* Recent records are served from memory, see record_cache.h */
+    if (record_cache_init(server_config.cache_size, data_store_length()) < 0) {
+        data_store_close();
+        close_listeners(fds, taken);
+        return -1;
+    }
+
+    server_sockfd = taken > 0 ? fds[0] : create_listen_socket(port);
+    if (server_sockfd < 0) {
+        record_cache_destroy();
+        data_store_close();
+        return -1;
+    }
+    snprintf(server_port, sizeof(server_port), "%s", port);
+    hot_restart_add_listener(server_sockfd);
+
+    if (taken > 0) {
+        log_msg(LOG_INFO, "Took %d listening sockets over", taken);
+    }
+
+    /* The other sockets taken over go to the reactors, the other modes listen on one */
+    if (server_config.io_mode == IO_MODE_REACTOR) {
+        spare_count = taken > 1 ? taken - 1 : 0;
+        memcpy(spare_listeners, fds + 1, spare_count * sizeof(int));
+    } else if (taken > 1) {
+        log_msg(LOG_WARNING, "Closing %d listening sockets taken over, this mode listens on one", taken - 1);
+        close_listeners(fds + 1, taken - 1);
+    }
+
+    log_msg(LOG_INFO, "Server started on port %s (backlog %d)\n", port, server_config.backlog);
+    return 0; /* success */
+}
+
+static Timer timestamp_timer;
+static Timer reap_timer;
+
+static void on_timestamp_timer(Timer *timer, void *arg) {
+    TimerWheel *wheel = arg;
+    /* Not while a takeover drains: the new server is about to be the only writer */
+    if (hot_restart_state() == HOT_RESTART_RUNNING) {
+        write_timestamp();
+    }
+    timer_add(wheel, timer, TIMESTAMP_INTERVAL_MS, on_timestamp_timer, wheel);
+}
+
+static void on_reap_timer(Timer *timer, void *arg) {
+    TimerWheel *wheel = arg;
+    join_exited_threads(); // check if there is any exited thread to join
+    timer_add(wheel, timer, REAP_INTERVAL_MS, on_reap_timer, wheel);
+}
+
+/*
+ * add_server_timers: schedules the periodic work of the server on the
+ * timer wheel of the main thread's loop, whichever the I/O mode.
+ */
+static void add_server_timers(TimerWheel *wheel) {
+    timer_add(wheel, &timestamp_timer, TIMESTAMP_INTERVAL_MS, on_timestamp_timer, wheel);
+    timer_add(wheel, &reap_timer, REAP_INTERVAL_MS, on_reap_timer, wheel);
+}
+
+/*
+ * server_run_epoll: drives every connection from a single edge-triggered
+ * epoll loop on this thread, instead of spawning a thread per client.
+ */
+static void server_run_epoll(void) {
+    EventLoop loop;
+
+    if (event_loop_init(&loop, server_sockfd) < 0) {
+        log_msg(LOG_ERR, "event loop init FAIL!");
+        return;
+    }
+
+    add_server_timers(&loop.timers);
+
+    log_msg(LOG_INFO, "Running epoll event loop");
+    event_loop_run(&loop);
+    event_loop_destroy(&loop);
+}
+
+/*
+ * server_run_uring: drives every connection from a single io_uring loop
+ * on this thread. Falls back to the epoll loop when io_uring can't be
+ * set up (old kernel, disabled by sysctl or seccomp).
+ */
+static void server_run_uring(void) {
+    UringLoop loop;
+
+    if (uring_loop_init(&loop, server_sockfd) < 0) {
+        log_msg(LOG_WARNING, "io_uring unavailable, falling back to epoll");
+        server_run_epoll();
+        return;
+    }
+
+    add_server_timers(&loop.timers);
+
+    log_msg(LOG_INFO, "Running io_uring event loop");
+    uring_loop_run(&loop);
+    uring_loop_destroy(&loop);
+}
+
+/*
+ * Reactor:
+ * One event loop with its own SO_REUSEPORT listening socket, run by a
+ * thread pinned to a CPU. The kernel spreads incoming connections
+ * across the listeners, so accepts no longer funnel through one socket.
+ */
+typedef struct Reactor {
+    int index;
+    int listen_fd;
+    int slot;        // thread slot handle of a reactor thread
+    EventLoop loop;
+} Reactor;
+
+/* Pin the calling thread to one CPU, chosen round-robin by reactor index */
+static void pin_to_cpu(int index) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        log_msg(LOG_ERR, "pthread_setaffinity_np: %s", strerror(rc));
+    }
+}
+
+/*
+ * reactor_run: body of every reactor, either on a reactor thread
+ * or on the main thread (reactor 0, which owns server_sockfd).
+ */
+static void reactor_run(Reactor *reactor) {
+    pin_to_cpu(reactor->index);
+
+    if (event_loop_init(&reactor->loop, reactor->listen_fd) < 0) {
+        log_msg(LOG_ERR, "reactor %d: event loop init FAIL!", reactor->index);
+        return;
+    }
+    if (reactor->index == 0) {
+        add_server_timers(&reactor->loop.timers);
+    }
+
+    log_msg(LOG_INFO, "Reactor %d running (listen socket: %d)", reactor->index, reactor->listen_fd);
+    event_loop_run(&reactor->loop);
+    event_loop_destroy(&reactor->loop);
+}
+
+static void *reactor_thread_func(void *arg) {
+    Reactor *reactor = (Reactor *)arg;
+    metrics_thread_init();
+
+    reactor_run(reactor);
+
+    close(reactor->listen_fd);
+    log_msg(LOG_INFO, "Exiting reactor %d thread, tid: %lu", reactor->index, pthread_self());
+    int slot = reactor->slot;
+    free(reactor);
+
+    set_thread_as_exited(slot);
+    return NULL;
+}
+
+/*
+ * server_run_reactors: starts server_config.reactors event loops, each with its
+ * own listening socket on the server port. Reactor 0 runs on the calling thread.
+ */
+static void server_run_reactors(void) {
+    int count = server_config.reactors;
+    if (count <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        count = ncpu > 0 ? (int)ncpu : 1;
+    }
+
+    for (int i = 1; i < count; i++) {
+        Reactor *reactor = (Reactor *)calloc(1, sizeof(Reactor));
+        if (!reactor) {
+            log_msg(LOG_ERR, "Reactor calloc: %s", strerror(errno));
+            break;
+        }
+        reactor->index = i;
+        reactor->listen_fd = spare_count > 0 ? spare_listeners[--spare_count] : create_listen_socket(server_port);
+        if (reactor->listen_fd < 0) {
+            free(reactor);
+            break;
+        }
+
+        reactor->slot = thread_slot_reserve();
+        if (reactor->slot < 0) {
+            close(reactor->listen_fd);
+            free(reactor);
+            break;
+        }
+
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, reactor_thread_func, reactor);
+        if (rc != 0) {
+            log_msg(LOG_ERR, "pthread_create (reactor): %s", strerror(rc));
+            thread_slot_cancel(reactor->slot);
+            close(reactor->listen_fd);
+            free(reactor);
+            break;
+        }
+        add_thread_to_list(reactor->slot, tid);
+        hot_restart_add_listener(reactor->listen_fd);
+    }
+
+    /* Taken over from a server that ran more reactors */
+    if (spare_count > 0) {
+        log_msg(LOG_WARNING, "Closing %d listening sockets taken over, more than the reactors", spare_count);
+        close_listeners(spare_listeners, spare_count);
+        spare_count = 0;
+    }
+
+    Reactor main_reactor = { .index = 0, .listen_fd = server_sockfd };
+    reactor_run(&main_reactor);
+}
+
 /*
  * server_run: main loop that accepts new connections and spawns a thread 
- * for each client. 
+ * for each client (or hands them to the event loops, see server_config.io_mode). 
  * 
  * It runs until keep_running is set to 0 (e.g., by a signal).
  */
  void server_run(void) {
+    if (server_config.io_mode == IO_MODE_EPOLL) {
+        server_run_epoll();
+        return;
+    }
+    if (server_config.io_mode == IO_MODE_REACTOR) {
+        server_run_reactors();
+        return;
+    }
+    if (server_config.io_mode == IO_MODE_URING) {
+        server_run_uring();
+        return;
+    }
+
+    int use_pool = (server_config.io_mode == IO_MODE_POOL);
+    if (use_pool && worker_pool_start(server_config.pool_workers, server_config.pool_queue) != 0) {
+        log_msg(LOG_ERR, "worker pool start FAIL!");
+        return;
+    }
+
+    /* No event loop in these modes: the accept loop waits in poll() and runs the timers */
+    TimerWheel timers;
+    timer_wheel_init(&timers);
+    add_server_timers(&timers);
+
+    int flags = fcntl(server_sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(server_sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_msg(LOG_ERR, "fcntl(O_NONBLOCK): %s", strerror(errno));
+    }
+
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
+    /* A takeover stops the accepts, the connections already accepted are served */
+    int accepting = 1;
+    hot_restart_accepting(1);
+
     while (keep_running) {
+        HotRestartState restart = hot_restart_state();
+        if (restart == HOT_RESTART_HANDED_OFF) {
+            break;
+        }
+        if (accepting != (restart == HOT_RESTART_RUNNING)) {
+            accepting = !accepting;
+            hot_restart_accepting(accepting ? 1 : -1);
+        }
+
+        struct pollfd pfd = { .fd = accepting ? server_sockfd : -1, .events = POLLIN };
+        int ready = poll(&pfd, 1, timer_wheel_timeout(&timers, ACCEPT_POLL_MS));
+        timer_wheel_advance(&timers);
+        if (ready <= 0) {
+            if (ready < 0 && errno != EINTR) {
+                log_msg(LOG_ERR, "poll: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        client_addr_len = sizeof(client_addr);
         int client_sockfd = accept(server_sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
         if (client_sockfd < 0) {
             /* If accept() was interrupted by a signal (keep_running is 0), we exit the loop */
             if (keep_running == 0) {
                 break;
             }
-            syslog(LOG_ERR, "accept: %s", strerror(errno));
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_msg(LOG_ERR, "accept: %s", strerror(errno));
+            }
             continue;
         }
-        /* Allocate thread arguments for the new connection */
-        ThreadArgs *args = (ThreadArgs *)malloc(sizeof(ThreadArgs));
-        if (!args) {
-            syslog(LOG_ERR, "ThreadArgs malloc: %s", strerror(errno));
+
+        /* Over the connection limits: close it before a thread or queue slot is spent on it */
+        in_addr_t addr = client_addr.sin_addr.s_addr;
+        if (admission_acquire(addr) != 0) {
             close(client_sockfd);
             continue;
         }
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+        if (use_pool) {
+            char ip_str[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
+
+            /* Hand the socket to a worker, blocks while the work queue is full */
+            if (worker_pool_submit(client_sockfd, ip_str, addr) != 0) {
+                close(client_sockfd);
+                admission_release(addr);
+                metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+                break;
+            }
+            log_msg(LOG_INFO, "Accepted connection from %s", ip_str);
+            continue;
+        }
+
+        /* Take a thread slot for the new connection, its arguments are stored in it */
+        int slot = thread_slot_reserve();
+        if (slot < 0) {
+            close(client_sockfd);
+            admission_release(addr);
+            metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+            continue;
+        }
         // fill args
+        ThreadArgs *args = thread_slot_args(slot);
         args->client_sockfd = client_sockfd;
+        args->addr = addr;
         // fill 'ip_str' with string version of client IP
         char ip_str[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &client_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
@@ -235,49 +599,78 @@ int server_start(char* port) {
         
         /* Create a thread to handle this connection */
         pthread_t tid;
-        if (pthread_create(&tid, NULL, connection_handler, (void *)args) != 0) {
-            syslog(LOG_ERR, "pthread_create: %s", strerror(errno));
+        if (pthread_create(&tid, NULL, connection_handler, (void *)(intptr_t)slot) != 0) {
+            log_msg(LOG_ERR, "pthread_create: %s", strerror(errno));
             close(client_sockfd);
-            free(args);
+            admission_release(addr);
+            metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+            thread_slot_cancel(slot);
             continue;
         }
 
         /* Add the new thread to the global thread list */
-        add_thread_to_list(tid);
+        add_thread_to_list(slot, tid);
 
         /* print client info */
-        syslog(LOG_INFO, "Accepted connection from %s", ip_str);
+        log_msg(LOG_INFO, "Accepted connection from %s", ip_str);
+    }
+
+    if (accepting) {
+        hot_restart_accepting(-1);
     }
 }
 
 /*
  * server_stop: closes the listening socket, waits for all active threads, 
- * and destroys the file_mutex.
+ * stops the append writer and destroys the thread list mutex.
  */
  int server_stop(void) {
-    syslog(LOG_INFO, "Server is stopping...");
-    
+    log_msg(LOG_INFO, "Server is stopping...");
+
+    /* Handed over: the connections left finish their replies first, within --drain-timeout */
+    if (hot_restart_state() == HOT_RESTART_HANDED_OFF) {
+        hot_restart_wait_drained();
+    }
+
     keep_running = 0; // Clear flag for other threads to stop running
 
     /* Wait for all connection threads to complete */
     join_all_threads();
 
+    /* Close connections still waiting for a worker */
+    if (server_config.io_mode == IO_MODE_POOL) {
+        worker_pool_destroy();
+    }
+
+    /* No more records can be submitted, flush what is queued and stop the writer */
+    append_writer_stop();
+
+    metrics_server_stop();
+    hot_restart_stop();
+
+    /* Every connection is closed, nothing uses the address table anymore */
+    admission_destroy();
+
     /* If the listening socket is still open, close it */
     if (server_sockfd >= 0) {
         close(server_sockfd);
         server_sockfd = -1;
     }
-    
-    // Wait for timer_thread to finish.
-    //pthread_join(timer_thread, NULL);
 
     /* Destroy the mutexes */
-    pthread_mutex_destroy(&file_mutex);
     pthread_mutex_destroy(&thread_list_mutex);
 
-    // Delete data file
-    remove(DATA_FILE_PATH);  
+    // Close and delete data file, unless it is kept for the next start (or taken over)
+    record_cache_destroy();
+    chunk_share_destroy();
+    wire_cache_destroy();
+    data_store_close();
+    if (!server_config.persist && hot_restart_state() != HOT_RESTART_HANDED_OFF) {
+        data_store_remove();
+    }
     
+    /* Every other thread was joined, flush the buffered messages */
+    async_log_stop();
     closelog();
 
     return 0; /* success */
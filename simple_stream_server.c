@@ -10,24 +10,75 @@
 #include <string.h>
 #include <syslog.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
 
 #include "simple_stream_server.h"
 #include "server_utils.h"
 #include "thread_list.h"
-
-#define USE_THREAD_TIMER 1
-#define USE_INTERRUPT_TIMER (!USE_THREAD_TIMER)
+#include "worker_pool.h"
+#include "append_writer.h"
+#include "recv_buffer.h"
+#include "record_cache.h"
+#include "data_sync.h"
+#include "metrics.h"
+#include "async_log.h"
+#include "admission.h"
+#include "out_queue.h"
+#include "wire_compress.h"
+#include "hot_restart.h"
 
 #define PORT "9000" // the port users will be connecting to
 
 
 volatile sig_atomic_t keep_running = 1; /* Flag to keep server running */
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // Global mutex for file writes.
+/* Runtime options, see parse_args() */
+ServerConfig server_config = {
+    .io_mode = IO_MODE_THREAD,
+    .backlog = DEFAULT_BACKLOG,
+    .reactors = 0,
+    .pool_workers = DEFAULT_POOL_WORKERS,
+    .pool_queue = DEFAULT_POOL_QUEUE,
+    .send_method = SEND_METHOD_SENDFILE,
+    .recv_buf_initial = DEFAULT_RECV_BUF_INITIAL,
+    .recv_buf_max = DEFAULT_RECV_BUF_MAX,
+    .incremental = 0,
+    .wire_compress = 0,
+    .compress_cache = DEFAULT_COMPRESS_CACHE,
+    .keep_alive = 0,
+    .cache_size = DEFAULT_CACHE_SIZE,
+    .segment_size = 0,
+    .retain_segments = 0,
+    .retain_bytes = 0,
+    .compress_segments = 0,
+    .persist = 0,
+    .durability = DURABILITY_NONE,
+    .sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS,
+    .sync_bytes = DEFAULT_SYNC_BYTES,
+    .metrics_port = 0,
+    .log_level = LOG_INFO,
+    .log_rate = DEFAULT_LOG_RATE,
+    .idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS,
+    .read_timeout_ms = DEFAULT_READ_TIMEOUT_MS,
+    .max_conns = 0,
+    .max_conns_per_ip = 0,
+    .ip_rate = 0,
+    .ip_burst = 0,
+    .max_pending = DEFAULT_MAX_PENDING,
+    .slow_consumer = SLOW_CONSUMER_THROTTLE,
+    .send_timeout_ms = DEFAULT_SEND_TIMEOUT_MS,
+    .slow_timeout_ms = DEFAULT_SLOW_TIMEOUT_MS,
+    .takeover = 0,
+    .drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS,
+};
 
-void write_timestamp() {
+/*
+ * write_timestamp:
+ * Appends a "timestamp:" record, called every TIMESTAMP_INTERVAL_MS by a
+ * timer of the main thread's loop (see server_utils.c).
+ */
+void write_timestamp(void) {
     /* Build the timestamp string in RFC 2822 style */
     time_t rawtime;
     struct tm tm_info;
@@ -42,117 +93,45 @@ void write_timestamp() {
     char timebuffer[128];
     snprintf(timebuffer, sizeof(timebuffer), "timestamp:%s\n", auxtimebuf);
 
-    syslog(LOG_INFO, "%s", timebuffer);
-
-    /* Lock the mutex before writing to DATA_FILE_PATH */
-    pthread_mutex_lock(&file_mutex);
-    {
-        /* Append-only open */
-        #if USE_SYSCALL_FILE
-        int fd = open(DATA_FILE_PATH, O_CREAT | O_WRONLY | O_APPEND, 0644);
-        #else
-        FILE *fd = fopen(DATA_FILE_PATH, "a");
-        #endif
-
-        if (fd != INVALID_FILE) {
-            /* "timestamp: <RFC2822 time>" followed by a newline */
-            #if USE_SYSCALL_FILE
-            write(fd, timebuffer, strlen(timebuffer));
-            close(fd);
-            #else
-            fwrite(timebuffer, 1, strlen(timebuffer), fd);
-            fclose(fd);
-            #endif
-        } else {
-            syslog(LOG_ERR, "%s (timer_thread_func): %s", USE_SYSCALL_FILE ? "open" : "fopen", strerror(errno));
-        }
-    }
-    pthread_mutex_unlock(&file_mutex);
-}
-
-#if USE_THREAD_TIMER
-void *timer_thread_func(void *arg) {
-    (void)arg; // quiet unused variable warning
-    while (keep_running) {
-        
-        // Wait 10 seconds
-        for(int i=0; i<10 && keep_running; i++){
-            sleep(1);  //sleep 1 second
-            join_exited_threads(); //check if there is any exited thread to join
-        }
-        
-        if(!keep_running) 
-            break;
-
-        //Each 10 seconds, write timestamp to file
-        write_timestamp();
-    }
-
-    syslog(LOG_INFO, "Exiting 'timer' thread, tid: %lu,", pthread_self());
-
-    set_thread_as_exited(pthread_self());
-
-    return NULL;
-}
+    log_msg(LOG_INFO, "%s", timebuffer);
 
-int setup_timer_thread() {
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, timer_thread_func, NULL) != 0) {
-        syslog(LOG_ERR, "setup_timer_thread: %s", strerror(errno));
-        return EXIT_FAILURE;
+    /* Queue "timestamp: <RFC2822 time>" followed by a newline to the append writer,
+     * which writes it between client records, never in the middle of one */
+    size_t len = strlen(timebuffer);
+    char *record = buffer_pool_alloc(len);
+    if (!record) {
+        return;
     }
-    add_thread_to_list(tid);
-    return 0;
-}
-#else
-void timer_handler(int signum) {
-    (void)signum; // quiet unused variable warning
-    printf("timer\n");
-}
-
-int setup_timer_handler() {
-    // Set up the signal handler for SIGALRM
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = timer_handler;
-    sigaction(SIGALRM, &sa, NULL);
-
-    // Configure the timer to expire after 10 seconds, then every 10 seconds
-    struct itimerval timer;
-    timer.it_value.tv_sec = 10;      // first expiration after 10s
-    timer.it_value.tv_usec = 0;
-    timer.it_interval.tv_sec = 10;   // subsequent intervals of 10s
-    timer.it_interval.tv_usec = 0;
-
-    // Start the real-time timer (ITIMER_REAL)
-    if (setitimer(ITIMER_REAL, &timer, NULL) == -1) {
-        syslog(LOG_ERR, "setitimer: %s", strerror(errno));
-        return EXIT_FAILURE;
+    memcpy(record, timebuffer, len);
+    if (append_writer_submit(record, len) == 0) {
+        log_msg(LOG_ERR, "write_timestamp: append writer is stopped");
     }
-    return 0;
 }
-#endif
 
-void signal_exit_handler(int signum) {
-    (void)signum; // quiet unused variable warning
-    syslog(LOG_INFO, "Caught signal, exiting");
-    server_stop();
-    exit(0);
+/* SIGUSR1 makes the log more verbose, SIGUSR2 less */
+void signal_log_level_handler(int signum) {
+    async_log_adjust_level(signum == SIGUSR1 ? 1 : -1);
 }
 
 void setup_signal_exit_handlers() {
+    // SIGINT/SIGTERM are read from a signalfd by the control thread, which clears keep_running
+    hot_restart_block_signals();
+
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_exit_handler;
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = signal_log_level_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    // A client closing early must not kill the server from inside send()/sendfile()/splice()
+    signal(SIGPIPE, SIG_IGN);
 }
 
 void daemonize() {
     pid_t pid = fork();
 
     if (pid < 0) {
-        syslog(LOG_ERR, "Failed to fork: %s", strerror(errno));
+        log_msg(LOG_ERR, "Failed to fork: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -167,7 +146,7 @@ void daemonize() {
     // - It detaches from the controlling terminal.
     // - Ensures the daemon keeps running even if the terminal is closed.
     if (setsid() < 0) {
-        syslog(LOG_ERR, "Failed to create new session: %s", strerror(errno));
+        log_msg(LOG_ERR, "Failed to create new session: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -178,11 +157,504 @@ void daemonize() {
     freopen("/dev/null", "w", stderr);
 }
 
+void print_usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-d] [-m thread|epoll|reactor|pool|uring] [-n REACTORS] [-w WORKERS] [-q QUEUE] [-b BACKLOG]\n"
+        "          [-s sendfile|splice|copy] [-k]\n"
+        "  -d           run as a daemon\n"
+        "  -m MODE      connection I/O mode:\n"
+        "                 thread   one thread per connection (default)\n"
+        "                 epoll    single edge-triggered epoll event loop\n"
+        "                 reactor  one epoll loop per CPU, each with its own listening socket\n"
+        "                 pool     fixed pool of worker threads fed by a bounded queue\n"
+        "                 uring    single io_uring event loop, falls back to epoll without io_uring\n"
+        "  -n REACTORS  number of reactors in reactor mode (default: one per online CPU)\n"
+        "  -w WORKERS   worker threads in pool mode (default: %d)\n"
+        "  -q QUEUE     accepted connections queued in pool mode (default: %d)\n"
+        "  -b BACKLOG   listen() backlog (default: %d)\n"
+        "  -s METHOD    how the data file is sent to clients:\n"
+        "                 sendfile zero-copy sendfile(2) (default)\n"
+        "                 splice   zero-copy splice(2) through a pipe\n"
+        "                 copy     pread() into a buffer and send()\n"
+        "               (uring mode always uses linked read + send requests)\n"
+        "\n"
+        "Tuning (SIZE accepts K and M suffixes):\n"
+        "  --recv-buf-initial SIZE  first allocation of a packet receive buffer (default: %d)\n"
+        "  --recv-buf-max SIZE      largest packet accepted, larger ones close the connection (default: %d)\n"
+        "  --cache-size SIZE        recent records kept in memory and sent without reading the\n"
+        "                           data file, 0 disables the cache (default: %d)\n"
+        "\n"
+        "Storage:\n"
+        "  --segment-size SIZE      store records in mmap'ed segment files of SIZE bytes instead\n"
+        "                           of a single flat file (default: 0, flat file)\n"
+        "  --retain-segments N      keep at most N segments, deleting the oldest (default: no limit)\n"
+        "  --retain-bytes SIZE      keep at most SIZE bytes, deleting the oldest segments (default: no limit)\n"
+        "  --compress-segments      rewrite segments once full as LZ4 compressed block files,\n"
+        "                           decompressed 64K at a time when read (default: off)\n"
+        "  --persist                keep the flat data file on shutdown, the next start serves it\n"
+        "                           again (default: deleted on shutdown)\n"
+        "  --durability MODE        when records are synced to disk:\n"
+        "                             none      left to the kernel page cache (default)\n"
+        "                             periodic  background sync every --sync-interval or --sync-bytes\n"
+        "                             sync      each batch synced before its records are answered\n"
+        "  --sync-interval MS       periodic mode: longest time records stay unsynced (default: %d)\n"
+        "  --sync-bytes SIZE        periodic mode: sync early once SIZE bytes are unsynced,\n"
+        "                           0 syncs on the interval only (default: %d)\n"
+        "\n"
+        "Monitoring:\n"
+        "  --metrics-port PORT      serve metrics in the Prometheus text format on\n"
+        "                           127.0.0.1:PORT (default: disabled)\n"
+        "  --log-level LEVEL        err, warning, notice, info or debug (default: info),\n"
+        "                           SIGUSR1 logs more and SIGUSR2 less while running\n"
+        "  --log-rate N             messages logged per second and thread, the rest are\n"
+        "                           counted and dropped, 0 = unlimited (default: %d)\n"
+        "\n"
+        "Protocol:\n"
+        "  -k, --keep-alive         keep connections open and answer every packet, pipelined\n"
+        "                           packets are appended and answered in order\n"
+        "  --idle-timeout MS        close connections that send nothing for MS milliseconds\n"
+        "                           between packets, 0 = never (default: %d)\n"
+        "  --read-timeout MS        close connections that take more than MS milliseconds to send\n"
+        "                           a packet once it started, 0 = never (default: %d)\n"
+        "  --send-timeout MS        close connections whose reply makes no progress for MS\n"
+        "                           milliseconds, 0 = never (default: %d)\n"
+        "  --max-pending SIZE       reply bytes queued for a client before --slow-consumer\n"
+        "                           applies, epoll and reactor modes (default: %d)\n"
+        "  --slow-consumer POLICY   what to do with a client over --max-pending:\n"
+        "                             throttle    stop reading it until it caught up (default)\n"
+        "                             drop        keep reading, discard the replies not started yet\n"
+        "                             disconnect  stop reading it, close it if it didn't catch up\n"
+        "                                         within --slow-timeout\n"
+        "  --slow-timeout MS        disconnect policy: time a client over --max-pending gets to\n"
+        "                           catch up (default: %d)\n"
+        "  --incremental            answer \"?offset N\" and \"?record N\" packets with the stored\n"
+        "                           data from byte offset N / record N only, without appending them\n"
+        "  --compress               accept \"?compress lz4\", after which the replies of the\n"
+        "                           connection are sent as LZ4 compressed blocks\n"
+        "  --compress-cache SIZE    compressed reply blocks kept for later replies, 0 compresses\n"
+        "                           every reply anew (default: %d)\n"
+        "\n"
+        "Admission control (0 = no limit, the default):\n"
+        "  --max-conns N            connections open at once, further ones are closed on accept\n"
+        "  --max-conns-per-ip N     connections open at once from one client address\n"
+        "  --ip-rate SIZE           bytes per second received from one client address, faster\n"
+        "                           connections stop reading until they are back under it\n"
+        "  --ip-burst SIZE          bytes a client address may send at once (default: one second\n"
+        "                           of --ip-rate)\n"
+        "\n"
+        "Restart:\n"
+        "  --takeover               take the listening sockets over from the running server, which\n"
+        "                           stops accepting and appending, finishes its replies and exits\n"
+        "  --drain-timeout MS       once its sockets were taken over, close the connections still\n"
+        "                           open after MS milliseconds, 0 = never (default: %d)\n",
+        prog, DEFAULT_POOL_WORKERS, DEFAULT_POOL_QUEUE, DEFAULT_BACKLOG,
+        DEFAULT_RECV_BUF_INITIAL, DEFAULT_RECV_BUF_MAX, DEFAULT_CACHE_SIZE,
+        DEFAULT_SYNC_INTERVAL_MS, DEFAULT_SYNC_BYTES, DEFAULT_LOG_RATE,
+        DEFAULT_IDLE_TIMEOUT_MS, DEFAULT_READ_TIMEOUT_MS, DEFAULT_SEND_TIMEOUT_MS,
+        DEFAULT_MAX_PENDING, DEFAULT_SLOW_TIMEOUT_MS, DEFAULT_COMPRESS_CACHE,
+        DEFAULT_DRAIN_TIMEOUT_MS);
+}
+
+/* Long-only options, numbered after every short option character */
+enum {
+    OPT_RECV_BUF_INITIAL = 256,
+    OPT_RECV_BUF_MAX,
+    OPT_INCREMENTAL,
+    OPT_CACHE_SIZE,
+    OPT_SEGMENT_SIZE,
+    OPT_RETAIN_SEGMENTS,
+    OPT_RETAIN_BYTES,
+    OPT_DURABILITY,
+    OPT_SYNC_INTERVAL,
+    OPT_SYNC_BYTES,
+    OPT_METRICS_PORT,
+    OPT_LOG_LEVEL,
+    OPT_LOG_RATE,
+    OPT_IDLE_TIMEOUT,
+    OPT_READ_TIMEOUT,
+    OPT_MAX_CONNS,
+    OPT_MAX_CONNS_PER_IP,
+    OPT_IP_RATE,
+    OPT_IP_BURST,
+    OPT_SEND_TIMEOUT,
+    OPT_MAX_PENDING,
+    OPT_SLOW_CONSUMER,
+    OPT_SLOW_TIMEOUT,
+    OPT_COMPRESS_SEGMENTS,
+    OPT_COMPRESS,
+    OPT_COMPRESS_CACHE,
+    OPT_PERSIST,
+    OPT_TAKEOVER,
+    OPT_DRAIN_TIMEOUT,
+};
+
+static const struct option long_options[] = {
+    { "daemon",           no_argument,       NULL, 'd' },
+    { "mode",             required_argument, NULL, 'm' },
+    { "reactors",         required_argument, NULL, 'n' },
+    { "workers",          required_argument, NULL, 'w' },
+    { "queue",            required_argument, NULL, 'q' },
+    { "backlog",          required_argument, NULL, 'b' },
+    { "send",             required_argument, NULL, 's' },
+    { "keep-alive",       no_argument,       NULL, 'k' },
+    { "recv-buf-initial", required_argument, NULL, OPT_RECV_BUF_INITIAL },
+    { "recv-buf-max",     required_argument, NULL, OPT_RECV_BUF_MAX },
+    { "incremental",      no_argument,       NULL, OPT_INCREMENTAL },
+    { "cache-size",       required_argument, NULL, OPT_CACHE_SIZE },
+    { "segment-size",     required_argument, NULL, OPT_SEGMENT_SIZE },
+    { "retain-segments",  required_argument, NULL, OPT_RETAIN_SEGMENTS },
+    { "retain-bytes",     required_argument, NULL, OPT_RETAIN_BYTES },
+    { "durability",       required_argument, NULL, OPT_DURABILITY },
+    { "sync-interval",    required_argument, NULL, OPT_SYNC_INTERVAL },
+    { "sync-bytes",       required_argument, NULL, OPT_SYNC_BYTES },
+    { "metrics-port",     required_argument, NULL, OPT_METRICS_PORT },
+    { "log-level",        required_argument, NULL, OPT_LOG_LEVEL },
+    { "log-rate",         required_argument, NULL, OPT_LOG_RATE },
+    { "idle-timeout",     required_argument, NULL, OPT_IDLE_TIMEOUT },
+    { "read-timeout",     required_argument, NULL, OPT_READ_TIMEOUT },
+    { "max-conns",        required_argument, NULL, OPT_MAX_CONNS },
+    { "max-conns-per-ip", required_argument, NULL, OPT_MAX_CONNS_PER_IP },
+    { "ip-rate",          required_argument, NULL, OPT_IP_RATE },
+    { "ip-burst",         required_argument, NULL, OPT_IP_BURST },
+    { "send-timeout",     required_argument, NULL, OPT_SEND_TIMEOUT },
+    { "max-pending",      required_argument, NULL, OPT_MAX_PENDING },
+    { "slow-consumer",    required_argument, NULL, OPT_SLOW_CONSUMER },
+    { "slow-timeout",     required_argument, NULL, OPT_SLOW_TIMEOUT },
+    { "compress-segments", no_argument,      NULL, OPT_COMPRESS_SEGMENTS },
+    { "compress",         no_argument,       NULL, OPT_COMPRESS },
+    { "compress-cache",   required_argument, NULL, OPT_COMPRESS_CACHE },
+    { "persist",          no_argument,       NULL, OPT_PERSIST },
+    { "takeover",         no_argument,       NULL, OPT_TAKEOVER },
+    { "drain-timeout",    required_argument, NULL, OPT_DRAIN_TIMEOUT },
+    { NULL, 0, NULL, 0 }
+};
+
+/*
+ * parse_size:
+ * Parses a byte count with an optional K or M suffix.
+ * Returns 0 on success, or -1 if 'str' is not a positive size.
+ */
+int parse_size(const char *str, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0 || end == str || value == 0) {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *size = (size_t)value;
+    return 0;
+}
+
+/*
+ * parse_args:
+ * Fills server_config from the command line.
+ * Returns 0 on success, or -1 on invalid arguments.
+ */
+int parse_args(int argc, char *argv[], int *daemon_mode) {
+    int opt;
+    while ((opt = getopt_long(argc, argv, "dm:n:w:q:b:s:k", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                *daemon_mode = 1;
+                break;
+            case 'm':
+                if (strcmp(optarg, "thread") == 0) {
+                    server_config.io_mode = IO_MODE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    server_config.io_mode = IO_MODE_EPOLL;
+                } else if (strcmp(optarg, "reactor") == 0) {
+                    server_config.io_mode = IO_MODE_REACTOR;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    server_config.io_mode = IO_MODE_POOL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    server_config.io_mode = IO_MODE_URING;
+                } else {
+                    fprintf(stderr, "Unknown I/O mode: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'n':
+                server_config.reactors = atoi(optarg);
+                if (server_config.reactors < 0) {
+                    fprintf(stderr, "Invalid number of reactors: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'w':
+                server_config.pool_workers = atoi(optarg);
+                if (server_config.pool_workers <= 0) {
+                    fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'q':
+                server_config.pool_queue = atoi(optarg);
+                if (server_config.pool_queue <= 0) {
+                    fprintf(stderr, "Invalid queue size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'b':
+                server_config.backlog = atoi(optarg);
+                if (server_config.backlog <= 0) {
+                    fprintf(stderr, "Invalid backlog: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "sendfile") == 0) {
+                    server_config.send_method = SEND_METHOD_SENDFILE;
+                } else if (strcmp(optarg, "splice") == 0) {
+                    server_config.send_method = SEND_METHOD_SPLICE;
+                } else if (strcmp(optarg, "copy") == 0) {
+                    server_config.send_method = SEND_METHOD_COPY;
+                } else {
+                    fprintf(stderr, "Unknown send method: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'k':
+                server_config.keep_alive = 1;
+                break;
+            case OPT_RECV_BUF_INITIAL:
+                if (parse_size(optarg, &server_config.recv_buf_initial) != 0) {
+                    fprintf(stderr, "Invalid receive buffer size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_RECV_BUF_MAX:
+                if (parse_size(optarg, &server_config.recv_buf_max) != 0) {
+                    fprintf(stderr, "Invalid receive buffer size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_INCREMENTAL:
+                server_config.incremental = 1;
+                break;
+            case OPT_CACHE_SIZE:
+                if (strcmp(optarg, "0") == 0) {
+                    server_config.cache_size = 0;
+                } else if (parse_size(optarg, &server_config.cache_size) != 0) {
+                    fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SEGMENT_SIZE:
+                if (strcmp(optarg, "0") == 0) {
+                    server_config.segment_size = 0;
+                } else if (parse_size(optarg, &server_config.segment_size) != 0) {
+                    fprintf(stderr, "Invalid segment size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_RETAIN_SEGMENTS:
+                server_config.retain_segments = atoi(optarg);
+                if (server_config.retain_segments < 0) {
+                    fprintf(stderr, "Invalid number of segments: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_RETAIN_BYTES:
+                if (parse_size(optarg, &server_config.retain_bytes) != 0) {
+                    fprintf(stderr, "Invalid retention size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_DURABILITY:
+                if (strcmp(optarg, "none") == 0) {
+                    server_config.durability = DURABILITY_NONE;
+                } else if (strcmp(optarg, "periodic") == 0) {
+                    server_config.durability = DURABILITY_PERIODIC;
+                } else if (strcmp(optarg, "sync") == 0) {
+                    server_config.durability = DURABILITY_SYNC;
+                } else {
+                    fprintf(stderr, "Unknown durability mode: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SYNC_INTERVAL:
+                server_config.sync_interval_ms = atoi(optarg);
+                if (server_config.sync_interval_ms <= 0) {
+                    fprintf(stderr, "Invalid sync interval: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SYNC_BYTES:
+                if (strcmp(optarg, "0") == 0) {
+                    server_config.sync_bytes = 0;
+                } else if (parse_size(optarg, &server_config.sync_bytes) != 0) {
+                    fprintf(stderr, "Invalid sync size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_METRICS_PORT:
+                server_config.metrics_port = atoi(optarg);
+                if (server_config.metrics_port <= 0 || server_config.metrics_port > 65535) {
+                    fprintf(stderr, "Invalid metrics port: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_LOG_LEVEL:
+                if (strcmp(optarg, "err") == 0) {
+                    server_config.log_level = LOG_ERR;
+                } else if (strcmp(optarg, "warning") == 0) {
+                    server_config.log_level = LOG_WARNING;
+                } else if (strcmp(optarg, "notice") == 0) {
+                    server_config.log_level = LOG_NOTICE;
+                } else if (strcmp(optarg, "info") == 0) {
+                    server_config.log_level = LOG_INFO;
+                } else if (strcmp(optarg, "debug") == 0) {
+                    server_config.log_level = LOG_DEBUG;
+                } else {
+                    fprintf(stderr, "Unknown log level: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_LOG_RATE:
+                server_config.log_rate = atoi(optarg);
+                if (server_config.log_rate < 0) {
+                    fprintf(stderr, "Invalid log rate: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_IDLE_TIMEOUT:
+                server_config.idle_timeout_ms = atoi(optarg);
+                if (server_config.idle_timeout_ms < 0) {
+                    fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_READ_TIMEOUT:
+                server_config.read_timeout_ms = atoi(optarg);
+                if (server_config.read_timeout_ms < 0) {
+                    fprintf(stderr, "Invalid read timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_MAX_CONNS:
+                server_config.max_conns = atoi(optarg);
+                if (server_config.max_conns < 0) {
+                    fprintf(stderr, "Invalid max connections: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_MAX_CONNS_PER_IP:
+                server_config.max_conns_per_ip = atoi(optarg);
+                if (server_config.max_conns_per_ip < 0) {
+                    fprintf(stderr, "Invalid max connections per address: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_IP_RATE:
+                if (strcmp(optarg, "0") == 0) {
+                    server_config.ip_rate = 0;
+                } else if (parse_size(optarg, &server_config.ip_rate) != 0) {
+                    fprintf(stderr, "Invalid rate: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_IP_BURST:
+                if (strcmp(optarg, "0") == 0) {
+                    server_config.ip_burst = 0;
+                } else if (parse_size(optarg, &server_config.ip_burst) != 0) {
+                    fprintf(stderr, "Invalid burst: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SEND_TIMEOUT:
+                server_config.send_timeout_ms = atoi(optarg);
+                if (server_config.send_timeout_ms < 0) {
+                    fprintf(stderr, "Invalid send timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_MAX_PENDING:
+                if (parse_size(optarg, &server_config.max_pending) != 0) {
+                    fprintf(stderr, "Invalid pending size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SLOW_CONSUMER:
+                if (strcmp(optarg, "throttle") == 0) {
+                    server_config.slow_consumer = SLOW_CONSUMER_THROTTLE;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    server_config.slow_consumer = SLOW_CONSUMER_DROP;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    server_config.slow_consumer = SLOW_CONSUMER_DISCONNECT;
+                } else {
+                    fprintf(stderr, "Unknown slow consumer policy: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SLOW_TIMEOUT:
+                server_config.slow_timeout_ms = atoi(optarg);
+                if (server_config.slow_timeout_ms < 0) {
+                    fprintf(stderr, "Invalid slow consumer timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_COMPRESS_SEGMENTS:
+                server_config.compress_segments = 1;
+                break;
+            case OPT_COMPRESS:
+                server_config.wire_compress = 1;
+                break;
+            case OPT_COMPRESS_CACHE:
+                if (strcmp(optarg, "0") == 0) {
+                    server_config.compress_cache = 0;
+                } else if (parse_size(optarg, &server_config.compress_cache) != 0) {
+                    fprintf(stderr, "Invalid compressed block cache size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_PERSIST:
+                server_config.persist = 1;
+                break;
+            case OPT_TAKEOVER:
+                server_config.takeover = 1;
+                break;
+            case OPT_DRAIN_TIMEOUT:
+                server_config.drain_timeout_ms = atoi(optarg);
+                if (server_config.drain_timeout_ms < 0) {
+                    fprintf(stderr, "Invalid drain timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (server_config.compress_segments && server_config.segment_size == 0) {
+        fprintf(stderr, "--compress-segments needs --segment-size\n");
+        return -1;
+    }
+    if (server_config.persist && server_config.segment_size != 0) {
+        fprintf(stderr, "--persist needs the flat file (no --segment-size)\n");
+        return -1;
+    }
+    if (server_config.recv_buf_max < server_config.recv_buf_initial) {
+        server_config.recv_buf_max = server_config.recv_buf_initial;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     int daemon_mode = 0;
-    // Verify args to detect deamon mode (-d)
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = 1;
+    // Verify args to detect deamon mode (-d) and the I/O mode (-m)
+    if (parse_args(argc, argv, &daemon_mode) != 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
     }
 
     /* Register signal handlers */
@@ -192,24 +664,46 @@ int main(int argc, char *argv[]) {
     
     /* Start the server on the default port */
     if(server_start(PORT) != 0) {
-        syslog(LOG_ERR, "starting server FAIL!");
+        log_msg(LOG_ERR, "starting server FAIL!");
         return -1;
     }
     
     /* Any Thread must be created AFTER DAEMONIZATION, as the FORK process doesnt inherit threads*/
     if (daemon_mode) {
-        syslog(LOG_INFO, "Running in daemon mode");
+        log_msg(LOG_INFO, "Running in daemon mode");
         daemonize();
     }
 
-    /* Create Timer thread */
-    #if USE_THREAD_TIMER
-    setup_timer_thread();
-    #else
-    setup_timer_handler();
-    #endif
+    metrics_thread_init();
+
+    /* From here on messages are buffered and written to syslog by a logger thread */
+    async_log_start();
+
+    /* Create the append writer thread, the only writer of DATA_FILE_PATH */
+    if (append_writer_start() != 0) {
+        log_msg(LOG_ERR, "starting append writer FAIL!");
+        return -1;
+    }
+
+    /* Connection limits and per-address byte rates, checked from the accept loops */
+    if (admission_init() != 0) {
+        log_msg(LOG_ERR, "admission control init FAIL!");
+        return -1;
+    }
+
+    /* Serve metrics scrapes from a thread of their own */
+    if (server_config.metrics_port > 0 && metrics_server_start(server_config.metrics_port) != 0) {
+        log_msg(LOG_ERR, "starting metrics server FAIL!");
+        return -1;
+    }
+
+    /* Stop on SIGINT/SIGTERM, hand the listening sockets to a new server on request */
+    if (hot_restart_start() != 0) {
+        log_msg(LOG_ERR, "starting control thread FAIL!");
+        return -1;
+    }
 
-    /* Accept connections until a signal (SIGINT/SIGTERM) stops the server */
+    /* Accept connections until a signal (SIGINT/SIGTERM) or a handoff stops the server */
     server_run();
 
     /* Stop the server gracefully (close socket, join threads, etc.) */
@@ -1,16 +1,106 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stddef.h>
+
 #define PROCESS_NAME "simple_stream_server"
 #define DATA_FILE_PATH "/var/tmp/" PROCESS_NAME "data"
 
-#define USE_SYSCALL_FILE 1
-#define USE_STDIO_FILE (!USE_SYSCALL_FILE)
+/*
+ * IoMode:
+ * How accepted connections are driven, selected at startup with '-m'.
+ */
+typedef enum IoMode {
+    IO_MODE_THREAD = 0, // one thread per connection, blocking sockets (default)
+    IO_MODE_EPOLL,      // single edge-triggered epoll loop, non-blocking sockets
+    IO_MODE_REACTOR,    // one epoll loop per CPU, each with its own SO_REUSEPORT listener
+    IO_MODE_POOL,       // fixed pool of worker threads fed by a bounded queue of accepted sockets
+    IO_MODE_URING,      // single io_uring loop (accept, recv, file read + send), epoll if unavailable
+} IoMode;
 
-#if USE_SYSCALL_FILE
-#define INVALID_FILE -1
-#else
-#define INVALID_FILE NULL
-#endif
+/*
+ * SendMethod:
+ * How the data file is copied to the client socket, selected with '-s'.
+ */
+typedef enum SendMethod {
+    SEND_METHOD_SENDFILE = 0, // sendfile(2), zero-copy (default)
+    SEND_METHOD_SPLICE,       // splice(2) through a pipe, zero-copy
+    SEND_METHOD_COPY,         // pread() into a buffer + send()
+} SendMethod;
+
+/*
+ * Durability:
+ * When appended records are synced to disk, selected with '--durability'.
+ */
+typedef enum Durability {
+    DURABILITY_NONE = 0, // page cache only, written back by the kernel (default)
+    DURABILITY_PERIODIC, // background sync every sync_interval_ms / sync_bytes
+    DURABILITY_SYNC,     // every batch synced before its records are answered
+} Durability;
+
+/*
+ * SlowConsumer:
+ * What a non-blocking connection does once more than max_pending reply
+ * bytes wait for the client to read them, selected with '--slow-consumer'.
+ */
+typedef enum SlowConsumer {
+    SLOW_CONSUMER_THROTTLE = 0, // stop reading the connection until its output drains (default)
+    SLOW_CONSUMER_DROP,         // keep reading, discard the replies not started yet
+    SLOW_CONSUMER_DISCONNECT,   // stop reading, close the connection if still over after slow_timeout_ms
+} SlowConsumer;
+
+#define DEFAULT_BACKLOG 10 // how many pending connections queue will hold
+#define DEFAULT_IDLE_TIMEOUT_MS 60000 // connections sending nothing between packets are closed after it
+#define DEFAULT_READ_TIMEOUT_MS 30000 // a packet must be received completely within it (slow clients)
+#define DEFAULT_SEND_TIMEOUT_MS 60000 // a reply that makes no progress for this long closes the connection
+#define DEFAULT_SLOW_TIMEOUT_MS 10000 // disconnect policy: time a slow consumer gets to catch up
+#define DEFAULT_DRAIN_TIMEOUT_MS 30000 // after a handoff, replies still being sent get this long to complete
 
-#endif
\ No newline at end of file
+/*
+ * ServerConfig:
+ * Runtime options parsed from the command line in main().
+ */
+typedef struct ServerConfig {
+    IoMode io_mode;
+    int backlog;   // listen() backlog of every listening socket
+    int reactors;  // number of reactors in IO_MODE_REACTOR, 0 = one per online CPU
+    int pool_workers; // worker threads in IO_MODE_POOL
+    int pool_queue;   // accepted sockets queued for the workers before accept() blocks
+    SendMethod send_method;
+    size_t recv_buf_initial; // first allocation of a packet receive buffer, also the pooled block size
+    size_t recv_buf_max;     // largest packet accepted
+    int incremental;         // accept "?offset N" / "?record N" queries, see query.h
+    int wire_compress;       // accept "?compress lz4", switching the connection to compressed replies
+    size_t compress_cache;   // bytes of compressed reply blocks kept, 0 = none, see wire_compress.h
+    int keep_alive;          // serve every packet of a connection instead of closing after the first
+    size_t cache_size;       // bytes of recent records kept in memory, 0 = disabled, see record_cache.h
+    size_t segment_size;     // size of each mmap'ed segment file, 0 = single flat file, see data_store.h
+    int retain_segments;     // segments kept, the oldest are deleted beyond it (0 = no limit)
+    size_t retain_bytes;     // bytes kept, whole segments are deleted beyond it (0 = no limit)
+    int compress_segments;   // rewrite sealed segments as compressed block files, see data_store.h
+    int persist;             // keep the flat data file (and its record index) on shutdown
+    Durability durability;   // see data_sync.h
+    int sync_interval_ms;    // periodic durability: sync at least this often
+    size_t sync_bytes;       // periodic durability: sync early once this many bytes are pending (0 = never)
+    int metrics_port;        // local port serving metrics in the Prometheus text format, 0 = disabled
+    int log_level;           // most verbose syslog priority logged, changed at runtime with SIGUSR1/SIGUSR2
+    int log_rate;            // messages logged per second and thread, 0 = unlimited, see async_log.h
+    int idle_timeout_ms;     // close connections idle between packets for this long, 0 = never
+    int read_timeout_ms;     // close connections whose packet is not complete this long after it started, 0 = never
+    int max_conns;           // connections open at once, the next ones are closed on accept (0 = no limit)
+    int max_conns_per_ip;    // connections open at once from one address (0 = no limit), see admission.h
+    size_t ip_rate;          // bytes per second received from one address (0 = no limit)
+    size_t ip_burst;         // bytes one address may send at once above ip_rate (0 = one second of ip_rate)
+    size_t max_pending;      // reply bytes queued on a connection before slow_consumer applies, see out_queue.h
+    SlowConsumer slow_consumer;
+    int slow_timeout_ms;     // disconnect policy: close connections over max_pending for this long
+    int send_timeout_ms;     // close connections whose pending reply made no progress for this long, 0 = never
+    int takeover;            // take the listening sockets over from the running server, see hot_restart.h
+    int drain_timeout_ms;    // after handing them to a new server, close the connections left after it, 0 = never
+} ServerConfig;
+
+extern ServerConfig server_config;
+
+void write_timestamp(void);
+
+#endif
@@ -1,4 +1,5 @@
 #include "thread_list.h"
+#include "async_log.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,122 +12,165 @@
 
 
 /*
- * We maintain a global head pointer (thread_list_head)
- * to the singly linked list of threads, as well as a mutex
- * to protect modifications to this list.
+ * Every server thread owns a slot of a slab that grows by chunks of
+ * THREAD_SLOT_CHUNK slots and never shrinks, so a slot (and the
+ * ThreadArgs in it) doesn't move while its thread runs. Slots are
+ * reused through a free list, so thread churn doesn't hit the allocator,
+ * and every operation on a slot is O(1) through its handle. The mutex
+ * protects the slab and the lists.
  */
-static ThreadNode *thread_list_head = NULL;
+static ThreadSlot *chunks[THREAD_SLOT_CHUNKS];
+static int chunk_count = 0;
+static int free_head = -1;
+static int live_head = -1;
+static int exited_head = -1;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static ThreadSlot *slot_at(int handle) {
+    return &chunks[handle / THREAD_SLOT_CHUNK][handle % THREAD_SLOT_CHUNK];
+}
+
+/* Adds a chunk of slots to the free list, called with the mutex held */
+static int grow_slab(void) {
+    if (chunk_count == THREAD_SLOT_CHUNKS) {
+        log_msg(LOG_ERR, "thread slots exhausted (%d threads)", THREAD_SLOT_CHUNK * THREAD_SLOT_CHUNKS);
+        return -1;
+    }
+    ThreadSlot *chunk = (ThreadSlot *)calloc(THREAD_SLOT_CHUNK, sizeof(ThreadSlot));
+    if (!chunk) {
+        log_msg(LOG_ERR, "ThreadSlot calloc: %s", strerror(errno));
+        return -1;
+    }
+
+    int base = chunk_count * THREAD_SLOT_CHUNK;
+    for (int i = THREAD_SLOT_CHUNK - 1; i >= 0; i--) {
+        chunk[i].live_next = free_head;
+        free_head = base + i;
+    }
+    chunks[chunk_count++] = chunk;
+    return 0;
+}
+
+static void live_unlink(int handle) {
+    ThreadSlot *slot = slot_at(handle);
+    if (slot->live_prev >= 0) slot_at(slot->live_prev)->live_next = slot->live_next;
+    else live_head = slot->live_next;
+    if (slot->live_next >= 0) slot_at(slot->live_next)->live_prev = slot->live_prev;
+}
+
+static void exited_unlink(int handle) {
+    ThreadSlot *slot = slot_at(handle);
+    if (slot->exit_prev >= 0) slot_at(slot->exit_prev)->exit_next = slot->exit_next;
+    else exited_head = slot->exit_next;
+    if (slot->exit_next >= 0) slot_at(slot->exit_next)->exit_prev = slot->exit_prev;
+}
+
+/* Takes a slot out of every list and back to the free list, called with the mutex held */
+static void release_slot(int handle) {
+    ThreadSlot *slot = slot_at(handle);
+    if (slot->state == THREAD_SLOT_EXITED) exited_unlink(handle);
+    live_unlink(handle);
+    slot->state = THREAD_SLOT_FREE;
+    slot->live_next = free_head;
+    free_head = handle;
+}
+
 /*
- * add_thread_to_list:
- * Allocates a new ThreadNode to store the given pthread_t tid
- * and inserts it at the beginning of the list.
+ * thread_slot_reserve:
+ * Takes a slot from the free list for a thread about to be created.
+ * The handle is passed to the thread, which calls set_thread_as_exited()
+ * with it before returning.
+ * Returns the handle, or -1 on error.
  */
- void add_thread_to_list(pthread_t tid) {
-    ThreadNode *node = (ThreadNode *)malloc(sizeof(ThreadNode));
-    if (!node) {
-        syslog(LOG_ERR, "ThreadNode malloc: %s", strerror(errno));
-        return;
+int thread_slot_reserve(void) {
+    pthread_mutex_lock(&thread_list_mutex);
+    if (free_head < 0 && grow_slab() < 0) {
+        pthread_mutex_unlock(&thread_list_mutex);
+        return -1;
     }
-    node->thread_id = tid;
-    node->exited = 0;
-    node->next = NULL;
 
+    int handle = free_head;
+    ThreadSlot *slot = slot_at(handle);
+    free_head = slot->live_next;
+
+    slot->state = THREAD_SLOT_RESERVED;
+    slot->exit_prev = slot->exit_next = -1;
+    slot->live_prev = -1;
+    slot->live_next = live_head;
+    if (live_head >= 0) slot_at(live_head)->live_prev = handle;
+    live_head = handle;
+
+    pthread_mutex_unlock(&thread_list_mutex);
+    return handle;
+}
+
+/* Gives back a reserved slot whose thread could not be created */
+void thread_slot_cancel(int handle) {
     pthread_mutex_lock(&thread_list_mutex);
-    node->next = thread_list_head;
-    thread_list_head = node;
+    release_slot(handle);
     pthread_mutex_unlock(&thread_list_mutex);
 }
 
+/* Arguments of the connection handler thread of 'handle', valid until it is joined */
+ThreadArgs *thread_slot_args(int handle) {
+    pthread_mutex_lock(&thread_list_mutex);
+    ThreadArgs *args = &slot_at(handle)->args;
+    pthread_mutex_unlock(&thread_list_mutex);
+    return args;
+}
+
 /*
- * remove_thread_from_list:
- * Searches the list for the given pthread_t tid.
- * When found, removes it from the list and frees the node.
+ * add_thread_to_list:
+ * Records the thread created for a reserved slot. The thread may have
+ * exited already, set_thread_as_exited() fills in its id as well.
  */
-void remove_thread_from_list(pthread_t tid) {
+void add_thread_to_list(int handle, pthread_t tid) {
     pthread_mutex_lock(&thread_list_mutex);
-
-    ThreadNode *prev = NULL;
-    ThreadNode *curr = thread_list_head;
-
-    while (curr != NULL) {
-        if (pthread_equal(curr->thread_id, tid)) {
-            /* Found the node */
-            if (prev == NULL) {
-                /* Removing the head node */
-                thread_list_head = curr->next;
-            } else {
-                /* Removing a middle or tail node */
-                prev->next = curr->next;
-            }
-
-            syslog(LOG_INFO, "free thread node (tid: %lu)", curr->thread_id);            
-            free(curr);
-            break;
-        }
-        prev = curr;
-        curr = curr->next;
+    ThreadSlot *slot = slot_at(handle);
+    slot->thread_id = tid;
+    if (slot->state == THREAD_SLOT_RESERVED) {
+        slot->state = THREAD_SLOT_RUNNING;
     }
-
     pthread_mutex_unlock(&thread_list_mutex);
 }
 
 /*
  * set_thread_as_exited:
- * search the list for the given pthread_t tid.
- * when found set as 'exited'.
+ * Called by a thread on its way out: marks its slot as 'exited' and
+ * queues it to be joined.
  */
- void set_thread_as_exited(pthread_t tid) {
+void set_thread_as_exited(int handle) {
     pthread_mutex_lock(&thread_list_mutex);
-
-    ThreadNode *node = thread_list_head;
-
-    while (node != NULL) {
-        if (pthread_equal(node->thread_id, tid)) {
-            /* Found the node */
-            node->exited = 1;
-            syslog(LOG_INFO, "set thread node as 'exited' (tid: %lu)", node->thread_id);            
-            break;
-        }
-        node = node->next;
-    }
-
+    ThreadSlot *slot = slot_at(handle);
+    slot->thread_id = pthread_self();
+    slot->state = THREAD_SLOT_EXITED;
+    slot->exit_prev = -1;
+    slot->exit_next = exited_head;
+    if (exited_head >= 0) slot_at(exited_head)->exit_prev = handle;
+    exited_head = handle;
+    log_msg(LOG_INFO, "set thread node as 'exited' (tid: %lu)", slot->thread_id);
     pthread_mutex_unlock(&thread_list_mutex);
 }
 
 
 /*
  * join_exited_threads:
- * search the list for any pthread_t marked as 'exited'.
- * when found, join the thread, and free its node from the thread list.
+ * Joins every thread marked as 'exited' and frees their slots.
+ * All exited threads are reaped in a single sweep, without looking at
+ * the running ones, so bursts of short connections don't leave the
+ * list growing between sweeps.
  */
  void join_exited_threads(void) {
     pthread_mutex_lock(&thread_list_mutex);
 
-    ThreadNode *prev = NULL;
-    ThreadNode *curr = thread_list_head;
-
-    while (curr != NULL) {
-        if (curr->exited) {
-            /* Found exited node */
-            syslog(LOG_INFO, "joining 'exited' thread (tid: %lu)", curr->thread_id);            
-            pthread_join(curr->thread_id, NULL);
-
-            if (prev == NULL) {
-                /* Removing the head node */
-                thread_list_head = curr->next;
-            } else {
-                /* Removing a middle or tail node */
-                prev->next = curr->next;
-            }
-
-            syslog(LOG_INFO, "free thread node (tid: %lu)", curr->thread_id);            
-            free(curr);
-            break;
-        }
-        prev = curr;
-        curr = curr->next;
+    while (exited_head >= 0) {
+        int handle = exited_head;
+        ThreadSlot *slot = slot_at(handle);
+        log_msg(LOG_INFO, "joining 'exited' thread (tid: %lu)", slot->thread_id);
+        pthread_join(slot->thread_id, NULL);
+
+        log_msg(LOG_INFO, "free thread node (tid: %lu)", slot->thread_id);
+        release_slot(handle);
     }
 
     pthread_mutex_unlock(&thread_list_mutex);
@@ -134,39 +178,40 @@ void remove_thread_from_list(pthread_t tid) {
 
 /*
  * join_all_threads:
- * Iterates over the list of threads, performing pthread_join on each.
- * And remove the thread from the list as well,
- * we repeatedly check until the list is empty.
+ * Joins every thread of the live list and frees their slots,
+ * until the list is empty. Reserved slots whose thread was never
+ * created are freed without a join.
  */
  void join_all_threads(void) {
-    syslog(LOG_INFO, "join_all_threads");
+    log_msg(LOG_INFO, "join_all_threads");
     while (1) {
         pthread_mutex_lock(&thread_list_mutex);
-        
-        ThreadNode *node = thread_list_head;
-        if (!node) {
-            syslog(LOG_INFO, "no threads to join");
+
+        int handle = live_head;
+        if (handle < 0) {
+            log_msg(LOG_INFO, "no threads to join");
             /* The list is empty; no more threads to join */
             pthread_mutex_unlock(&thread_list_mutex);
             break;
         }
 
-        /* Take the first thread in the list */
-        pthread_t tid = node->thread_id;
+        ThreadSlot *slot = slot_at(handle);
+        if (slot->state == THREAD_SLOT_RESERVED) {
+            release_slot(handle);
+            pthread_mutex_unlock(&thread_list_mutex);
+            continue;
+        }
+
+        /* Take the first thread in the list, it marks itself as exited before returning */
+        pthread_t tid = slot->thread_id;
         pthread_mutex_unlock(&thread_list_mutex);
 
-        /*
-         * Wait for this thread to finish.
-         * remove_thread_from_list() is typically called by the
-         * thread itself upon exit. But if it's not removed yet,
-         * we can also remove it after join to ensure no memory leaks.
-         */
         pthread_join(tid, NULL);
-        syslog(LOG_INFO,"pthread_join tid: %lu", tid);
+        log_msg(LOG_INFO,"pthread_join tid: %lu", tid);
 
-        /*
-         * Remove the thread from the list
-         */
-        remove_thread_from_list(tid);
+        pthread_mutex_lock(&thread_list_mutex);
+        log_msg(LOG_INFO, "free thread node (tid: %lu)", tid);
+        release_slot(handle);
+        pthread_mutex_unlock(&thread_list_mutex);
     }
-}
\ No newline at end of file
+}
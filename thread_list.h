@@ -2,22 +2,56 @@
 #define thread_list_H
 
 #include <pthread.h>
+#include <netinet/in.h>
+
+#define THREAD_SLOT_CHUNK 256   // slots allocated at once when the free list is empty
+#define THREAD_SLOT_CHUNKS 256  // at most THREAD_SLOT_CHUNK * THREAD_SLOT_CHUNKS threads
+
+/*
+ * ThreadArgs:
+ * The arguments needed by a connection handler thread, stored in its
+ * thread slot, so starting a thread allocates nothing.
+ */
+typedef struct ThreadArgs {
+    int client_sockfd; // client socket file descriptor
+    char ip_str[INET_ADDRSTRLEN];
+    in_addr_t addr;    // client address, admitted by admission_acquire()
+} ThreadArgs;
+
+/*
+ * ThreadSlotState:
+ * A slot is reserved before its thread is created, so the handle can be
+ * passed to the thread, and goes back to the free list once reaped.
+ */
+typedef enum ThreadSlotState {
+    THREAD_SLOT_FREE = 0,
+    THREAD_SLOT_RESERVED,   // no thread yet
+    THREAD_SLOT_RUNNING,
+    THREAD_SLOT_EXITED,     // set_thread_as_exited() was called, waiting to be joined
+} ThreadSlotState;
 
 /*
- * ThreadNode:
- * A node in the singly linked list that stores a pthread_t.
+ * ThreadSlot:
+ * Entry of the slab of server threads, found by its index (the handle)
+ * in O(1). Slots are linked by index: every used slot is in the live
+ * list (for join_all_threads()), exited ones also in the exited list
+ * (for join_exited_threads()), and unused ones in the free list.
  */
-typedef struct ThreadNode {
+typedef struct ThreadSlot {
     pthread_t thread_id;
-    int exited;
-    struct ThreadNode *next;
-} ThreadNode;
+    ThreadSlotState state;
+    int live_prev, live_next;  // live list, or free list (live_next only)
+    int exit_prev, exit_next;  // exited list
+    ThreadArgs args;           // connection handler threads only
+} ThreadSlot;
 
+int thread_slot_reserve(void);
+void thread_slot_cancel(int handle);
+ThreadArgs *thread_slot_args(int handle);
 
-void add_thread_to_list(pthread_t tid);
-void remove_thread_from_list(pthread_t tid);
-void set_thread_as_exited(pthread_t tid);
+void add_thread_to_list(int handle, pthread_t tid);
+void set_thread_as_exited(int handle);
 void join_exited_threads(void);
 void join_all_threads(void);
 
-#endif
\ No newline at end of file
+#endif
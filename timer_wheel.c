@@ -0,0 +1,158 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+
+/* Longest delay in ticks, longer ones are clamped */
+#define MAX_DELTA ((1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(TimerWheel *wheel) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->start_ms = timer_now_ms();
+}
+
+/*
+ * enqueue:
+ * Links 'timer' into the slot covering its expiry: level 0 if it expires
+ * within 64 ticks of the next tick to run, level 1 within 64^2, and so on.
+ */
+static void enqueue(TimerWheel *wheel, Timer *timer) {
+    if (timer->expires < wheel->tick) timer->expires = wheel->tick;
+    uint64_t delta = timer->expires - wheel->tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        timer->expires = wheel->tick + MAX_DELTA;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << LEVEL_SHIFT(level + 1))) {
+        level++;
+    }
+
+    Timer **slot = &wheel->slots[level][(timer->expires >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    timer->next = *slot;
+    if (timer->next) timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void unlink_timer(Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/*
+ * timer_add:
+ * Arms 'timer' to call 'callback(timer, arg)' from timer_wheel_advance()
+ * once 'delay_ms' elapsed, never earlier. Re-arms it if already armed.
+ */
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t delay_ms, TimerCallback callback, void *arg) {
+    if (timer->pprev) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+    timer->callback = callback;
+    timer->arg = arg;
+    /* The wheel may lag behind the clock (advanced before the caller waited), count from now */
+    timer->expires = (timer_now_ms() - wheel->start_ms + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    enqueue(wheel, timer);
+    wheel->count++;
+}
+
+/* Disarms 'timer', a no-op if it is not armed */
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (!timer->pprev) return;
+    unlink_timer(timer);
+    wheel->count--;
+}
+
+/* Moves the timers of one slot of 'level' down, now that the ticks it covers are next */
+static void cascade(TimerWheel *wheel, int level) {
+    Timer **slot = &wheel->slots[level][(wheel->tick >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    Timer *timer = *slot;
+    *slot = NULL;
+    while (timer) {
+        Timer *next = timer->next;
+        enqueue(wheel, timer);
+        timer = next;
+    }
+}
+
+/*
+ * timer_wheel_advance:
+ * Runs the callbacks of every timer expired by now. Callbacks may add or
+ * cancel any timer, including their own; a timer added with no delay
+ * runs on the next call.
+ */
+void timer_wheel_advance(TimerWheel *wheel) {
+    uint64_t target = (timer_now_ms() - wheel->start_ms) / TIMER_TICK_MS;
+
+    while (wheel->tick <= target) {
+        if (wheel->count == 0) {
+            /* Nothing to cascade or run, skip the idle ticks */
+            wheel->tick = target + 1;
+            break;
+        }
+
+        int idx = wheel->tick & SLOT_MASK;
+        if (idx == 0) {
+            /* Level 0 wrapped: refill it from level 1, which may need a refill first, ... */
+            int top = 1;
+            while (top < TIMER_WHEEL_LEVELS - 1 && ((wheel->tick >> LEVEL_SHIFT(top)) & SLOT_MASK) == 0) {
+                top++;
+            }
+            for (int level = top; level > 0; level--) {
+                cascade(wheel, level);
+            }
+        }
+
+        /* Detach the slot, so timers re-added by the callbacks (even to this slot) run later */
+        wheel->tick++;
+        Timer *expired = wheel->slots[0][idx];
+        wheel->slots[0][idx] = NULL;
+        if (expired) expired->pprev = &expired;
+
+        while (expired) {
+            Timer *timer = expired;
+            unlink_timer(timer);
+            wheel->count--;
+            timer->callback(timer, timer->arg);
+        }
+    }
+}
+
+/*
+ * timer_wheel_timeout:
+ * Milliseconds the caller may sleep before timer_wheel_advance() has
+ * work to do, at most 'max_ms'. Looks at level 0 only: when it is empty,
+ * wakes at its wrap to cascade the next level.
+ */
+int timer_wheel_timeout(const TimerWheel *wheel, int max_ms) {
+    if (wheel->count == 0) return max_ms;
+
+    uint64_t ticks = TIMER_WHEEL_SLOTS - (wheel->tick & SLOT_MASK);
+    for (uint64_t k = 0; k < ticks; k++) {
+        if (wheel->slots[0][(wheel->tick + k) & SLOT_MASK]) {
+            ticks = k;
+            break;
+        }
+    }
+
+    uint64_t deadline = wheel->start_ms + (wheel->tick + ticks) * TIMER_TICK_MS;
+    uint64_t now = timer_now_ms();
+    if (deadline <= now) return 0;
+    if (deadline - now > (uint64_t)max_ms) return max_ms;
+    return (int)(deadline - now);
+}
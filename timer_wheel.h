@@ -0,0 +1,56 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10              // resolution of every timer
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4          // 64^4 ticks of 10ms: delays up to ~46 hours
+
+struct Timer;
+typedef void (*TimerCallback)(struct Timer *timer, void *arg);
+
+/*
+ * Timer:
+ * A single-shot timer, embedded in the structure it belongs to (e.g. a
+ * connection), so arming it allocates nothing. Zero-initialized timers
+ * are valid and not armed.
+ */
+typedef struct Timer {
+    uint64_t expires;          // tick it fires at
+    TimerCallback callback;
+    void *arg;
+    struct Timer *next;        // slot list
+    struct Timer **pprev;      // link pointing to this timer, NULL when not armed
+} Timer;
+
+/*
+ * TimerWheel:
+ * Hierarchical timing wheel owned by one event loop thread (not thread
+ * safe). Level 0 has a slot per tick; each higher level has slots 64
+ * times as wide, whose timers are cascaded down one level when level 0
+ * wraps around. Arming and cancelling are O(1), and expiring costs O(1)
+ * per timer plus at most one cascade per level.
+ */
+typedef struct TimerWheel {
+    uint64_t start_ms;         // monotonic time of tick 0
+    uint64_t tick;             // next tick to expire
+    unsigned count;            // armed timers
+    Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+uint64_t timer_now_ms(void);
+
+void timer_wheel_init(TimerWheel *wheel);
+void timer_wheel_advance(TimerWheel *wheel);
+int timer_wheel_timeout(const TimerWheel *wheel, int max_ms);
+
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t delay_ms, TimerCallback callback, void *arg);
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+
+static inline int timer_armed(const Timer *timer) {
+    return timer->pprev != NULL;
+}
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,1249 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "uring_loop.h"
+#include "simple_stream_server.h"
+#include "append_writer.h"
+#include "data_store.h"
+#include "record_cache.h"
+#include "chunk_share.h"
+#include "recv_buffer.h"
+#include "query.h"
+#include "wire_compress.h"
+#include "metrics.h"
+#include "async_log.h"
+#include "admission.h"
+#include "hot_restart.h"
+
+extern volatile sig_atomic_t keep_running;
+
+/* Multishot accept and provided buffer rings arrived together (Linux 5.19), older headers get the stub below */
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(__NR_io_uring_setup)
+
+#define URING_SQ_ENTRIES 1024        // submission queue size
+#define URING_CQ_ENTRIES 16384       // completion queue size, room for two operations per connection
+#define URING_BUF_COUNT 256          // receive buffers provided to the kernel (power of 2)
+#define URING_BUF_SIZE (16 * 1024)   // size of each provided receive buffer
+#define URING_BUF_GROUP 0            // buffer group id of the provided buffers
+#define URING_SEND_CHUNK (64 * 1024) // bytes per send copied from the record cache
+#define URING_DRAIN_ROUNDS 5         // io_uring_enter() calls spent waiting for cancelled operations
+
+/*
+ * Operation tag kept in the low bits of user_data, the rest is the
+ * UringConn pointer (NULL for the loop's own operations), or the
+ * SharedChunk being read for OP_READ.
+ */
+enum {
+    OP_ACCEPT = 1,
+    OP_NOTIFY,
+    OP_TIMEOUT,
+    OP_CANCEL,
+    OP_RECV,
+    OP_READ,
+    OP_SEND,
+};
+#define OP_MASK 7ULL
+
+#define URING_TIMEOUT_MS 1000        // wake up at least once a second to check keep_running, sooner for timers
+
+/* Wake-up timeout of the queued OP_TIMEOUT, the kernel copies it when the request is submitted */
+static struct __kernel_timespec timeout_ts;
+
+/*
+ * ConnState:
+ * Same life cycle as the epoll loop connections (see event_loop.c):
+ * RECV -> APPEND -> SEND, back to RECV with keep-alive. Queries skip APPEND.
+ */
+typedef enum ConnState {
+    CONN_RECV,    // a recv is queued, waiting for a complete packet
+    CONN_APPEND,  // packet queued to the append writer, waiting for it to be written
+    CONN_SEND,    // sends are queued for the snapshot, one chunk at a time
+} ConnState;
+
+/* What the connection timer is armed for, see event_loop.c */
+typedef enum Deadline {
+    DEADLINE_NONE,
+    DEADLINE_IDLE,  // no byte of the next packet yet, server_config.idle_timeout_ms
+    DEADLINE_READ,  // packet started, server_config.read_timeout_ms from its first byte
+} Deadline;
+
+/*
+ * UringConn:
+ * Per-client state. The kernel may still use the buffers of a closed
+ * connection, so it is only freed once no operation is in flight.
+ */
+typedef struct UringConn {
+    int fd;                        // client socket
+    char ip_str[INET_ADDRSTRLEN];
+    in_addr_t addr;                // client address, released from admission control when freed
+    ConnState state;
+    int inflight;                  // operations queued for this connection
+    int closing;                   // closed, waiting for 'inflight' to drop to 0
+
+    RecvBuffer rbuf;               // received bytes of the current packet
+
+    uint64_t append_seq;           // append writer sequence number while in CONN_APPEND
+    struct UringConn *wait_prev;   // links in loop->wait_head while in CONN_APPEND
+    struct UringConn *wait_next;
+
+    off_t send_off;                // next file offset to send while in CONN_SEND
+    off_t send_end;                // end of the data store snapshot being sent
+    uint64_t send_start_ns;        // metrics_now_ns() when the reply started, for the send latency
+    char *send_buf;                // URING_SEND_CHUNK bytes copied from the record cache
+    DataExtent send_ext;           // segment of the queued chunk, held until its send completed
+    SharedChunk *send_chunk;       // flat file chunk sent (or waited for), shared with the other replies
+    struct UringConn *chunk_prev;  // links in send_chunk->waiters while it is loading
+    struct UringConn *chunk_next;
+    int chunk_waiting;             // in send_chunk->waiters
+    int chunk_sent;                // result of the queued send
+    int compress;                  // replies are compressed, negotiated with "?compress lz4"
+    int keep_open;                 // the reply answers "?compress lz4", the connection goes on after it
+    int served;                    // a packet was answered, closed between packets while a takeover drains
+    int finishing;                 // closed after the reply being sent (see hot_restart_finishing())
+    WireReply wire;                // send state of a compressed reply
+
+    Timer timer;                   // idle or read deadline in loop->timers
+    Deadline deadline;
+    Timer throttle;                // armed while receives are paused by the byte rate of the address
+    Timer stall;                   // armed while a reply is sent, pushed back by every chunk the client took
+
+    struct UringConn *prev;
+    struct UringConn *next;
+} UringConn;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t pack_data(void *ptr, int op) {
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+/* Operations are only (re)armed while the loop is running */
+static int loop_active(UringLoop *loop) {
+    return keep_running && !loop->stopping;
+}
+
+/* Not while a takeover drains (see update_accepting()) */
+static int accept_wanted(UringLoop *loop) {
+    return loop_active(loop) && loop->accepting && hot_restart_state() == HOT_RESTART_RUNNING;
+}
+
+/*
+ * ring_submit:
+ * Publishes the prepared submission entries and enters the kernel,
+ * waiting for 'wait' completions. Returns 0 on success (interrupted
+ * waits included), or -1 if the ring is unusable.
+ */
+static int ring_submit(UringLoop *loop, unsigned wait) {
+    unsigned head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    unsigned pending = loop->sq_local_tail - head;
+
+    __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+    if (pending == 0 && wait == 0) {
+        return 0;
+    }
+
+    if (sys_io_uring_enter(loop->ring_fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0) < 0) {
+        /* EBUSY/EAGAIN: completion queue backed up, reaping makes room */
+        if (errno == EINTR || errno == EBUSY || errno == EAGAIN) return 0;
+        log_msg(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * reserve_sqes:
+ * Makes sure 'count' submission entries are free, submitting the queue
+ * first if needed. Linked operations are reserved together, so their
+ * chain isn't split across two submissions.
+ * Returns 0 on success, or -1 if the queue has no room.
+ */
+static int reserve_sqes(UringLoop *loop, unsigned count) {
+    unsigned head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if (loop->sq_entries - (loop->sq_local_tail - head) >= count) {
+        return 0;
+    }
+
+    if (ring_submit(loop, 0) < 0) return -1;
+    head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if (loop->sq_entries - (loop->sq_local_tail - head) < count) {
+        log_msg(LOG_ERR, "io_uring submission queue full");
+        return -1;
+    }
+    return 0;
+}
+
+/* Takes the next cleared submission entry, after reserve_sqes() */
+static struct io_uring_sqe *next_sqe(UringLoop *loop) {
+    struct io_uring_sqe *sqe = &loop->sqes[loop->sq_local_tail & *loop->sq_mask];
+    loop->sq_local_tail++;
+    loop->inflight++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static int arm_accept(UringLoop *loop) {
+    if (reserve_sqes(loop, 1) < 0) return -1;
+
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (loop->multishot_accept) {
+        /* One request keeps accepting, a completion is posted per connection */
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = pack_data(NULL, OP_ACCEPT);
+    loop->accept_armed = 1;
+    return 0;
+}
+
+static int arm_notify(UringLoop *loop) {
+    if (reserve_sqes(loop, 1) < 0) return -1;
+
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->notify_fd;
+    sqe->addr = (uintptr_t)&loop->notify_value;
+    sqe->len = sizeof(loop->notify_value);
+    sqe->user_data = pack_data(NULL, OP_NOTIFY);
+    loop->notify_armed = 1;
+    return 0;
+}
+
+/*
+ * arm_timeout:
+ * Queues the wake-up timeout, due with the next timer. It also completes
+ * after any other completion ('off' = 1), so it is re-armed with every
+ * batch of completions and follows the timers added meanwhile.
+ */
+static int arm_timeout(UringLoop *loop) {
+    if (reserve_sqes(loop, 1) < 0) return -1;
+
+    int ms = timer_wheel_timeout(&loop->timers, URING_TIMEOUT_MS);
+    timeout_ts.tv_sec = ms / 1000;
+    timeout_ts.tv_nsec = (ms % 1000) * 1000000LL;
+
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&timeout_ts;
+    sqe->len = 1;
+    sqe->off = 1;
+    sqe->user_data = pack_data(NULL, OP_TIMEOUT);
+    return 0;
+}
+
+/* Hands a provided receive buffer back to the kernel */
+static void recycle_buffer(UringLoop *loop, unsigned bid) {
+    struct io_uring_buf_ring *br = loop->buf_ring;
+    unsigned short tail = br->tail;
+    struct io_uring_buf *buf = &br->bufs[tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uintptr_t)(loop->buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/*
+ * setup_buffer_ring:
+ * Registers URING_BUF_COUNT receive buffers with the kernel, which picks
+ * one when data arrives, so idle connections don't hold a buffer.
+ * Without buffer ring support, receives go straight to the connection buffer.
+ */
+static void setup_buffer_ring(UringLoop *loop) {
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    void *ring = NULL;
+    if (posix_memalign(&ring, sysconf(_SC_PAGESIZE), ring_size) != 0) {
+        log_msg(LOG_ERR, "posix_memalign (buffer ring): %s", strerror(errno));
+        return;
+    }
+    memset(ring, 0, ring_size);
+
+    char *base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!base) {
+        log_msg(LOG_ERR, "buffer ring malloc: %s", strerror(errno));
+        free(ring);
+        return;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_msg(LOG_INFO, "io_uring buffer rings not supported (%s), receiving into connection buffers", strerror(errno));
+        free(base);
+        free(ring);
+        return;
+    }
+
+    loop->buf_ring = ring;
+    loop->buf_base = base;
+    for (unsigned bid = 0; bid < URING_BUF_COUNT; bid++) {
+        recycle_buffer(loop, bid);
+    }
+}
+
+/*
+ * setup_ring:
+ * Creates the io_uring instance and maps its queues.
+ * Returns 0 on success, or -1 if io_uring is unavailable.
+ */
+static int setup_ring(UringLoop *loop) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    /* Only this thread submits, completions are processed when it waits for them */
+    params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+
+    loop->ring_fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params);
+    if (loop->ring_fd < 0 && errno == EINVAL) {
+        /* Older kernel, retry without the optional flags */
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_CQ_ENTRIES;
+        loop->ring_fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params);
+    }
+    if (loop->ring_fd < 0) {
+        log_msg(LOG_ERR, "io_uring_setup: %s", strerror(errno));
+        return -1;
+    }
+
+    loop->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    loop->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        if (loop->cq_ring_size > loop->sq_ring_size) loop->sq_ring_size = loop->cq_ring_size;
+        loop->cq_ring_size = loop->sq_ring_size;
+    }
+
+    void *sq_ring = mmap(NULL, loop->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         loop->ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        log_msg(LOG_ERR, "mmap (io_uring sq): %s", strerror(errno));
+        return -1;
+    }
+    loop->sq_ring = sq_ring;
+
+    if (single_mmap) {
+        loop->cq_ring = sq_ring;
+    } else {
+        void *cq_ring = mmap(NULL, loop->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             loop->ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            log_msg(LOG_ERR, "mmap (io_uring cq): %s", strerror(errno));
+            return -1;
+        }
+        loop->cq_ring = cq_ring;
+    }
+
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        log_msg(LOG_ERR, "mmap (io_uring sqes): %s", strerror(errno));
+        return -1;
+    }
+    loop->sqes = sqes;
+
+    char *sq = loop->sq_ring;
+    loop->sq_head = (unsigned *)(sq + params.sq_off.head);
+    loop->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    loop->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    loop->sq_array = (unsigned *)(sq + params.sq_off.array);
+    loop->sq_entries = params.sq_entries;
+    loop->sq_local_tail = *loop->sq_tail;
+
+    char *cq = loop->cq_ring;
+    loop->cq_head = (unsigned *)(cq + params.cq_off.head);
+    loop->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    loop->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    /* Submission entries are always used in ring order */
+    for (unsigned i = 0; i < loop->sq_entries; i++) {
+        loop->sq_array[i] = i;
+    }
+
+    return 0;
+}
+
+static void wait_list_remove(UringLoop *loop, UringConn *conn) {
+    if (conn->wait_prev) conn->wait_prev->wait_next = conn->wait_next;
+    else loop->wait_head = conn->wait_next;
+    if (conn->wait_next) conn->wait_next->wait_prev = conn->wait_prev;
+    else loop->wait_tail = conn->wait_prev;
+    conn->wait_prev = conn->wait_next = NULL;
+}
+
+/* Takes a connection out of the waiters of the shared chunk it waits for */
+static void chunk_wait_remove(UringConn *conn) {
+    if (conn->chunk_prev) conn->chunk_prev->chunk_next = conn->chunk_next;
+    else conn->send_chunk->waiters = conn->chunk_next;
+    if (conn->chunk_next) conn->chunk_next->chunk_prev = conn->chunk_prev;
+    conn->chunk_prev = conn->chunk_next = NULL;
+    conn->chunk_waiting = 0;
+}
+
+static void conn_free(UringLoop *loop, UringConn *conn) {
+    close(conn->fd);
+    if (conn->finishing) hot_restart_finishing(-1);
+    admission_release(conn->addr);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    loop->conn_count--;
+
+    log_msg(LOG_INFO, "Closed connection from %s", conn->ip_str);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+
+    recv_buffer_release(&conn->rbuf);
+    data_store_release_extent(&conn->send_ext);
+    if (conn->send_chunk) chunk_share_release(conn->send_chunk);
+    if (conn->compress) wire_reply_release(&conn->wire);
+    free(conn->send_buf);
+    free(conn);
+}
+
+/*
+ * conn_close:
+ * Closes a connection. Queued operations are aborted by shutting the
+ * socket down, and the connection is freed once they completed.
+ */
+static void conn_close(UringLoop *loop, UringConn *conn) {
+    if (conn->closing) return;
+    if (conn->state == CONN_APPEND) wait_list_remove(loop, conn);
+    if (conn->chunk_waiting) chunk_wait_remove(conn);
+    timer_cancel(&loop->timers, &conn->timer);
+    timer_cancel(&loop->timers, &conn->throttle);
+    timer_cancel(&loop->timers, &conn->stall);
+    conn->closing = 1;
+
+    if (conn->inflight > 0) {
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    conn_free(loop, conn);
+}
+
+/* Deadline expired: the queued recv is aborted by conn_close() */
+static void on_conn_timer(Timer *timer, void *arg) {
+    UringLoop *loop = arg;
+    UringConn *conn = (UringConn *)((char *)timer - offsetof(UringConn, timer));
+
+    log_msg(LOG_INFO, "%s timeout, closing connection from %s",
+            conn->deadline == DEADLINE_IDLE ? "Idle" : "Read", conn->ip_str);
+    metrics_add(METRIC_CONNECTIONS_TIMED_OUT, 1);
+    conn_close(loop, conn);
+}
+
+/* The client read nothing of its reply for server_config.send_timeout_ms, the queued send is aborted */
+static void on_stall_timer(Timer *timer, void *arg) {
+    UringLoop *loop = arg;
+    UringConn *conn = (UringConn *)((char *)timer - offsetof(UringConn, stall));
+
+    log_msg(LOG_INFO, "Send timeout, closing connection from %s", conn->ip_str);
+    metrics_add(METRIC_SLOW_CLOSED_TIMEOUT, 1);
+    conn_close(loop, conn);
+}
+
+/*
+ * conn_wait_recv:
+ * Called before each receive is queued: pushes the idle deadline back
+ * between packets, keeps the read deadline set at the first byte of a
+ * partially received packet (see event_loop.c).
+ */
+static void conn_wait_recv(UringLoop *loop, UringConn *conn) {
+    if (conn->rbuf.len == 0) {
+        conn->deadline = DEADLINE_IDLE;
+        if (server_config.idle_timeout_ms > 0) {
+            timer_add(&loop->timers, &conn->timer, server_config.idle_timeout_ms, on_conn_timer, loop);
+        } else {
+            timer_cancel(&loop->timers, &conn->timer);
+        }
+    } else if (conn->deadline != DEADLINE_READ) {
+        conn->deadline = DEADLINE_READ;
+        if (server_config.read_timeout_ms > 0) {
+            timer_add(&loop->timers, &conn->timer, server_config.read_timeout_ms, on_conn_timer, loop);
+        } else {
+            timer_cancel(&loop->timers, &conn->timer);
+        }
+    }
+}
+
+/*
+ * arm_recv:
+ * Queues a receive. With a buffer ring the kernel picks the buffer when
+ * data arrives, otherwise ('direct', or no buffer ring) the data lands
+ * in the connection's packet buffer.
+ * Returns 0 on success, or -1 on error.
+ */
+static int arm_recv(UringLoop *loop, UringConn *conn, int direct) {
+    if (!loop->buf_ring) direct = 1;
+    if (direct && recv_buffer_reserve(&conn->rbuf) < 0) {
+        log_msg(LOG_ERR, "packet too large or out of memory, socket: %u", conn->fd);
+        return -1;
+    }
+    if (reserve_sqes(loop, 1) < 0) return -1;
+
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    if (direct) {
+        sqe->addr = (uintptr_t)(conn->rbuf.data + conn->rbuf.len);
+        sqe->len = conn->rbuf.cap - conn->rbuf.len;
+    } else {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->len = URING_BUF_SIZE;
+    }
+    sqe->user_data = pack_data(conn, OP_RECV);
+    conn->inflight++;
+    return 0;
+}
+
+/* Queues a send of 'len' bytes at 'data' for the current chunk of the snapshot */
+static int queue_send(UringLoop *loop, UringConn *conn, const char *data, size_t len) {
+    if (reserve_sqes(loop, 1) < 0) return -1;
+
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = pack_data(conn, OP_SEND);
+    conn->inflight++;
+    return 0;
+}
+
+/*
+ * arm_chunk_read:
+ * Reads a new shared chunk from the flat file, as far as the store goes.
+ * The read holds a reference of its own, so the chunk outlives the
+ * replies waiting for it.
+ */
+static int arm_chunk_read(UringLoop *loop, SharedChunk *chunk) {
+    size_t want = SHARED_CHUNK_SIZE;
+    off_t length = data_store_length();
+    if ((off_t)want > length - chunk->start) want = length - chunk->start;
+
+    /* The flat file is never deleted, no need to hold the extent during the read */
+    DataExtent ext;
+    if (data_store_extent(chunk->start, want, &ext) < 0) return -1;
+    data_store_release_extent(&ext);
+    if (reserve_sqes(loop, 1) < 0) return -1;
+
+    chunk_share_retain(chunk);
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ext.fd;
+    sqe->addr = (uintptr_t)chunk->data;
+    sqe->len = ext.len;
+    sqe->off = ext.file_offset;
+    sqe->user_data = pack_data(chunk, OP_READ);
+    return 0;
+}
+
+static int arm_send(UringLoop *loop, UringConn *conn);
+
+/*
+ * send_chunk:
+ * Sends from the loaded shared chunk of the connection. A chunk loaded
+ * before the snapshot grew may stop short of the next byte: a newer one
+ * is taken then.
+ */
+static int send_chunk(UringLoop *loop, UringConn *conn) {
+    SharedChunk *chunk = conn->send_chunk;
+    if (chunk->state != CHUNK_READY) return -1;
+
+    size_t avail = chunk_share_avail(chunk, conn->send_off);
+    if (avail == 0) {
+        chunk_share_release(chunk);
+        conn->send_chunk = NULL;
+        return arm_send(loop, conn);
+    }
+    if ((off_t)avail > conn->send_end - conn->send_off) avail = conn->send_end - conn->send_off;
+    return queue_send(loop, conn, chunk->data + (conn->send_off - chunk->start), avail);
+}
+
+/*
+ * arm_send:
+ * Queues the next chunk of the snapshot: copied from the record cache
+ * and sent when resident, sent straight from a mapped segment, or
+ * otherwise sent from a chunk of the flat file shared with the other
+ * replies (see chunk_share.h), read first unless another reply did.
+ * Returns 0 on success, or -1 on error.
+ */
+static int arm_send(UringLoop *loop, UringConn *conn) {
+    size_t chunk = URING_SEND_CHUNK;
+    if ((off_t)chunk > conn->send_end - conn->send_off) chunk = conn->send_end - conn->send_off;
+
+    conn->chunk_sent = 0;
+
+    if (record_cache_start() <= conn->send_off) {
+        if (!conn->send_buf) {
+            conn->send_buf = malloc(URING_SEND_CHUNK);
+            if (!conn->send_buf) {
+                log_msg(LOG_ERR, "send buffer malloc: %s", strerror(errno));
+                return -1;
+            }
+        }
+        size_t cached = record_cache_read(conn->send_buf, chunk, conn->send_off);
+        if (cached > 0) {
+            return queue_send(loop, conn, conn->send_buf, cached);
+        }
+    }
+
+    if (data_store_extent(conn->send_off, chunk, &conn->send_ext) < 0) {
+        log_msg(LOG_ERR, "data at offset %lld deleted by retention before it was sent", (long long)conn->send_off);
+        return -1;
+    }
+    if (conn->send_ext.data) {
+        return queue_send(loop, conn, conn->send_ext.data, conn->send_ext.len);
+    }
+    data_store_release_extent(&conn->send_ext);
+
+    int load;
+    conn->send_chunk = chunk_share_acquire(conn->send_off, &load);
+    if (!conn->send_chunk) return -1;
+    if (load && arm_chunk_read(loop, conn->send_chunk) < 0) {
+        chunk_share_loaded(conn->send_chunk, -1);
+        return -1;
+    }
+
+    if (conn->send_chunk->state == CHUNK_LOADING) {
+        /* Sent by on_chunk_read() */
+        SharedChunk *shared = conn->send_chunk;
+        conn->chunk_prev = NULL;
+        conn->chunk_next = shared->waiters;
+        if (conn->chunk_next) conn->chunk_next->chunk_prev = conn;
+        shared->waiters = conn;
+        conn->chunk_waiting = 1;
+        return 0;
+    }
+    return send_chunk(loop, conn);
+}
+
+/*
+ * arm_wire_send:
+ * Queues the send of the next bytes of a compressed reply, the rest of
+ * the block being sent or the next one (see wire_compress.h).
+ * Returns 0 on success, or -1 on error.
+ */
+static int arm_wire_send(UringLoop *loop, UringConn *conn) {
+    const char *data;
+    size_t len;
+    conn->chunk_sent = 0;
+    if (wire_reply_next(&conn->wire, &data, &len) <= 0) return -1;
+    return queue_send(loop, conn, data, len);
+}
+
+/* The reply being sent is the last one: a takeover doesn't wait for the connection anymore */
+static void conn_finish(UringConn *conn) {
+    if (!conn->finishing) {
+        conn->finishing = 1;
+        hot_restart_finishing(1);
+    }
+}
+
+static void conn_start_send(UringConn *conn, const Query *query) {
+    conn->keep_open = query && query->type == QUERY_COMPRESS;
+    if (conn->keep_open) {
+        conn->compress = 1;
+    } else {
+        conn->served = 1;
+        if (!server_config.keep_alive || hot_restart_state() != HOT_RESTART_RUNNING) conn_finish(conn);
+    }
+
+    DataSnapshot snap;
+    data_store_snapshot(&snap);
+    if (query) query_resolve(query, &snap);
+    conn->send_off = snap.start;
+    conn->send_end = snap.end;
+    if (conn->compress) wire_reply_init(&conn->wire, conn->send_off, conn->send_end);
+    conn->send_start_ns = metrics_now_ns();
+    conn->state = CONN_SEND;
+}
+
+/*
+ * conn_advance:
+ * Moves a connection with nothing in flight forward: queues the next
+ * send chunk or receive, answers queries and hands data packets to the
+ * append writer. Packets already buffered (pipelined) are handled
+ * without another receive.
+ */
+static void conn_advance(UringLoop *loop, UringConn *conn) {
+    while (1) {
+        if (conn->state == CONN_SEND) {
+            int pending = conn->compress ? !wire_reply_done(&conn->wire) : conn->send_off < conn->send_end;
+            if (pending) {
+                if (server_config.send_timeout_ms > 0 && !timer_armed(&conn->stall)) {
+                    timer_add(&loop->timers, &conn->stall, server_config.send_timeout_ms, on_stall_timer, loop);
+                }
+                int rc = conn->compress ? arm_wire_send(loop, conn) : arm_send(loop, conn);
+                if (rc < 0) conn_close(loop, conn);
+                return;
+            }
+
+            /* Whole snapshot sent */
+            timer_cancel(&loop->timers, &conn->stall);
+            metrics_observe(METRIC_SEND_LATENCY, metrics_now_ns() - conn->send_start_ns);
+            free(conn->send_buf);
+            conn->send_buf = NULL;
+            if (conn->compress) wire_reply_release(&conn->wire);
+            if (conn->finishing) {
+                conn_close(loop, conn);
+                return;
+            }
+            conn->state = CONN_RECV;
+        }
+
+        char *nl = recv_buffer_find_newline(&conn->rbuf);
+        if (!nl) {
+            /* Idle connections don't keep a buffer when the kernel provides one */
+            if (conn->rbuf.len == 0 && loop->buf_ring) recv_buffer_release(&conn->rbuf);
+            conn_wait_recv(loop, conn);
+            if (arm_recv(loop, conn, 0) < 0) conn_close(loop, conn);
+            return;
+        }
+
+        /* The next packet gets deadlines of its own */
+        timer_cancel(&loop->timers, &conn->timer);
+        conn->deadline = DEADLINE_NONE;
+
+        size_t len = nl - conn->rbuf.data + 1;
+        Query query;
+        if (query_parse(conn->rbuf.data, len, &query)) {
+            recv_buffer_consume(&conn->rbuf, len);
+            conn_start_send(conn, &query);
+            continue;
+        }
+
+        char *record = recv_buffer_take(&conn->rbuf, len);
+        conn->append_seq = record ? append_writer_submit(record, len) : 0;
+        if (conn->append_seq == 0) {
+            conn_close(loop, conn);
+            return;
+        }
+
+        conn->state = CONN_APPEND;
+        conn->wait_prev = loop->wait_tail;
+        conn->wait_next = NULL;
+        if (loop->wait_tail) loop->wait_tail->wait_next = conn;
+        else loop->wait_head = conn;
+        loop->wait_tail = conn;
+        return;
+    }
+}
+
+/* Copies a provided buffer into the packet buffer, growing it as needed */
+static int rbuf_append(RecvBuffer *rbuf, const char *data, size_t len) {
+    while (len > 0) {
+        if (recv_buffer_reserve(rbuf) < 0) return -1;
+
+        size_t n = rbuf->cap - rbuf->len;
+        if (n > len) n = len;
+        memcpy(rbuf->data + rbuf->len, data, n);
+        rbuf->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* The address is back under its byte rate, nothing is in flight */
+static void on_throttle_timer(Timer *timer, void *arg) {
+    UringLoop *loop = arg;
+    UringConn *conn = (UringConn *)((char *)timer - offsetof(UringConn, throttle));
+    conn_advance(loop, conn);
+}
+
+static void on_recv(UringLoop *loop, UringConn *conn, int res, unsigned flags) {
+    int copy_failed = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0) {
+            copy_failed = rbuf_append(&conn->rbuf, loop->buf_base + (size_t)bid * URING_BUF_SIZE, res);
+        }
+        recycle_buffer(loop, bid);
+    } else if (res > 0) {
+        conn->rbuf.len += res;
+    }
+
+    if (res == -ENOBUFS) {
+        /* Every provided buffer is in use, receive into the connection buffer this time */
+        if (arm_recv(loop, conn, 1) < 0) conn_close(loop, conn);
+        return;
+    }
+    if (res == 0) {
+        log_msg(LOG_INFO, "Connection closed by peer, socket: %u", conn->fd);
+        conn_close(loop, conn);
+        return;
+    }
+    if (res < 0) {
+        log_msg(LOG_ERR, "recv: %s", strerror(-res));
+        conn_close(loop, conn);
+        return;
+    }
+    if (copy_failed) {
+        log_msg(LOG_ERR, "packet too large or out of memory, socket: %u", conn->fd);
+        conn_close(loop, conn);
+        return;
+    }
+    metrics_add(METRIC_BYTES_RECEIVED, res);
+
+    /* Over the byte rate of its address: queue the next receive once the debt is paid back */
+    uint64_t throttle_ms = admission_consume(conn->addr, res);
+    if (throttle_ms > 0) {
+        conn_wait_recv(loop, conn);
+        timer_add(&loop->timers, &conn->throttle, throttle_ms, on_throttle_timer, loop);
+        return;
+    }
+
+    conn_advance(loop, conn);
+}
+
+/* Called once the send of a chunk completed */
+static void on_send(UringLoop *loop, UringConn *conn) {
+    data_store_release_extent(&conn->send_ext);
+    if (conn->send_chunk) {
+        chunk_share_release(conn->send_chunk);
+        conn->send_chunk = NULL;
+    }
+
+    if (conn->chunk_sent < 0) {
+        if (conn->chunk_sent != -EPIPE && conn->chunk_sent != -ECONNRESET) {
+            log_msg(LOG_ERR, "send: %s", strerror(-conn->chunk_sent));
+        }
+        conn_close(loop, conn);
+        return;
+    }
+
+    /* A short send is resumed by reading the unsent part again */
+    if (conn->compress) {
+        wire_reply_advance(&conn->wire, conn->chunk_sent);
+    } else {
+        conn->send_off += conn->chunk_sent;
+    }
+    metrics_add(METRIC_BYTES_SENT, conn->chunk_sent);
+    if (conn->chunk_sent > 0) timer_cancel(&loop->timers, &conn->stall);
+    conn_advance(loop, conn);
+}
+
+static void on_conn_completion(UringLoop *loop, UringConn *conn, int op, int res, unsigned flags) {
+    conn->inflight--;
+
+    if (conn->closing) {
+        if (op == OP_RECV && (flags & IORING_CQE_F_BUFFER)) {
+            recycle_buffer(loop, flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (conn->inflight == 0) conn_free(loop, conn);
+        return;
+    }
+
+    switch (op) {
+        case OP_RECV:
+            on_recv(loop, conn, res, flags);
+            break;
+        case OP_SEND:
+            conn->chunk_sent = res;
+            on_send(loop, conn);
+            break;
+    }
+}
+
+/*
+ * accept_admit:
+ * Reads the peer address of an accepted socket and passes it through
+ * admission control. Returns 0 if admitted, or -1 if it must be closed.
+ */
+static int accept_admit(int fd, struct sockaddr_in *client_addr) {
+    socklen_t client_addr_len = sizeof(*client_addr);
+    if (getpeername(fd, (struct sockaddr *)client_addr, &client_addr_len) < 0) {
+        memset(client_addr, 0, sizeof(*client_addr)); // unknown peer: only the global limit applies
+    }
+    return admission_acquire(client_addr->sin_addr.s_addr);
+}
+
+static void on_accept(UringLoop *loop, int res, unsigned flags) {
+    struct sockaddr_in client_addr;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        loop->accept_armed = 0;
+        loop->accept_cancelled = 0;
+    }
+
+    if (res < 0) {
+        if (res == -EINVAL && loop->multishot_accept) {
+            log_msg(LOG_INFO, "io_uring multishot accept not supported, accepting one connection per request");
+            loop->multishot_accept = 0;
+        } else if (res != -ECANCELED) {
+            log_msg(LOG_ERR, "accept: %s", strerror(-res));
+        }
+    } else if (!loop_active(loop)) {
+        close(res);
+    } else if (accept_admit(res, &client_addr) != 0) {
+        close(res);
+    } else {
+        UringConn *conn = calloc(1, sizeof(UringConn));
+        if (!conn) {
+            log_msg(LOG_ERR, "Connection calloc: %s", strerror(errno));
+            close(res);
+            admission_release(client_addr.sin_addr.s_addr);
+        } else {
+            conn->fd = res;
+            conn->addr = client_addr.sin_addr.s_addr;
+            conn->state = CONN_RECV;
+            inet_ntop(AF_INET, &client_addr.sin_addr, conn->ip_str, sizeof(conn->ip_str));
+
+            conn->next = loop->conns;
+            if (loop->conns) loop->conns->prev = conn;
+            loop->conns = conn;
+            loop->conn_count++;
+            metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+            log_msg(LOG_INFO, "Accepted connection from %s", conn->ip_str);
+            conn_advance(loop, conn);
+        }
+    }
+
+    if (!loop->accept_armed && accept_wanted(loop)) {
+        arm_accept(loop);
+    }
+}
+
+/*
+ * resume_appended:
+ * Called when the append writer signals a commit. Records are committed in
+ * sequence order, so only the front of the FIFO has to be checked.
+ */
+static void resume_appended(UringLoop *loop) {
+    while (loop->wait_head) {
+        UringConn *conn = loop->wait_head;
+        int status = append_writer_poll(conn->append_seq);
+        if (status == 1) {
+            break;
+        }
+
+        wait_list_remove(loop, conn);
+        conn->state = CONN_SEND;
+        if (status < 0) {
+            conn_close(loop, conn);
+        } else {
+            conn_start_send(conn, NULL);
+            conn_advance(loop, conn);
+        }
+    }
+}
+
+/*
+ * on_chunk_read:
+ * A shared chunk was read: sends it to every reply waiting for it, or
+ * closes them if the read failed.
+ */
+static void on_chunk_read(UringLoop *loop, SharedChunk *chunk, int res) {
+    if (res <= 0) {
+        log_msg(LOG_ERR, "read (io_uring send): %s", res < 0 ? strerror(-res) : "unexpected end of file");
+    }
+    chunk_share_loaded(chunk, res > 0 ? res : -1);
+
+    while (chunk->waiters) {
+        UringConn *conn = chunk->waiters;
+        chunk_wait_remove(conn);
+        if (send_chunk(loop, conn) < 0) conn_close(loop, conn);
+    }
+    chunk_share_release(chunk);
+}
+
+static void handle_completion(UringLoop *loop, uint64_t user_data, int res, unsigned flags) {
+    int op = user_data & OP_MASK;
+    UringConn *conn = (UringConn *)(uintptr_t)(user_data & ~OP_MASK);
+
+    /* Multishot requests stay queued while IORING_CQE_F_MORE is set */
+    if (!(flags & IORING_CQE_F_MORE)) {
+        loop->inflight--;
+    }
+
+    switch (op) {
+        case OP_ACCEPT:
+            on_accept(loop, res, flags);
+            break;
+        case OP_NOTIFY:
+            loop->notify_armed = 0;
+            resume_appended(loop);
+            if (loop_active(loop)) arm_notify(loop);
+            break;
+        case OP_TIMEOUT:
+            if (loop_active(loop)) {
+                arm_timeout(loop);
+                /* Retry operations that could not be queued earlier */
+                if (!loop->accept_armed && accept_wanted(loop)) arm_accept(loop);
+                if (!loop->notify_armed) arm_notify(loop);
+            }
+            break;
+        case OP_CANCEL:
+            break;
+        case OP_READ:
+            on_chunk_read(loop, (SharedChunk *)(uintptr_t)(user_data & ~OP_MASK), res);
+            break;
+        default:
+            on_conn_completion(loop, conn, op, res, flags);
+            break;
+    }
+}
+
+static void reap_completions(UringLoop *loop) {
+    unsigned head = *loop->cq_head;
+
+    while (1) {
+        unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+
+        struct io_uring_cqe *cqe = &loop->cqes[head & *loop->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+
+        /* The entry is copied, hand its slot back before handling it */
+        head++;
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+
+        handle_completion(loop, user_data, res, flags);
+    }
+}
+
+/*
+ * uring_loop_init:
+ * Sets up the rings and queues the accept, the append writer
+ * notification read and the wake-up timeout.
+ * Returns 0 on success, or -1 if io_uring can not be used (the caller
+ * falls back to another mode).
+ */
+int uring_loop_init(UringLoop *loop, int listen_fd) {
+    memset(loop, 0, sizeof(*loop));
+    loop->ring_fd = -1;
+    loop->listen_fd = listen_fd;
+    loop->notify_fd = -1;
+    loop->multishot_accept = 1;
+    timer_wheel_init(&loop->timers);
+
+    if (setup_ring(loop) < 0) {
+        uring_loop_destroy(loop);
+        return -1;
+    }
+    setup_buffer_ring(loop);
+
+    /* Blocking eventfd: the read is queued to the ring and completes when the writer signals */
+    loop->notify_fd = eventfd(0, EFD_CLOEXEC);
+    if (loop->notify_fd < 0) {
+        log_msg(LOG_ERR, "eventfd: %s", strerror(errno));
+        uring_loop_destroy(loop);
+        return -1;
+    }
+    if (append_writer_add_listener(loop->notify_fd) < 0) {
+        close(loop->notify_fd);
+        loop->notify_fd = -1;
+        uring_loop_destroy(loop);
+        return -1;
+    }
+
+    if (arm_accept(loop) < 0 || arm_notify(loop) < 0 || arm_timeout(loop) < 0 || ring_submit(loop, 0) < 0) {
+        uring_loop_destroy(loop);
+        return -1;
+    }
+    loop->accepting = 1;
+    hot_restart_accepting(1);
+
+    return 0;
+}
+
+/*
+ * update_accepting:
+ * Follows the hot restart state: while a takeover drains, the queued
+ * accept is cancelled (connections it completed meanwhile are served)
+ * and the connections already answered are closed between packets, the
+ * others get the reply to the packet they send. Accepts resume if the
+ * takeover is aborted.
+ */
+static void update_accepting(UringLoop *loop) {
+    if (hot_restart_state() == HOT_RESTART_RUNNING) {
+        if (!loop->accepting) {
+            loop->accepting = 1;
+            hot_restart_accepting(1);
+            if (!loop->accept_armed) arm_accept(loop);
+        }
+        return;
+    }
+    if (!loop->accepting) {
+        return;
+    }
+
+    if (loop->accept_armed) {
+        if (!loop->accept_cancelled && reserve_sqes(loop, 1) == 0) {
+            struct io_uring_sqe *sqe = next_sqe(loop);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = pack_data(NULL, OP_ACCEPT);
+            sqe->user_data = pack_data(NULL, OP_CANCEL);
+            loop->accept_cancelled = 1;
+        }
+        return; // stopped once the accept completed
+    }
+    loop->accepting = 0;
+    hot_restart_accepting(-1);
+
+    UringConn *conn = loop->conns;
+    while (conn) {
+        UringConn *next = conn->next;
+        if (!conn->closing && conn->state == CONN_RECV && conn->served && conn->rbuf.len == 0) {
+            conn_close(loop, conn); // the queued recv is aborted
+        } else if (!conn->closing && conn->state == CONN_SEND && !conn->keep_open) {
+            conn_finish(conn);
+        }
+        conn = next;
+    }
+}
+
+/*
+ * uring_loop_run:
+ * Submits queued operations, dispatches their completions and runs the
+ * expired timers until keep_running is cleared, or the listener was
+ * handed over and the last connection closed. Each iteration is one
+ * io_uring_enter() call, the queued timeout wakes it for the next timer.
+ */
+void uring_loop_run(UringLoop *loop) {
+    while (keep_running) {
+        update_accepting(loop);
+        if (!loop->accepting && hot_restart_state() == HOT_RESTART_HANDED_OFF && loop->conn_count == 0) {
+            break;
+        }
+        if (ring_submit(loop, 1) < 0) {
+            break;
+        }
+        reap_completions(loop);
+        timer_wheel_advance(&loop->timers);
+    }
+}
+
+/*
+ * uring_loop_destroy:
+ * Closes every remaining connection, cancels the loop's own operations
+ * and waits for them, so the kernel no longer touches any buffer freed
+ * here. The listening socket is owned by the caller.
+ */
+void uring_loop_destroy(UringLoop *loop) {
+    loop->stopping = 1;
+    if (loop->accepting) {
+        hot_restart_accepting(-1);
+        loop->accepting = 0;
+    }
+
+    if (loop->sqes) {
+        UringConn *conn = loop->conns;
+        while (conn) {
+            UringConn *next = conn->next;
+            conn_close(loop, conn);
+            conn = next;
+        }
+
+        if (loop->inflight > 0 && reserve_sqes(loop, 1) == 0) {
+            struct io_uring_sqe *sqe = next_sqe(loop);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            sqe->user_data = pack_data(NULL, OP_CANCEL);
+        }
+
+        for (int round = 0; loop->inflight > 0 && round < URING_DRAIN_ROUNDS; round++) {
+            if (ring_submit(loop, 1) < 0) break;
+            reap_completions(loop);
+        }
+        if (loop->inflight > 0) {
+            log_msg(LOG_ERR, "io_uring: %d operations still in flight at shutdown", loop->inflight);
+        }
+    }
+
+    /* Closing the ring cancels whatever is left before the buffers go away */
+    if (loop->ring_fd >= 0) {
+        close(loop->ring_fd);
+        loop->ring_fd = -1;
+    }
+    while (loop->conns) {
+        loop->conns->inflight = 0;
+        conn_free(loop, loop->conns);
+    }
+
+    if (loop->sqes) munmap(loop->sqes, loop->sqes_size);
+    if (loop->cq_ring && loop->cq_ring != loop->sq_ring) munmap(loop->cq_ring, loop->cq_ring_size);
+    if (loop->sq_ring) munmap(loop->sq_ring, loop->sq_ring_size);
+    loop->sqes = NULL;
+    loop->cq_ring = loop->sq_ring = NULL;
+
+    free(loop->buf_ring);
+    free(loop->buf_base);
+    loop->buf_ring = NULL;
+    loop->buf_base = NULL;
+
+    if (loop->notify_fd >= 0) {
+        append_writer_remove_listener(loop->notify_fd);
+        close(loop->notify_fd);
+        loop->notify_fd = -1;
+    }
+}
+
+#else /* no io_uring support in the kernel headers */
+
+int uring_loop_init(UringLoop *loop, int listen_fd) {
+    memset(loop, 0, sizeof(*loop));
+    loop->listen_fd = listen_fd;
+    loop->ring_fd = -1;
+    loop->notify_fd = -1;
+    log_msg(LOG_ERR, "io_uring support not built (kernel headers older than 5.19)");
+    return -1;
+}
+
+void uring_loop_run(UringLoop *loop) {
+    (void)loop;
+}
+
+void uring_loop_destroy(UringLoop *loop) {
+    (void)loop;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timer_wheel.h"
+
+struct UringConn;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+/*
+ * UringLoop:
+ * An io_uring instance that owns a listening socket and every connection
+ * accepted from it. Accepts, receives, file reads and sends are queued
+ * to the kernel and many of them are submitted and reaped with a single
+ * io_uring_enter() call, instead of one syscall per operation.
+ * The rings are set up with the raw syscalls, liburing is not needed.
+ */
+typedef struct UringLoop {
+    int ring_fd;               // io_uring instance
+    int listen_fd;             // listening socket (blocking, accepts are queued to the ring)
+    int notify_fd;             // eventfd written by the append writer after each commit
+    uint64_t notify_value;     // target of the read queued on notify_fd
+
+    /* Submission queue, mapped from ring_fd */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;    // entries prepared but not published to *sq_tail yet
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* Completion queue, mapped from ring_fd (may share the submission queue mapping) */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Receive buffers provided to the kernel, NULL if buffer rings are not supported */
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_base;
+
+    int multishot_accept;      // cleared if the kernel rejects multishot accept
+    int accept_armed;          // an accept is queued
+    int accepting;             // accepts are queued, not once a takeover drained them (see hot_restart.h)
+    int accept_cancelled;      // a cancel of the queued accept is queued (takeover)
+    int notify_armed;          // a read of notify_fd is queued
+    int stopping;              // set by uring_loop_destroy(), nothing new is queued
+    int inflight;              // operations submitted and not completed yet
+    TimerWheel timers;         // connection deadlines, and the server timers on the main thread's loop
+
+    struct UringConn *conns;   // doubly linked list of open connections
+    int conn_count;            // number of entries in 'conns'
+    struct UringConn *wait_head; // FIFO of connections waiting for their record to be written,
+    struct UringConn *wait_tail; // in submit (sequence number) order
+} UringLoop;
+
+int uring_loop_init(UringLoop *loop, int listen_fd);
+void uring_loop_run(UringLoop *loop);
+void uring_loop_destroy(UringLoop *loop);
+
+#endif /* URING_LOOP_H */
@@ -0,0 +1,323 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+#include "wire_compress.h"
+#include "lz_codec.h"
+#include "chunk_share.h"
+#include "data_store.h"
+#include "record_cache.h"
+#include "simple_stream_server.h"
+#include "metrics.h"
+#include "async_log.h"
+
+#define WIRE_BLOCK_SIZE SHARED_CHUNK_SIZE // the grid of compressed segments, so their blocks are reused
+#define WIRE_CACHE_BUCKETS 1024           // hash buckets of the block cache (power of 2)
+
+/*
+ * WireBlock:
+ * Store range [start, end) as sent on the wire, header included.
+ * Reference counted: the cache holds one while the block is cached, and
+ * each reply sending it one.
+ */
+typedef struct WireBlock {
+    off_t start;
+    off_t end;
+    int refs;                      // protected by cache_mutex
+    struct WireBlock *next;        // hash bucket chain
+    struct WireBlock *lru_prev;    // cache LRU list, most recently used first
+    struct WireBlock *lru_next;
+    size_t len;                    // bytes of 'data'
+    char data[];
+} WireBlock;
+
+static WireBlock *buckets[WIRE_CACHE_BUCKETS];
+static WireBlock *lru_head = NULL;
+static WireBlock *lru_tail = NULL;
+static size_t cached_bytes = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char end_mark[WIRE_END_SIZE] = { 0 };
+
+static WireBlock **bucket_of(off_t start, off_t end) {
+    uint64_t h = (uint64_t)start * 0x9E3779B97F4A7C15ULL ^ (uint64_t)end * 0xC2B2AE3D27D4EB4FULL;
+    return &buckets[(h >> 32) & (WIRE_CACHE_BUCKETS - 1)];
+}
+
+static void put32(char *p, uint32_t v) {
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)((v >> 8) & 0xff);
+    p[2] = (char)((v >> 16) & 0xff);
+    p[3] = (char)(v >> 24);
+}
+
+static void lru_remove(WireBlock *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push_front(WireBlock *b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    else lru_tail = b;
+    lru_head = b;
+}
+
+/* Takes a cached block out of the cache, returns 1 if its last reference was the cache's */
+static int cache_remove(WireBlock *b) {
+    WireBlock **link = bucket_of(b->start, b->end);
+    while (*link != b) link = &(*link)->next;
+    *link = b->next;
+    lru_remove(b);
+    cached_bytes -= b->len;
+    return --b->refs == 0;
+}
+
+static void block_put(WireBlock *b) {
+    pthread_mutex_lock(&cache_mutex);
+    int last = --b->refs == 0;
+    pthread_mutex_unlock(&cache_mutex);
+    if (last) free(b);
+}
+
+/* Returns the cached block for [start, end) with a reference taken, or NULL */
+static WireBlock *cache_lookup(off_t start, off_t end) {
+    pthread_mutex_lock(&cache_mutex);
+    WireBlock *b = *bucket_of(start, end);
+    while (b && (b->start != start || b->end != end)) b = b->next;
+    if (b) {
+        b->refs++;
+        lru_remove(b);
+        lru_push_front(b);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return b;
+}
+
+/*
+ * cache_insert:
+ * Caches a new block, evicting the least recently used ones beyond
+ * server_config.compress_cache bytes. If a concurrent reply cached the
+ * same block first, 'b' is freed and that one is returned instead.
+ */
+static WireBlock *cache_insert(WireBlock *b) {
+    WireBlock *evicted = NULL;
+
+    pthread_mutex_lock(&cache_mutex);
+    WireBlock **bucket = bucket_of(b->start, b->end);
+    for (WireBlock *other = *bucket; other; other = other->next) {
+        if (other->start == b->start && other->end == b->end) {
+            other->refs++;
+            pthread_mutex_unlock(&cache_mutex);
+            free(b);
+            return other;
+        }
+    }
+
+    b->refs = 1;
+    if (b->len <= server_config.compress_cache) {
+        b->refs++;
+        b->next = *bucket;
+        *bucket = b;
+        lru_push_front(b);
+        cached_bytes += b->len;
+
+        while (cached_bytes > server_config.compress_cache) {
+            WireBlock *victim = lru_tail;
+            if (cache_remove(victim)) {
+                victim->next = evicted;
+                evicted = victim;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    while (evicted) {
+        WireBlock *next = evicted->next;
+        free(evicted);
+        evicted = next;
+    }
+    return b;
+}
+
+/* Reads store bytes [start, end), from the record cache where resident */
+static int read_store(char *buf, off_t start, off_t end) {
+    while (start < end) {
+        size_t n = 0;
+        if (record_cache_start() <= start) {
+            n = record_cache_read(buf, end - start, start);
+        }
+        if (n == 0) {
+            ssize_t r = data_store_pread(buf, end - start, start);
+            if (r <= 0) {
+                log_msg(LOG_ERR, "pread (compressed reply): %s", r < 0 ? strerror(errno) : "unexpected end of file");
+                return -1;
+            }
+            n = r;
+        }
+        buf += n;
+        start += n;
+    }
+    return 0;
+}
+
+/*
+ * block_build:
+ * Makes the wire form of [start, end): copied from the compressed segment
+ * holding that exact block if any, otherwise compressed here.
+ * Returns the block, or NULL on error.
+ */
+static WireBlock *block_build(off_t start, off_t end) {
+    size_t raw = end - start;
+    WireBlock *b = malloc(sizeof(WireBlock) + WIRE_HEADER_SIZE + raw);
+    if (!b) {
+        log_msg(LOG_ERR, "WireBlock malloc: %s", strerror(errno));
+        return NULL;
+    }
+    b->start = start;
+    b->end = end;
+    char *payload = b->data + WIRE_HEADER_SIZE;
+
+    int stored = 0;
+    ssize_t len = data_store_compressed_block(start, end, payload, raw, &stored);
+    if (len >= 0) {
+        metrics_add(METRIC_WIRE_BLOCKS_SEGMENT, 1);
+    } else {
+        char *src = malloc(raw);
+        if (!src || read_store(src, start, end) < 0) {
+            if (!src) log_msg(LOG_ERR, "compressed reply malloc: %s", strerror(errno));
+            free(src);
+            free(b);
+            return NULL;
+        }
+        len = lz_compress(src, raw, payload, raw - 1);
+        if (len == 0) {
+            memcpy(payload, src, raw);
+            len = raw;
+            stored = 1;
+        }
+        free(src);
+        metrics_add(METRIC_WIRE_BLOCKS_COMPRESSED, 1);
+    }
+
+    put32(b->data, (uint32_t)len | (stored ? WIRE_STORED : 0));
+    put32(b->data + 4, (uint32_t)raw);
+    b->len = WIRE_HEADER_SIZE + len;
+
+    WireBlock *shrunk = realloc(b, sizeof(WireBlock) + b->len);
+    return shrunk ? shrunk : b;
+}
+
+/* Returns the block for [start, end) with a reference taken, or NULL on error */
+static WireBlock *block_get(off_t start, off_t end) {
+    WireBlock *b = cache_lookup(start, end);
+    if (b) {
+        metrics_add(METRIC_WIRE_BLOCKS_CACHED, 1);
+        return b;
+    }
+
+    b = block_build(start, end);
+    return b ? cache_insert(b) : NULL;
+}
+
+void wire_reply_init(WireReply *r, off_t off, off_t end) {
+    r->off = off;
+    r->end = end > off ? end : off;
+    r->block = NULL;
+    r->sent = 0;
+    r->bytes = 0;
+}
+
+/*
+ * wire_reply_next:
+ * Points '*data' at the next bytes of the reply, '*len' of them, making
+ * the next block when the previous one was sent. The bytes stay valid
+ * until they are passed to wire_reply_advance().
+ * Returns 1 with bytes to send, 0 once the reply is complete, or -1 on
+ * error.
+ */
+int wire_reply_next(WireReply *r, const char **data, size_t *len) {
+    if (r->block && r->sent == r->block->len) {
+        metrics_add(METRIC_WIRE_BYTES_RAW, r->block->end - r->block->start);
+        metrics_add(METRIC_WIRE_BYTES_COMPRESSED, r->block->len);
+        r->off = r->block->end;
+        block_put(r->block);
+        r->block = NULL;
+        r->sent = 0;
+    }
+
+    if (!r->block && r->off < r->end) {
+        off_t end = (r->off / WIRE_BLOCK_SIZE + 1) * WIRE_BLOCK_SIZE;
+        if (end > r->end) end = r->end;
+        r->block = block_get(r->off, end);
+        if (!r->block) return -1;
+    }
+
+    if (r->block) {
+        *data = r->block->data + r->sent;
+        *len = r->block->len - r->sent;
+        return 1;
+    }
+    if (r->sent < WIRE_END_SIZE) {
+        *data = end_mark + r->sent;
+        *len = WIRE_END_SIZE - r->sent;
+        return 1;
+    }
+    return 0;
+}
+
+/* Records that 'n' bytes returned by wire_reply_next() reached the socket */
+void wire_reply_advance(WireReply *r, size_t n) {
+    r->sent += n;
+    r->bytes += n;
+}
+
+/*
+ * wire_reply_send:
+ * Sends the reply until it is complete or the socket buffer is full.
+ * Returns 0 when the whole reply was sent, 1 if the socket would block,
+ * or -1 on error (see file_send_range()).
+ */
+int wire_reply_send(WireReply *r, int sockfd) {
+    const char *data;
+    size_t len;
+    int rc;
+    while ((rc = wire_reply_next(r, &data, &len)) > 0) {
+        ssize_t s = send(sockfd, data, len, MSG_NOSIGNAL);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            log_msg(LOG_ERR, "send: %s", strerror(errno));
+            return -1;
+        }
+        wire_reply_advance(r, s);
+        metrics_add(METRIC_BYTES_SENT, s);
+    }
+    return rc;
+}
+
+/* Drops the block of a reply that is complete or abandoned */
+void wire_reply_release(WireReply *r) {
+    if (r->block) {
+        block_put(r->block);
+        r->block = NULL;
+    }
+}
+
+/* Frees the cached blocks, at shutdown once no reply is left */
+void wire_cache_destroy(void) {
+    pthread_mutex_lock(&cache_mutex);
+    while (lru_tail) {
+        WireBlock *b = lru_tail;
+        if (cache_remove(b)) free(b);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
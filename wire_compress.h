@@ -0,0 +1,57 @@
+#ifndef WIRE_COMPRESS_H
+#define WIRE_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DEFAULT_COMPRESS_CACHE (16 * 1024 * 1024) // compressed reply blocks kept for later replies
+#define WIRE_HEADER_SIZE 8           // block header: 32-bit size (| WIRE_STORED), 32-bit raw size
+#define WIRE_STORED 0x80000000u      // the block is sent uncompressed, it didn't shrink
+#define WIRE_END_SIZE 4              // end mark: a block size of 0
+
+/*
+ * Compressed replies, negotiated per connection with "?compress lz4"
+ * (server_config.wire_compress, see query.h).
+ *
+ * A compressed reply is a sequence of blocks, each an 8-byte header (the
+ * block size and the raw size, 32-bit little-endian, the size with the
+ * WIRE_STORED bit set if the block is raw bytes) followed by an LZ4 block
+ * (see lz_codec.h), and ends with a 4-byte zero block size.
+ *
+ * Blocks follow the 64K grid of the store (the first and last block of a
+ * reply may be shorter), so most replies are made of the same blocks.
+ * Store bytes never change, so a compressed block is valid for good: the
+ * last server_config.compress_cache bytes of blocks are kept, and a block
+ * a compressed segment already holds is copied from it. A block is
+ * compressed once, however many clients read it.
+ */
+
+struct WireBlock;
+
+/*
+ * WireReply:
+ * Send state of one compressed reply, [off, end) of the store.
+ */
+typedef struct WireReply {
+    off_t off;                 // store offset of the next block
+    off_t end;                 // end of the reply
+    struct WireBlock *block;   // block being sent, NULL between blocks
+    size_t sent;               // bytes of 'block', or of the end mark, already sent
+    uint64_t bytes;            // bytes handed to the socket so far
+} WireReply;
+
+void wire_reply_init(WireReply *r, off_t off, off_t end);
+int wire_reply_next(WireReply *r, const char **data, size_t *len);
+void wire_reply_advance(WireReply *r, size_t n);
+int wire_reply_send(WireReply *r, int sockfd);
+void wire_reply_release(WireReply *r);
+
+void wire_cache_destroy(void);
+
+/* The end mark went out: the reply is complete */
+static inline int wire_reply_done(const WireReply *r) {
+    return !r->block && r->off >= r->end && r->sent == WIRE_END_SIZE;
+}
+
+#endif /* WIRE_COMPRESS_H */
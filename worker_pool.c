@@ -0,0 +1,174 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "worker_pool.h"
+#include "connection_handler.h"
+#include "thread_list.h"
+#include "metrics.h"
+#include "async_log.h"
+#include "admission.h"
+
+#define POOL_WAIT_MS 1000   // condition waits time out to re-check keep_running
+
+extern volatile sig_atomic_t keep_running;
+
+/*
+ * Bounded multi-producer/multi-consumer ring of accepted sockets.
+ * 'head' is the next job to pop, 'count' the number of queued jobs.
+ * Producers block on 'not_full' (backpressure: the acceptor stops calling
+ * accept() and new clients wait in the kernel listen backlog), consumers
+ * block on 'not_empty'.
+ */
+static PoolJob *queue = NULL;
+static int queue_size = 0;
+static int queue_head = 0;
+static int queue_count = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+/* Absolute CLOCK_REALTIME deadline POOL_WAIT_MS from now, for pthread_cond_timedwait() */
+static void wait_deadline(struct timespec *ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += POOL_WAIT_MS / 1000;
+    ts->tv_nsec += (POOL_WAIT_MS % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * worker_thread_func:
+ * Pops accepted sockets from the queue and serves them one at a time,
+ * until keep_running is cleared.
+ */
+static void *worker_thread_func(void *arg) {
+    int slot = (int)(intptr_t)arg; // thread slot handle
+    metrics_thread_init();
+
+    while (1) {
+        PoolJob job;
+
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_count == 0 && keep_running) {
+            struct timespec ts;
+            wait_deadline(&ts);
+            pthread_cond_timedwait(&queue_not_empty, &queue_mutex, &ts);
+        }
+        if (!keep_running) {
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+        job = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_size;
+        queue_count--;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_mutex);
+
+        handle_client(job.client_sockfd, job.ip_str, job.addr);
+    }
+
+    log_msg(LOG_INFO, "Exiting worker thread, tid: %lu", pthread_self());
+    set_thread_as_exited(slot);
+    return NULL;
+}
+
+/*
+ * worker_pool_start:
+ * Allocates the work queue and creates the worker threads.
+ * Workers are added to the global thread list, so join_all_threads()
+ * waits for them on shutdown.
+ * Returns 0 on success, or -1 on error.
+ */
+int worker_pool_start(int workers, int size) {
+    queue = (PoolJob *)calloc(size, sizeof(PoolJob));
+    if (!queue) {
+        log_msg(LOG_ERR, "PoolJob calloc: %s", strerror(errno));
+        return -1;
+    }
+    queue_size = size;
+    queue_head = 0;
+    queue_count = 0;
+
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        int slot = thread_slot_reserve();
+        if (slot < 0) {
+            break;
+        }
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, worker_thread_func, (void *)(intptr_t)slot);
+        if (rc != 0) {
+            log_msg(LOG_ERR, "pthread_create (worker): %s", strerror(rc));
+            thread_slot_cancel(slot);
+            break;
+        }
+        add_thread_to_list(slot, tid);
+        started++;
+    }
+
+    if (started == 0) {
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "Worker pool started: %d workers, queue size %d", started, size);
+    return 0;
+}
+
+/*
+ * worker_pool_submit:
+ * Queues an accepted socket for the next free worker.
+ * Blocks while the queue is full.
+ * Returns 0 on success, or -1 if the server is stopping (socket not queued).
+ */
+int worker_pool_submit(int client_sockfd, const char *ip_str, in_addr_t addr) {
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_count == queue_size && keep_running) {
+        struct timespec ts;
+        wait_deadline(&ts);
+        pthread_cond_timedwait(&queue_not_full, &queue_mutex, &ts);
+    }
+    if (!keep_running) {
+        pthread_mutex_unlock(&queue_mutex);
+        return -1;
+    }
+
+    PoolJob *job = &queue[(queue_head + queue_count) % queue_size];
+    job->client_sockfd = client_sockfd;
+    snprintf(job->ip_str, sizeof(job->ip_str), "%s", ip_str);
+    job->addr = addr;
+    queue_count++;
+
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+}
+
+/*
+ * worker_pool_destroy:
+ * Closes sockets left in the queue and frees it.
+ * Must be called after the workers were joined.
+ */
+void worker_pool_destroy(void) {
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_count > 0) {
+        close(queue[queue_head].client_sockfd);
+        admission_release(queue[queue_head].addr);
+        metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+        queue_head = (queue_head + 1) % queue_size;
+        queue_count--;
+    }
+    free(queue);
+    queue = NULL;
+    queue_size = 0;
+    pthread_mutex_unlock(&queue_mutex);
+}
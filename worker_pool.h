@@ -0,0 +1,24 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <netinet/in.h>
+
+#define DEFAULT_POOL_WORKERS 16    // worker threads in IO_MODE_POOL
+#define DEFAULT_POOL_QUEUE   256   // accepted sockets waiting for a free worker
+
+/*
+ * PoolJob:
+ * An accepted connection waiting in the work queue.
+ * Stored by value in the queue ring, so submitting never allocates.
+ */
+typedef struct PoolJob {
+    int client_sockfd;
+    char ip_str[INET_ADDRSTRLEN];
+    in_addr_t addr;
+} PoolJob;
+
+int worker_pool_start(int workers, int queue_size);
+int worker_pool_submit(int client_sockfd, const char *ip_str, in_addr_t addr);
+void worker_pool_destroy(void);
+
+#endif /* WORKER_POOL_H */